@@ -0,0 +1,111 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Decompression throughput of a bzip2 file (a file list, say) with UnBZFilter on one thread and
+ * with BZBlockReader, then with several BZBlockReaders at once the way lists opened together
+ * are read. The output of both is compared; only the first stream of a file made of several
+ * is read by UnBZFilter, so use a single stream.
+ *
+ * usage: bzlist-bench file.bz2 [readers at once]
+ */
+
+#include "dcpp/stdinc.h"
+#include "dcpp/BZUtils.h"
+#include "dcpp/File.h"
+#include "dcpp/FilteredFile.h"
+
+#include <chrono>
+#include <thread>
+
+using namespace dcpp;
+using std::chrono::steady_clock;
+
+namespace {
+
+/** @return Bytes read and the crc of them, so that the output needn't be kept */
+pair<int64_t, uint32_t> drain(InputStream& is) {
+    vector<char> buf(256 * 1024);
+    int64_t total = 0;
+    uint32_t crc = 0;
+    for(;;) {
+        size_t n = buf.size();
+        n = is.read(&buf[0], n);
+        if(n == 0)
+            break;
+        for(size_t i = 0; i < n; ++i)
+            crc = (crc << 5) + crc + static_cast<uint8_t>(buf[i]);
+        total += n;
+    }
+    return make_pair(total, crc);
+}
+
+pair<int64_t, uint32_t> single(const string& path) {
+    File f(path, File::READ, File::OPEN);
+    FilteredInputStream<UnBZFilter, false> is(&f);
+    return drain(is);
+}
+
+pair<int64_t, uint32_t> blocks(const string& path) {
+    File f(path, File::READ, File::OPEN);
+    BZBlockReader is(&f);
+    return drain(is);
+}
+
+double seconds(steady_clock::time_point start) {
+    return std::chrono::duration<double>(steady_clock::now() - start).count();
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    if(argc < 2) {
+        printf("usage: %s file.bz2 [readers at once]\n", argv[0]);
+        return 2;
+    }
+    const string path = argv[1];
+    const size_t readers = argc > 2 ? max(atoi(argv[2]), 1) : 4;
+
+    try {
+        auto start = steady_clock::now();
+        const auto one = single(path);
+        const double ts = seconds(start);
+        printf("%-17s%8.1f MB/s\n", "UnBZFilter:", one.first / ts / (1024 * 1024));
+
+        start = steady_clock::now();
+        const auto many = blocks(path);
+        const double tb = seconds(start);
+        printf("%-17s%8.1f MB/s (%.2fx, %u cores)\n", "BZBlockReader:", many.first / tb / (1024 * 1024), ts / tb,
+            std::thread::hardware_concurrency());
+
+        if(one != many) {
+            printf("outputs differ\n");
+            return 1;
+        }
+
+        vector<std::thread> threads;
+        start = steady_clock::now();
+        for(size_t i = 0; i < readers; ++i)
+            threads.emplace_back([&] { blocks(path); });
+        for(auto& t: threads)
+            t.join();
+        printf("%-17s%8.1f MB/s in all\n", (std::to_string(readers) + " readers:").c_str(), readers * many.first / seconds(start) / (1024 * 1024));
+    } catch(const Exception& e) {
+        printf("%s\n", e.getError().c_str());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Speaker::fire() throughput with 1, 8 and 64 listeners on 1 to 4 threads, and what
+ * removeListener() costs while another thread is inside a slow listener.
+ *
+ * usage: speaker-bench [seconds per run]
+ */
+
+#include "dcpp/stdinc.h"
+#include "dcpp/Speaker.h"
+
+#include <chrono>
+#include <thread>
+#include <time.h>
+
+using namespace dcpp;
+using std::chrono::steady_clock;
+
+namespace {
+
+struct Event { };
+
+class Listener {
+public:
+    virtual ~Listener() { }
+    virtual void on(Event, int) noexcept = 0;
+};
+
+class Counter : public Listener {
+public:
+    Counter() : count(0) { }
+    void on(Event, int n) noexcept { count += n; }
+    std::atomic<uint64_t> count;
+};
+
+class Sleeper : public Listener {
+public:
+    void on(Event, int ms) noexcept { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); }
+};
+
+class Bench : public Speaker<Listener> {
+public:
+    using Speaker<Listener>::fire;
+};
+
+double seconds(steady_clock::time_point start) {
+    return std::chrono::duration<double>(steady_clock::now() - start).count();
+}
+
+double threadCpu() {
+    timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void fireRate(size_t listeners, size_t threads, double duration) {
+    Bench speaker;
+    vector<Counter> counters(listeners);
+    for(auto& c: counters)
+        speaker.addListener(&c);
+
+    std::atomic<bool> stop(false);
+    std::atomic<uint64_t> fired(0);
+    vector<std::thread> workers;
+    const auto start = steady_clock::now();
+    for(size_t i = 0; i < threads; ++i) {
+        workers.emplace_back([&] {
+            uint64_t n = 0;
+            while(!stop.load(std::memory_order_relaxed)) {
+                for(int k = 0; k < 1000; ++k)
+                    speaker.fire(Event(), 1);
+                n += 1000;
+            }
+            fired += n;
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(duration));
+    stop = true;
+    for(auto& t: workers)
+        t.join();
+
+    printf("%3zu listeners, %zu threads: %8.2f Mfire/s\n", listeners, threads, fired / seconds(start) / 1e6);
+}
+
+void removeCost() {
+    Bench speaker;
+    Sleeper slow;
+    Counter other;
+    speaker.addListener(&slow);
+    speaker.addListener(&other);
+
+    // another thread sits in the slow listener while this one removes the other listener
+    std::thread firing([&] { speaker.fire(Event(), 500); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    const auto start = steady_clock::now();
+    const double cpu = threadCpu();
+    speaker.removeListener(&other);
+    printf("removeListener() during a 500 ms listener: %.0f ms wall, %.1f ms cpu\n",
+        seconds(start) * 1000, (threadCpu() - cpu) * 1000);
+    firing.join();
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    const double duration = argc > 1 ? atof(argv[1]) : 1.0;
+
+    const size_t listeners[] = { 1, 8, 64 };
+    const size_t threads[] = { 1, 2, 4 };
+    for(auto l: listeners) {
+        for(auto t: threads)
+            fireRate(l, t, duration);
+    }
+    removeCost();
+    return 0;
+}
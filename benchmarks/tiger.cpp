@@ -0,0 +1,85 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * TigerHash::hashLeaves() throughput in MB/s for each kernel this CPU can run, on the same
+ * pseudo-random 64 MiB every time, hashed as 1 KiB and 64 KiB leaves. Also checks that the
+ * kernels agree.
+ *
+ * usage: tiger-bench [rounds]
+ */
+
+#include "dcpp/stdinc.h"
+#include "dcpp/TigerHash.h"
+
+#include <chrono>
+
+using namespace dcpp;
+using std::chrono::steady_clock;
+
+namespace {
+
+const char* kernelName(TigerHash::Kernel k) {
+    return k == TigerHash::KERNEL_AVX2 ? "avx2" : "scalar";
+}
+
+double leafRate(const vector<uint8_t>& data, size_t len, TigerHash::Kernel k, int rounds, vector<uint8_t>& out) {
+    const size_t count = data.size() / len;
+    out.resize(count * TigerHash::BYTES);
+
+    double best = 0;
+    for(int i = 0; i < rounds; ++i) {
+        const auto start = steady_clock::now();
+        TigerHash::hashLeaves(&data[0], len, count, &out[0], k);
+        const double s = std::chrono::duration<double>(steady_clock::now() - start).count();
+        best = max(best, data.size() / s / (1024 * 1024));
+    }
+    return best;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    const int rounds = argc > 1 ? max(atoi(argv[1]), 1) : 5;
+
+    vector<uint8_t> data(64 << 20);
+    uint32_t seed = 1;
+    for(auto& c: data)
+        c = static_cast<uint8_t>((seed = seed * 1103515245 + 12345) >> 16);
+
+    const TigerHash::Kernel kernels[] = { TigerHash::KERNEL_SCALAR, TigerHash::KERNEL_AVX2 };
+    const size_t lens[] = { 1024, 64 * 1024 };
+    bool same = true;
+    for(auto len: lens) {
+        vector<uint8_t> reference, out;
+        for(auto k: kernels) {
+            if(!TigerHash::hasKernel(k)) {
+                printf("%6s, %2zu KiB leaves: not available\n", kernelName(k), len / 1024);
+                continue;
+            }
+            printf("%6s, %2zu KiB leaves: %8.1f MB/s\n", kernelName(k), len / 1024, leafRate(data, len, k, rounds, out));
+            if(reference.empty())
+                reference = out;
+            else if(out != reference)
+                same = false;
+        }
+    }
+    if(!same) {
+        printf("kernels disagree\n");
+        return 1;
+    }
+    return 0;
+}
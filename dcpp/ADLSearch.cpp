@@ -51,6 +51,7 @@ bUseRegexp(false)
 
 void ADLSearch::Prepare(StringMap& params) {
     // Prepare quick search of substrings
+    stringSearches = MultiStringSearch();
     stringSearchList.clear();
     #ifdef USE_PCRE
     if(searchString.find("$Re:") == 0){
@@ -65,11 +66,12 @@ void ADLSearch::Prepare(StringMap& params) {
         // Split into substrings
         StringTokenizer<string> st(stringParams, ' ');
         for(StringIter i = st.getTokens().begin(); i != st.getTokens().end(); ++i) {
-            if(!i->empty()) {
+            if(!i->empty() && !stringSearches.add(*i)) {
                 // Add substring search
                 stringSearchList.push_back(StringSearch(*i));
             }
         }
+        stringSearches.prepare();
     #ifdef USE_PCRE
     }
     #endif
@@ -128,7 +130,7 @@ int64_t ADLSearch::GetSizeBase() {
     }
 }
 
-bool ADLSearch::MatchesFile(const string& f, const string& fp, int64_t size) {
+bool ADLSearch::MatchesFile(const string& f, const string& lf, const string& fp, const string& lfp, int64_t size) {
     // Check status
     if(!isActive) {
         return false;
@@ -150,11 +152,11 @@ bool ADLSearch::MatchesFile(const string& f, const string& fp, int64_t size) {
     switch(sourceType) {
     default:
     case OnlyDirectory: return false;
-    case OnlyFile:      return SearchAll(f);
-    case FullPath:      return SearchAll(fp);
+    case OnlyFile:      return SearchAll(f, lf);
+    case FullPath:      return SearchAll(fp, lfp);
     }
 }
-bool ADLSearch::MatchesDirectory(const string& d) {
+bool ADLSearch::MatchesDirectory(const string& d, const string& ld) {
     // Check status
     if(!isActive) {
         return false;
@@ -164,10 +166,13 @@ bool ADLSearch::MatchesDirectory(const string& d) {
     }
 
     // Do search
-    return SearchAll(d);
+    return SearchAll(d, ld);
 }
 
-bool ADLSearch::SearchAll(const string& s) {
+bool ADLSearch::SearchAll(const string& s, const string& ls) {
+    #ifndef USE_PCRE
+    (void)s;
+    #endif
     #ifdef USE_PCRE
     if(bUseRegexp){
         pcrecpp::RE_Options options;
@@ -181,12 +186,15 @@ bool ADLSearch::SearchAll(const string& s) {
     } else {
     #endif
     // Match all substrings
+        if(stringSearches.empty() || !stringSearches.matchAll(ls)) {
+            return false;
+        }
         for(StringSearch::List::iterator i = stringSearchList.begin(); i != stringSearchList.end(); ++i) {
-            if(!i->match(s)) {
+            if(!i->matchLower(ls)) {
                 return false;
             }
         }
-        return !stringSearchList.empty();
+        return true;
     #ifdef USE_PCRE
     }
     #endif
@@ -323,11 +331,11 @@ void ADLSearchManager::Save()
     }
 }
 
-void ADLSearchManager::MatchesFile(DestDirList& destDirVector, DirectoryListing::File *currentFile, string& fullPath) {
+void ADLSearchManager::MatchesFile(DirectoryListing& aDirList, DestDirList& destDirVector, DirectoryListing::File *currentFile, string& fullPath, string& lowerPath) {
     // Add to any substructure being stored
     for(auto id = destDirVector.begin(); id != destDirVector.end(); ++id) {
         if(id->subdir != NULL) {
-            DirectoryListing::File *copyFile = new DirectoryListing::File(*currentFile, true);
+            DirectoryListing::File *copyFile = aDirList.copyFile(*currentFile, true);
             dcassert(id->subdir->getAdls());
 
             id->subdir->files.push_back(copyFile);
@@ -341,13 +349,16 @@ void ADLSearchManager::MatchesFile(DestDirList& destDirVector, DirectoryListing:
     }
 
     string filePath = fullPath + "\\" + currentFile->getName();
+    // Lower cased once here rather than by each search
+    const string lowerName = Text::toLower(currentFile->getName());
+    const string lowerFilePath = lowerPath + "\\" + lowerName;
     // Match searches
     for(auto is = collection.begin(); is != collection.end(); ++is) {
         if(destDirVector[is->ddIndex].fileAdded) {
             continue;
         }
-        if(is->MatchesFile(currentFile->getName(), filePath, currentFile->getSize())) {
-            DirectoryListing::File *copyFile = new DirectoryListing::File(*currentFile, true);
+        if(is->MatchesFile(currentFile->getName(), lowerName, filePath, lowerFilePath, currentFile->getSize())) {
+            DirectoryListing::File *copyFile = aDirList.copyFile(*currentFile, true);
             destDirVector[is->ddIndex].dir->files.push_back(copyFile);
             destDirVector[is->ddIndex].fileAdded = true;
 
@@ -366,7 +377,7 @@ void ADLSearchManager::MatchesFile(DestDirList& destDirVector, DirectoryListing:
     }
 }
 
-void ADLSearchManager::MatchesDirectory(DestDirList& destDirVector, DirectoryListing::Directory* currentDir, string& fullPath) {
+void ADLSearchManager::MatchesDirectory(DestDirList& destDirVector, DirectoryListing::Directory* currentDir, const string& lowerName, string& fullPath) {
     // Add to any substructure being stored
     for(auto id = destDirVector.begin(); id != destDirVector.end(); ++id) {
         if(id->subdir != NULL) {
@@ -387,7 +398,7 @@ void ADLSearchManager::MatchesDirectory(DestDirList& destDirVector, DirectoryLis
         if(destDirVector[is->ddIndex].subdir != NULL) {
             continue;
         }
-        if(is->MatchesDirectory(currentDir->getName())) {
+        if(is->MatchesDirectory(currentDir->getName(), lowerName)) {
             destDirVector[is->ddIndex].subdir =
                 new DirectoryListing::AdlDirectory(fullPath, destDirVector[is->ddIndex].dir, currentDir->getName());
             destDirVector[is->ddIndex].dir->directories.push_back(destDirVector[is->ddIndex].subdir);
@@ -456,19 +467,22 @@ void ADLSearchManager::matchListing(DirectoryListing& aDirList) noexcept {
     setBreakOnFirst(BOOLSETTING(ADLS_BREAK_ON_FIRST));
 
     string path(aDirList.getRoot()->getName());
-    matchRecurse(destDirs, aDirList.getRoot(), path);
+    string lowerPath(Text::toLower(path));
+    matchRecurse(aDirList, destDirs, aDirList.getRoot(), path, lowerPath);
 
     FinalizeDestinationDirectories(destDirs, aDirList.getRoot());
 }
 
-void ADLSearchManager::matchRecurse(DestDirList &aDestList, DirectoryListing::Directory* aDir, string &aPath) {
+void ADLSearchManager::matchRecurse(DirectoryListing& aDirList, DestDirList &aDestList, DirectoryListing::Directory* aDir, string &aPath, string &aLowerPath) {
     for(DirectoryListing::Directory::Iter dirIt = aDir->directories.begin(); dirIt != aDir->directories.end(); ++dirIt) {
+        const string lowerName = Text::toLower((*dirIt)->getName());
         string tmpPath = aPath + "\\" + (*dirIt)->getName();
-        MatchesDirectory(aDestList, *dirIt, tmpPath);
-        matchRecurse(aDestList, *dirIt, tmpPath);
+        string tmpLowerPath = aLowerPath + "\\" + lowerName;
+        MatchesDirectory(aDestList, *dirIt, lowerName, tmpPath);
+        matchRecurse(aDirList, aDestList, *dirIt, tmpPath, tmpLowerPath);
     }
     for(DirectoryListing::File::Iter fileIt = aDir->files.begin(); fileIt != aDir->files.end(); ++fileIt) {
-        MatchesFile(aDestList, *fileIt, aPath);
+        MatchesFile(aDirList, aDestList, *fileIt, aPath, aLowerPath);
     }
     StepUpDirectory(aDestList);
 }
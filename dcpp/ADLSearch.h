@@ -26,6 +26,7 @@
 #include "Util.h"
 #include "SettingsManager.h"
 #include "StringSearch.h"
+#include "MultiStringSearch.h"
 #include "Singleton.h"
 #include "DirectoryListing.h"
 
@@ -79,10 +80,10 @@ public:
     // Name of the destination directory (empty = 'ADLSearch') and its index
     string destDir;
     unsigned long ddIndex;
-    // Search for file match
-    bool MatchesFile(const string& f, const string& fp, int64_t size);
+    // Search for file match; the l* names are the same in lower case
+    bool MatchesFile(const string& f, const string& lf, const string& fp, const string& lfp, int64_t size);
     // Search for directory match
-    bool MatchesDirectory(const string& d);
+    bool MatchesDirectory(const string& d, const string& ld);
 
 private:
     friend class ADLSearchManager;
@@ -90,8 +91,10 @@ private:
     bool bUseRegexp;
     string regexpstring;
     // Substring searches
+    MultiStringSearch stringSearches;
+    // Substrings that didn't fit in stringSearches
     StringSearch::List stringSearchList;
-    bool SearchAll(const string& s);
+    bool SearchAll(const string& s, const string& ls);
 };
 
 ///  Class that holds all active searches
@@ -129,11 +132,11 @@ public:
 
 private:
     // @internal
-    void matchRecurse(DestDirList& /*aDestList*/, DirectoryListing::Directory* /*aDir*/, string& /*aPath*/);
+    void matchRecurse(DirectoryListing& /*aDirList*/, DestDirList& /*aDestList*/, DirectoryListing::Directory* /*aDir*/, string& /*aPath*/, string& /*aLowerPath*/);
     // Search for file match
-    void MatchesFile(DestDirList& destDirVector, DirectoryListing::File *currentFile, string& fullPath);
+    void MatchesFile(DirectoryListing& aDirList, DestDirList& destDirVector, DirectoryListing::File *currentFile, string& fullPath, string& lowerPath);
     // Search for directory match
-    void MatchesDirectory(DestDirList& destDirVector, DirectoryListing::Directory* currentDir, string& fullPath);
+    void MatchesDirectory(DestDirList& destDirVector, DirectoryListing::Directory* currentDir, const string& lowerName, string& fullPath);
     // Step up directory
     void StepUpDirectory(DestDirList& destDirVector);
     // Prepare destination directory indexing
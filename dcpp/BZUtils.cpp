@@ -20,11 +20,15 @@
 
 #include "BZUtils.h"
 #include "Exception.h"
+#include "Streams.h"
 #include "format.h"
 
+#include <thread>
+
 namespace dcpp {
 
 using std::max;
+using std::min;
 
 BZFilter::BZFilter() {
     memset(&zs, 0, sizeof(zs));
@@ -67,6 +71,403 @@ bool BZFilter::operator()(const void* in, size_t& insize, void* out, size_t& out
     }
 }
 
+// Stream header, and the bit patterns starting a block and the end of stream marker
+static const char BZ_HEADER[] = "BZh9";
+static const uint64_t BZ_BLOCK_MAGIC = 0x314159265359ULL;
+static const uint64_t BZ_END_MAGIC = 0x177245385090ULL;
+
+static uint64_t getBits(const string& data, size_t pos, int n) {
+    uint64_t ret = 0;
+    for(int i = 0; i < n; ++i, ++pos)
+        ret = (ret << 1) | ((static_cast<uint8_t>(data[pos / 8]) >> (7 - pos % 8)) & 1);
+    return ret;
+}
+
+const size_t BZBlockWriter::MAX_BLOCK_INPUT;
+
+string BZBlockWriter::compress(const void* in, size_t insize) {
+    dcassert(insize <= MAX_BLOCK_INPUT);
+
+    string out(insize + insize / 100 + 600, 0);
+    unsigned int outsize = out.size();
+    if(BZ2_bzBuffToBuffCompress(&out[0], &outsize, (char*)in, insize, 9, 0, 30) != BZ_OK)
+        throw Exception(_("Error during compression"));
+    out.resize(outsize);
+    return out;
+}
+
+BZBlockWriter::BZBlockWriter(OutputStream* aStream) : s(aStream), buf(BZ_HEADER), bitBuf(0), bitCount(0), crc(0) {
+}
+
+void BZBlockWriter::append(const string& aStream) {
+    // header, block magic, block crc ... end of stream magic, stream crc, up to 7 bits of padding
+    if(aStream.size() < 4 + 6 + 4 + 6 + 4 || aStream.compare(0, 4, BZ_HEADER) != 0 ||
+        getBits(aStream, 32, 48) != BZ_BLOCK_MAGIC)
+    {
+        throw Exception(_("Error during compression"));
+    }
+
+    // the stream crc of a single block stream is the crc of that block
+    uint32_t blockCrc = getBits(aStream, 80, 32);
+    size_t end = aStream.size() * 8 - 80;
+    for(int pad = 0; ; ++pad, --end) {
+        if(pad == 8)
+            throw Exception(_("Error during compression"));
+        if(getBits(aStream, end, 48) == BZ_END_MAGIC && getBits(aStream, end + 48, 32) == blockCrc)
+            break;
+    }
+
+    size_t bytes = end / 8;
+    for(size_t i = 4; i < bytes; ++i)
+        putBits(static_cast<uint8_t>(aStream[i]), 8);
+    if(end % 8)
+        putBits(static_cast<uint8_t>(aStream[bytes]) >> (8 - end % 8), end % 8);
+
+    crc = ((crc << 1) | (crc >> 31)) ^ blockCrc;
+
+    // whole chunks only, as a tree hashing the output wants its blocks whole
+    const size_t chunk = 64 * 1024;
+    if(buf.size() >= chunk) {
+        size_t n = buf.size() - buf.size() % chunk;
+        s->write(buf.data(), n);
+        buf.erase(0, n);
+    }
+}
+
+void BZBlockWriter::finish() {
+    putBits(static_cast<uint32_t>(BZ_END_MAGIC >> 24), 24);
+    putBits(static_cast<uint32_t>(BZ_END_MAGIC & 0xffffff), 24);
+    putBits(crc, 32);
+    if(bitCount > 0)
+        putBits(0, 8 - bitCount);
+
+    s->write(buf);
+    buf.clear();
+    s->flush();
+}
+
+void BZBlockWriter::putBits(uint32_t bits, int n) {
+    bitBuf = (bitBuf << n) | bits;
+    bitCount += n;
+    while(bitCount >= 8) {
+        bitCount -= 8;
+        buf += static_cast<char>(bitBuf >> bitCount);
+    }
+}
+
+/** Append n bits of from, the first at bit start, to the toBits bits of to */
+static void appendBits(string& to, uint64_t& toBits, const string& from, uint64_t start, uint64_t n) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(from.data()) + start / 8;
+    const size_t size = from.size() - start / 8;
+    const int shift = start % 8;
+    // every byte but the last adds 8 bits, so the bits used in the last byte of to stay the same
+    const int used = toBits % 8;
+
+    for(size_t i = 0; n > 0; ++i) {
+        uint8_t v = p[i] << shift;
+        if(shift && i + 1 < size)
+            v |= p[i + 1] >> (8 - shift);
+        const int bits = n < 8 ? static_cast<int>(n) : 8;
+        v &= 0xff << (8 - bits);
+
+        if(used == 0) {
+            to += static_cast<char>(v);
+        } else {
+            to[to.size() - 1] |= v >> used;
+            if(bits > 8 - used)
+                to += static_cast<char>(v << (8 - used));
+        }
+        toBits += bits;
+        n -= bits;
+    }
+}
+
+namespace {
+const uint64_t NO_BLOCK = UINT64_MAX;
+const uint64_t MAGIC_MASK = 0xffffffffffffULL;
+/** Input needed past a magic to tell what it is: the stream crc, padding and the next stream's start */
+const uint64_t LOOKAHEAD = 128;
+const size_t READ_SIZE = 256 * 1024;
+/** Merges tried on a block that fails before it is taken to be corrupt; false starts are rare */
+const int MAX_REPAIRS = 2;
+}
+
+BZBlockReader::BZBlockReader(InputStream* aStream) : s(aStream), pos(0), last(0), lastCount(0), blockStart(NO_BLOCK),
+    streamCrc(0), level(0), stream(0), inStream(false), eof(false), done(false), inRead(0), outPos(0),
+    stopping(std::make_shared<std::atomic<bool>>(false)), pool(getPool())
+{
+}
+
+BZBlockReader::~BZBlockReader() {
+    // the blocks still queued hold on to what they need; they're skipped, not waited for
+    *stopping = true;
+}
+
+FastCriticalSection BZBlockReader::poolCs;
+std::weak_ptr<ThreadPool> BZBlockReader::sharedPool;
+
+std::shared_ptr<ThreadPool> BZBlockReader::getPool() {
+    FastLock l(poolCs);
+    auto p = sharedPool.lock();
+    if(!p) {
+        p = std::make_shared<ThreadPool>("BZReader", max(1u, std::thread::hardware_concurrency()));
+        sharedPool = p;
+    }
+    return p;
+}
+
+size_t BZBlockReader::read(void* buf, size_t& len) {
+    uint8_t* p = static_cast<uint8_t*>(buf);
+    size_t produced = 0;
+    inRead = 0;
+
+    while(produced < len) {
+        // a couple of blocks per thread keep the pool busy while the first ones are read
+        while(blocks.size() < pool->size() * 2 && split()) { }
+        if(blocks.empty())
+            break;
+
+        Block& b = *blocks.front();
+        if(!b.waited) {
+            b.ready.wait();
+            b.waited = true;
+            if(!b.ok)
+                repair();
+        }
+
+        size_t n = min(len - produced, b.out.size() - outPos);
+        memcpy(p + produced, b.out.data() + outPos, n);
+        produced += n;
+        outPos += n;
+        if(outPos == b.out.size()) {
+            blocks.pop_front();
+            outPos = 0;
+        }
+    }
+
+    len = inRead;
+    return produced;
+}
+
+bool BZBlockReader::split() {
+    while(!done) {
+        if(!inStream) {
+            // a stream starts at a byte boundary with its header and a block or the end of the stream
+            while(in.size() < pos / 8 + 10 && fill()) { }
+            if(pos / 8 >= in.size() || !isStreamStart(pos / 8)) {
+                if(stream == 0)
+                    throw Exception(_("Error during decompression"));
+                // whatever follows the last stream is ignored, as bzip2 does
+                done = true;
+                break;
+            }
+
+            level = in[pos / 8 + 3];
+            ++stream;
+            streamCrc = 0;
+            inStream = true;
+            pos += 32;
+            last = 0;
+            lastCount = 0;
+            blockStart = NO_BLOCK;
+            if(getBits(in, pos, 48) == BZ_BLOCK_MAGIC) {
+                blockStart = pos;
+                pos += 48;
+            }
+            continue;
+        }
+
+        const uint64_t avail = in.size() * 8;
+        if(pos + 8 + LOOKAHEAD > avail && !eof) {
+            fill();
+            continue;
+        }
+        if(pos >= avail)
+            throw Exception(_("Error during decompression"));
+
+        // whole bytes at a time while no magic ends in them
+        if(pos % 8 == 0 && lastCount >= 48) {
+            const uint64_t next = (last << 8) | static_cast<uint8_t>(in[pos / 8]);
+            bool magic = false;
+            for(int k = 7; k >= 0 && !magic; --k) {
+                const uint64_t v = (next >> k) & MAGIC_MASK;
+                magic = v == BZ_BLOCK_MAGIC || v == BZ_END_MAGIC;
+            }
+            if(!magic) {
+                last = next;
+                pos += 8;
+                continue;
+            }
+        }
+
+        if(scanBit())
+            return true;
+    }
+    return false;
+}
+
+bool BZBlockReader::fill() {
+    if(eof)
+        return false;
+
+    const size_t old = in.size();
+    in.resize(old + READ_SIZE);
+    size_t len = READ_SIZE;
+    const size_t n = s->read(&in[old], len);
+    in.resize(old + n);
+    inRead += len;
+
+    if(n == 0)
+        eof = true;
+    return n > 0;
+}
+
+bool BZBlockReader::scanBit() {
+    last = (last << 1) | ((static_cast<uint8_t>(in[pos / 8]) >> (7 - pos % 8)) & 1);
+    ++pos;
+    if(lastCount < 64)
+        ++lastCount;
+    if(lastCount < 48)
+        return false;
+
+    const uint64_t magic = last & MAGIC_MASK;
+    if(magic == BZ_BLOCK_MAGIC) {
+        const uint64_t start = pos - 48;
+        const bool ret = blockStart != NO_BLOCK;
+        if(ret)
+            cut(start);
+        blockStart = start;
+
+        // only the block being scanned is kept
+        const size_t drop = blockStart / 8;
+        in.erase(0, drop);
+        pos -= drop * 8;
+        blockStart -= drop * 8;
+        return ret;
+    }
+
+    if(magic == BZ_END_MAGIC) {
+        const uint64_t end = pos - 48;
+        uint32_t crc = streamCrc;
+        if(blockStart != NO_BLOCK && blockStart + 80 <= end)
+            crc = ((crc << 1) | (crc >> 31)) ^ static_cast<uint32_t>(getBits(in, blockStart + 48, 32));
+
+        // the magic may just as well be in the data of a block; the real end is followed by the
+        // crc of the stream, or at least by another stream or the end of the input
+        const uint64_t avail = in.size() * 8;
+        const uint64_t next = (pos + 32 + 7) / 8 * 8;
+        const bool real = (pos + 32 <= avail && getBits(in, pos, 32) == crc) ||
+            (eof && next >= avail) || isStreamStart(next / 8);
+        if(!real)
+            return false;
+
+        const bool ret = blockStart != NO_BLOCK;
+        if(ret)
+            cut(end);
+        blockStart = NO_BLOCK;
+        inStream = false;
+
+        const size_t drop = min(next / 8, static_cast<uint64_t>(in.size()));
+        in.erase(0, drop);
+        pos = next - drop * 8;
+        return ret;
+    }
+
+    return false;
+}
+
+void BZBlockReader::cut(uint64_t end) {
+    BlockPtr b = std::make_shared<Block>();
+    b->bitCount = 0;
+    b->level = level;
+    b->stream = stream;
+    b->ok = false;
+    b->waited = false;
+    b->bits.reserve((end - blockStart) / 8 + 1);
+    appendBits(b->bits, b->bitCount, in, blockStart, end - blockStart);
+
+    if(b->bitCount >= 80)
+        streamCrc = ((streamCrc << 1) | (streamCrc >> 31)) ^ static_cast<uint32_t>(getBits(b->bits, 48, 32));
+
+    blocks.push_back(b);
+    auto stop = stopping;
+    pool->add([stop, b] {
+        if(!*stop)
+            b->ok = decode(*b);
+        b->ready.signal();
+    });
+}
+
+bool BZBlockReader::isStreamStart(uint64_t bytePos) {
+    if(in.size() < bytePos + 10 || in.compare(bytePos, 3, BZ_HEADER, 3) != 0 || in[bytePos + 3] < '1' || in[bytePos + 3] > '9')
+        return false;
+    const uint64_t magic = getBits(in, (bytePos + 4) * 8, 48);
+    return magic == BZ_BLOCK_MAGIC || magic == BZ_END_MAGIC;
+}
+
+void BZBlockReader::repair() {
+    // a piece cut off at a false start fails too; the two together make the real block
+    BlockPtr first = blocks.front();
+    for(int n = 0; !first->ok; ++n) {
+        if(n == MAX_REPAIRS || (blocks.size() < 2 && !split()))
+            throw Exception(_("Error during decompression"));
+
+        BlockPtr next = blocks[1];
+        if(next->stream != first->stream)
+            throw Exception(_("Error during decompression"));
+
+        appendBits(first->bits, first->bitCount, next->bits, 0, next->bitCount);
+        blocks.erase(blocks.begin() + 1);
+        first->ok = decode(*first);
+    }
+}
+
+bool BZBlockReader::decode(Block& b) noexcept {
+    if(b.bitCount < 80)
+        return false;
+
+    // the block as a stream of its own, whose crc is that of the block
+    string data(BZ_HEADER, 3);
+    data += b.level;
+    uint64_t bits = 32;
+    data.reserve(b.bits.size() + 16);
+    appendBits(data, bits, b.bits, 0, b.bitCount);
+
+    string end(10, 0);
+    const uint64_t trailer[2] = { BZ_END_MAGIC, getBits(b.bits, 48, 32) };
+    for(int i = 0; i < 6; ++i)
+        end[i] = static_cast<char>(trailer[0] >> (40 - i * 8));
+    for(int i = 0; i < 4; ++i)
+        end[6 + i] = static_cast<char>(trailer[1] >> (24 - i * 8));
+    appendBits(data, bits, end, 0, 80);
+
+    bz_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if(BZ2_bzDecompressInit(&zs, 0, 0) != BZ_OK)
+        return false;
+
+    zs.next_in = &data[0];
+    zs.avail_in = data.size();
+
+    // a block holds up to its level times 100k before the first run length encoding
+    b.out.resize((b.level - '0') * 100000 + 64 * 1024);
+    size_t done = 0;
+    int err;
+    for(;;) {
+        zs.next_out = &b.out[done];
+        zs.avail_out = b.out.size() - done;
+        err = BZ2_bzDecompress(&zs);
+        done = b.out.size() - zs.avail_out;
+        if(err != BZ_OK || zs.avail_out > 0)
+            break;
+        b.out.resize(b.out.size() * 2);
+    }
+    BZ2_bzDecompressEnd(&zs);
+
+    b.out.resize(done);
+    return err == BZ_STREAM_END;
+}
+
 UnBZFilter::UnBZFilter() {
     memset(&zs, 0, sizeof(zs));
 
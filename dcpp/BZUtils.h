@@ -18,10 +18,18 @@
 
 #pragma once
 
+#include <atomic>
+#include <memory>
+
 #include <bzlib.h>
 
+#include "Streams.h"
+#include "ThreadPool.h"
+
 namespace dcpp {
 
+class OutputStream;
+
 class BZFilter {
 public:
     BZFilter();
@@ -39,6 +47,112 @@ private:
     bz_stream zs;
 };
 
+/**
+ * Writes a bzip2 stream made of blocks compressed independently of each other, so they can be
+ * compressed on several threads. The blocks are spliced into one stream rather than written as
+ * concatenated streams, since readers like UnBZFilter stop at the end of the first stream.
+ */
+class BZBlockWriter {
+public:
+    /** Input that compresses to exactly one block even at the worst run length expansion */
+    static const size_t MAX_BLOCK_INPUT = 700000;
+
+    /**
+     * Compress up to MAX_BLOCK_INPUT bytes into a stream of one block, to be passed to append();
+     * may be called from any thread.
+     */
+    static string compress(const void* in, size_t insize);
+
+    BZBlockWriter(OutputStream* aStream);
+
+    /** Add the block of a stream made by compress() */
+    void append(const string& aStream);
+    /** Write the end of the stream */
+    void finish();
+private:
+    void putBits(uint32_t bits, int n);
+
+    OutputStream* s;
+    string buf;
+    uint64_t bitBuf;
+    int bitCount;
+    uint32_t crc;
+};
+
+/**
+ * Reads bzip2 data decompressed on several threads. The input is cut where its blocks start,
+ * each block is made into a stream of its own and decompressed on a pool, and the output comes
+ * back in order. Unlike UnBZFilter, concatenated streams are read one after the other. The readers
+ * alive at the same time share one pool with a thread per core.
+ */
+class BZBlockReader : public InputStream {
+public:
+    /** @param aStream The compressed data, which stays owned by the caller */
+    BZBlockReader(InputStream* aStream);
+    virtual ~BZBlockReader();
+
+    virtual size_t read(void* buf, size_t& len);
+
+private:
+    struct Block {
+        /** The bits of the block from its magic on, starting at the first byte */
+        string bits;
+        uint64_t bitCount;
+        char level;
+        /** Number of the stream the block is in */
+        int stream;
+
+        string out;
+        bool ok;
+        bool waited;
+        Semaphore ready;
+    };
+    typedef std::shared_ptr<Block> BlockPtr;
+
+    /** Cut the next block off the input and queue it; false when there are no more */
+    bool split();
+    /** Read more input; false at its end */
+    bool fill();
+    /** Scan one bit of a stream for the start of a block or its end; true if a block was cut */
+    bool scanBit();
+    void cut(uint64_t end);
+    bool isStreamStart(uint64_t bytePos);
+    /** The first block failed: it must have been cut where a block merely seemed to start */
+    void repair();
+
+    static bool decode(Block& b) noexcept;
+    /** The pool of the readers alive, made by the first one and gone with the last */
+    static std::shared_ptr<ThreadPool> getPool();
+
+    InputStream* s;
+
+    /** Input not cut into blocks yet; pos is the bit scanned next and last the bits before it */
+    string in;
+    uint64_t pos;
+    uint64_t last;
+    int lastCount;
+    /** Where the block being scanned starts, NO_BLOCK if there's none yet */
+    uint64_t blockStart;
+    /** The crcs of the blocks of the stream combined, as at its end */
+    uint32_t streamCrc;
+    char level;
+    int stream;
+    bool inStream;
+    bool eof;
+    bool done;
+    size_t inRead;
+
+    deque<BlockPtr> blocks;
+    size_t outPos;
+
+    /** Set when the reader goes away; the blocks still queued are skipped then */
+    std::shared_ptr<std::atomic<bool>> stopping;
+    std::shared_ptr<ThreadPool> pool;
+
+    static FastCriticalSection poolCs;
+    static std::weak_ptr<ThreadPool> sharedPool;
+};
+
 class UnBZFilter {
 public:
     UnBZFilter();
@@ -0,0 +1,133 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "File.h"
+#include "HashValue.h"
+#include "CID.h"
+#include "Text.h"
+#include "Util.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace dcpp {
+
+/*
+ * Helpers for the binary index and journal files: records are built in a string with put()
+ * and read back from a FileImage with BinaryReader. Values are stored in native byte order,
+ * strings as a 32-bit length followed by the bytes.
+ */
+
+template<typename T>
+inline void put(string& buf, const T& v) { buf.append(reinterpret_cast<const char*>(&v), sizeof(T)); }
+template<class Hasher>
+inline void put(string& buf, const HashValue<Hasher>& v) { buf.append(reinterpret_cast<const char*>(v.data), HashValue<Hasher>::BYTES); }
+inline void put(string& buf, const CID& v) { buf.append(reinterpret_cast<const char*>(v.data()), CID::SIZE); }
+inline void put(string& buf, const string& v) { put(buf, static_cast<uint32_t>(v.size())); buf.append(v); }
+
+/** Bounds checked reads from a file image */
+class BinaryReader {
+public:
+    BinaryReader(const uint8_t* aData, size_t aSize) : begin(aData), p(aData), end(aData + aSize) { }
+
+    template<typename T>
+    bool get(T& v) { return read(&v, sizeof(T)); }
+    template<class Hasher>
+    bool get(HashValue<Hasher>& v) { return read(v.data, HashValue<Hasher>::BYTES); }
+    bool get(CID& v) {
+        uint8_t buf[CID::SIZE];
+        if(!read(buf, sizeof(buf)))
+            return false;
+        v = CID(buf);
+        return true;
+    }
+    bool get(string& v) {
+        uint32_t n;
+        if(!get(n) || static_cast<size_t>(end - p) < n)
+            return false;
+        v.assign(reinterpret_cast<const char*>(p), n);
+        p += n;
+        return true;
+    }
+
+    bool atEnd() const { return p == end; }
+    /** @return Number of bytes read so far */
+    size_t getPos() const { return p - begin; }
+
+private:
+    bool read(void* v, size_t n) {
+        if(static_cast<size_t>(end - p) < n)
+            return false;
+        memcpy(v, p, n);
+        p += n;
+        return true;
+    }
+
+    const uint8_t* begin;
+    const uint8_t* p;
+    const uint8_t* end;
+};
+
+/** Read-only image of a whole file, mapped where possible */
+class FileImage : boost::noncopyable {
+public:
+    explicit FileImage(const string& aFileName) : data(nullptr), size(0), mapped(false) {
+#ifndef _WIN32
+        int fd = ::open(Text::fromUtf8(aFileName).c_str(), O_RDONLY);
+        if(fd == -1)
+            throw FileException(Util::translateError(errno));
+
+        struct stat st;
+        if(::fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* p = ::mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(p != MAP_FAILED) {
+                ::madvise(p, st.st_size, MADV_SEQUENTIAL);
+                data = static_cast<const uint8_t*>(p);
+                size = st.st_size;
+                mapped = true;
+            }
+        }
+        ::close(fd);
+        if(mapped)
+            return;
+#endif
+        buf = File(aFileName, File::READ, File::OPEN).read();
+        data = reinterpret_cast<const uint8_t*>(buf.data());
+        size = buf.size();
+    }
+    ~FileImage() {
+#ifndef _WIN32
+        if(mapped)
+            ::munmap(const_cast<uint8_t*>(data), size);
+#endif
+    }
+
+    BinaryReader reader() const { return BinaryReader(data, size); }
+
+private:
+    const uint8_t* data;
+    size_t size;
+    bool mapped;
+    string buf;
+};
+
+} // namespace dcpp
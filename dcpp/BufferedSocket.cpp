@@ -37,10 +37,10 @@ namespace dcpp {
 
 BufferedSocket::BufferedSocket(char aSeparator) :
 separator(aSeparator), mode(MODE_LINE), dataBytes(0), rollback(0), state(STARTING),
-disconnecting(false)
+disconnecting(false), started(false), readPaused(false), worker(nullptr), queued(false), handshake(HANDSHAKE_NONE),
+handshakeEnd(0), watching(0), sendPos(0), sendFile(nullptr), fileFd(-1), fileLeft(0), filePos(0), fileChunk(0), writeChunk(0), fileDone(false),
+lastWritten(0), lastWriteSize(0), readRound(0), sendRound(0), timerAt(0)
 {
-    start();
-
     sockets.inc();
 }
 
@@ -107,8 +107,12 @@ void BufferedSocket::connect(const string& aAddress, uint16_t aPort, uint16_t lo
     setSocket(move(s));
     sock->bind(localPort, SETTING(BIND_IFACE)? sock->getIfaceI4(SETTING(BIND_IFACE_NAME)).c_str() : SETTING(BIND_ADDRESS));
 
+    proxy = proxy && (SETTING(OUTGOING_CONNECTIONS) == SettingsManager::OUTGOING_SOCKS5);
+
     Lock l(cs);
-    addTask(CONNECT, new ConnectInfo(aAddress, aPort, localPort, natRole, proxy && (SETTING(OUTGOING_CONNECTIONS) == SettingsManager::OUTGOING_SOCKS5)));
+    // SOCKS5 and NAT traversal connects are blocking, keep those off the shared I/O threads
+    startEngine(proxy || natRole != NAT_NONE);
+    addTask(CONNECT, new ConnectInfo(aAddress, aPort, localPort, natRole, proxy));
 }
 
 #define LONG_TIMEOUT 30000
@@ -171,14 +175,16 @@ void BufferedSocket::threadAccept() {
     }
 }
 
-void BufferedSocket::threadRead() {
-    if(state != RUNNING)
-        return;
+bool BufferedSocket::threadRead() {
+    if(state != RUNNING || readPaused)
+        return false;
 
-    int left = (mode == MODE_DATA) ? ThrottleManager::getInstance()->read(sock.get(), &inbuf[0], (int)inbuf.size()) : sock->read(&inbuf[0], (int)inbuf.size());
+    // the I/O threads of the event loop can't sleep for throttling, the socket is put off instead
+    int left = (mode == MODE_DATA) ? ThrottleManager::getInstance()->read(sock.get(), &inbuf[0], (int)inbuf.size(), worker ? &readRound : nullptr) :
+        sock->read(&inbuf[0], (int)inbuf.size());
     if(left == -1) {
         // EWOULDBLOCK, no data received...
-        return;
+        return false;
     } else if(left == 0) {
         // This socket has been closed...
         throw SocketException(_("Connection closed"));
@@ -274,6 +280,7 @@ void BufferedSocket::threadRead() {
     if(mode == MODE_LINE && line.size() > static_cast<size_t>(SETTING(MAX_COMMAND_LENGTH))) {
         throw SocketException(_("Maximum command length exceeded"));
     }
+    return true;
 }
 
 void BufferedSocket::threadSendFile(InputStream* file) {
@@ -286,6 +293,14 @@ void BufferedSocket::threadSendFile(InputStream* file) {
     size_t sockSize = (size_t)sock->getSocketOptInt(SO_SNDBUF);
     size_t bufSize = max(sockSize, (size_t)64*1024);
 
+    // plain files over plain sockets go straight from the page cache to the socket
+    int64_t left = 0;
+    int fd = sock->isSecure() ? -1 : file->getFileHandle(left);
+    if(fd != -1) {
+        threadSendFileDirect(file, fd, left, bufSize);
+        return;
+    }
+
     ByteVector readBuf(bufSize);
     ByteVector writeBuf(bufSize);
 
@@ -380,6 +395,41 @@ void BufferedSocket::threadSendFile(InputStream* file) {
     }
 }
 
+void BufferedSocket::threadSendFileDirect(InputStream* file, int fd, int64_t left, size_t bufSize) {
+    dcdebug("Starting threadSendFileDirect\n");
+    while(!disconnecting) {
+        if(left == 0) {
+            fire(BufferedSocketListener::TransmitDone());
+            return;
+        }
+
+        int w = sock->wait(0, Socket::WAIT_READ);
+        if(w & Socket::WAIT_READ) {
+            threadRead();
+        }
+
+        size_t len = (size_t)min((int64_t)bufSize, left);
+        int sent = ThrottleManager::getInstance()->sendFile(sock.get(), fd, len);
+
+        if(sent > 0) {
+            left -= sent;
+            file->skipped(sent);
+
+            fire(BufferedSocketListener::BytesSent(), sent, sent);
+        } else if(sent == -1) {
+            while(!disconnecting) {
+                int w = sock->wait(POLL_TIMEOUT, Socket::WAIT_WRITE | Socket::WAIT_READ);
+                if(w & Socket::WAIT_READ) {
+                    threadRead();
+                }
+                if(w & Socket::WAIT_WRITE) {
+                    break;
+                }
+            }
+        }
+    }
+}
+
 void BufferedSocket::write(const char* aBuf, size_t aLen) noexcept {
     if(!sock.get())
         return;
@@ -468,6 +518,12 @@ bool BufferedSocket::checkEvents() {
 }
 
 void BufferedSocket::checkSocket() {
+    if(readPaused) {
+        // keep handling the tasks while waiting
+        resumeSem.wait(POLL_TIMEOUT);
+        return;
+    }
+
     int waitFor = sock->wait(POLL_TIMEOUT, Socket::WAIT_READ);
 
     if(waitFor & Socket::WAIT_READ) {
@@ -499,8 +555,25 @@ int BufferedSocket::run() {
     return 0;
 }
 
+void BufferedSocket::resumeRead() noexcept {
+    if(!readPaused.exchange(false))
+        return;
+
+    Lock l(cs);
+    if(worker) {
+        worker->post(this);
+    } else {
+        resumeSem.signal();
+    }
+}
+
 void BufferedSocket::fail(const string& aError) {
+    handshake = HANDSHAKE_NONE;
     if(sock.get()) {
+        if(worker && watching) {
+            worker->watch(this, sock->sock, watching, 0);
+            watching = 0;
+        }
         sock->disconnect();
     }
 
@@ -518,7 +591,292 @@ void BufferedSocket::shutdown() {
 
 void BufferedSocket::addTask(Tasks task, TaskData* data) {
     dcassert(task == DISCONNECT || task == SHUTDOWN || task == UPDATED || sock.get());
-    tasks.push_back(make_pair(task, unique_ptr<TaskData>(data))); taskSem.signal();
+    startEngine(false);
+    tasks.push_back(make_pair(task, unique_ptr<TaskData>(data)));
+    if(worker) {
+        worker->post(this);
+    } else {
+        taskSem.signal();
+    }
+}
+
+/**
+ * Hands the socket over to whoever runs its tasks: an I/O thread of the SocketReactor
+ * when the event loop engine is active, a thread of its own otherwise.
+ * Called with cs held, before the first task is queued.
+ */
+void BufferedSocket::startEngine(bool blockingConnect) {
+    if(started)
+        return;
+    started = true;
+
+    SocketReactor* reactor = SocketReactor::getInstance();
+    if(reactor && !blockingConnect) {
+        worker = reactor->attach();
+    } else {
+        start();
+    }
+}
+
+/**
+ * Event loop counterpart of run(): advances a pending connect / accept, pushes out queued
+ * data or file contents, runs the queued tasks once nothing is being sent (the same order
+ * the thread engine processes them in) and reads whatever has arrived. Never blocks on the
+ * socket itself.
+ * @return false once the socket has been shut down and may be deleted.
+ */
+bool BufferedSocket::reactorStep(int events) noexcept {
+    // a new throttle round, or no throttled transfer tried again since
+    const uint64_t now = GET_TICK();
+    if(readRound <= now)
+        readRound = 0;
+    if(sendRound <= now)
+        sendRound = 0;
+
+    try {
+        if(handshake != HANDSHAKE_NONE) {
+            reactorHandshake();
+            if(handshake == HANDSHAKE_NONE) {
+                // the handshake may have pulled in application data as well
+                events |= Socket::WAIT_READ;
+            }
+        }
+
+        while(handshake == HANDSHAKE_NONE) {
+            if(disconnecting) {
+                reactorAbortSend();
+            } else if(sendFile) {
+                if(!reactorSendFile())
+                    break;
+            } else if(!sendBuf.empty()) {
+                if(!reactorSendData())
+                    break;
+            }
+
+            pair<Tasks, unique_ptr<TaskData> > p;
+            {
+                Lock l(cs);
+                if(tasks.empty())
+                    break;
+                p = move(tasks.front());
+                tasks.pop_front();
+            }
+
+            if(p.first == SHUTDOWN) {
+                if(watching) {
+                    worker->watch(this, sock->sock, watching, 0);
+                    watching = 0;
+                }
+                return false;
+            } else if(p.first == UPDATED) {
+                fire(BufferedSocketListener::Updated());
+                continue;
+            }
+
+            if(state == STARTING) {
+                if(p.first == CONNECT) {
+                    ConnectInfo* ci = static_cast<ConnectInfo*>(p.second.get());
+                    if(ci->proxy || ci->natRole != NAT_NONE) {
+                        // only when an earlier task already put us on an I/O thread
+                        threadConnect(ci->addr, ci->port, ci->localPort, ci->natRole, ci->proxy);
+                    } else {
+                        dcdebug("reactorConnect %s:%d\n", ci->addr.c_str(), (int)ci->port);
+                        fire(BufferedSocketListener::Connecting());
+                        state = RUNNING;
+                        sock->connect(ci->addr, ci->port);
+                        handshake = HANDSHAKE_CONNECT;
+                        handshakeEnd = GET_TICK() + LONG_TIMEOUT;
+                        reactorHandshake();
+                    }
+                } else if(p.first == ACCEPTED) {
+                    state = RUNNING;
+                    handshake = HANDSHAKE_ACCEPT;
+                    handshakeEnd = GET_TICK() + 30000;
+                    reactorHandshake();
+                } else {
+                    dcdebug("%d unexpected in STARTING state\n", p.first);
+                }
+                events |= Socket::WAIT_READ;
+            } else if(state == RUNNING) {
+                if(p.first == SEND_DATA) {
+                    Lock l(cs);
+                    writeBuf.swap(sendBuf);
+                    sendPos = 0;
+                } else if(p.first == SEND_FILE) {
+                    size_t sockSize = (size_t)sock->getSocketOptInt(SO_SNDBUF);
+                    sendFile = static_cast<SendFileInfo*>(p.second.get())->stream;
+                    dcassert(sendFile != NULL);
+                    fileChunk = max(sockSize, (size_t)64*1024);
+                    fileFd = sock->isSecure() ? -1 : sendFile->getFileHandle(fileLeft);
+                    fileBuf.clear();
+                    filePos = 0;
+                    fileDone = false;
+                    lastWritten = 0;
+                    writeChunk = sockSize / 2;
+                } else if(p.first == DISCONNECT) {
+                    fail(_("Disconnected"));
+                } else {
+                    dcdebug("%d unexpected in RUNNING state\n", p.first);
+                }
+            }
+        }
+
+        // reads are not watched while paused, whatever arrived meanwhile is taken after resumeRead()
+        if(((events & Socket::WAIT_READ) || !(watching & Socket::WAIT_READ)) && handshake == HANDSHAKE_NONE) {
+            // bounded so that one busy peer can't starve the rest of the I/O thread
+            int reads = 0;
+            while(threadRead()) {
+                if(++reads == 16) {
+                    worker->post(this);
+                    break;
+                }
+            }
+        }
+    } catch(const Exception& e) {
+        fail(e.getError());
+    }
+
+    reactorWatch();
+
+    // out of throttle tokens: back for the next round rather than polling the socket meanwhile
+    const uint64_t round = readRound && sendRound ? min(readRound, sendRound) : max(readRound, sendRound);
+    if(round != 0)
+        worker->schedule(this, round);
+    return true;
+}
+
+void BufferedSocket::reactorHandshake() {
+    if(disconnecting) {
+        // same as threadConnect / threadAccept, the queued tasks take it from here
+        handshake = HANDSHAKE_NONE;
+        return;
+    }
+
+    bool connecting = handshake == HANDSHAKE_CONNECT;
+    if(connecting ? sock->waitConnected(0) : sock->waitAccepted(0)) {
+        handshake = HANDSHAKE_NONE;
+        if(connecting)
+            fire(BufferedSocketListener::Connected());
+    } else if(GET_TICK() > handshakeEnd) {
+        throw SocketException(_("Connection timeout"));
+    }
+}
+
+/** @return true once sendBuf has been written out completely */
+bool BufferedSocket::reactorSendData() {
+    while(sendPos < sendBuf.size()) {
+        int n = sock->write(&sendBuf[sendPos], sendBuf.size() - sendPos);
+        if(n <= 0)
+            return false;
+        sendPos += n;
+    }
+    sendBuf.clear();
+    sendPos = 0;
+    return true;
+}
+
+/** @return true once the whole file has been sent, false to wait for the socket */
+bool BufferedSocket::reactorSendFile() {
+    // one buffer per round, the socket stays writable so we'll be back on the next poll
+    size_t budget = fileChunk;
+
+    if(fileFd != -1) {
+        // zero-copy, see threadSendFileDirect
+        while(budget > 0) {
+            if(fileLeft == 0) {
+                sendFile = nullptr;
+                fire(BufferedSocketListener::TransmitDone());
+                return true;
+            }
+
+            size_t len = (size_t)min((int64_t)fileChunk, fileLeft);
+            int sent = ThrottleManager::getInstance()->sendFile(sock.get(), fileFd, len, &sendRound);
+            if(sent <= 0)
+                return false;
+
+            fileLeft -= sent;
+            sendFile->skipped(sent);
+            budget -= min(budget, static_cast<size_t>(sent));
+            fire(BufferedSocketListener::BytesSent(), sent, sent);
+        }
+        return false;
+    }
+
+    while(budget > 0) {
+        if(filePos == fileBuf.size()) {
+            if(fileDone) {
+                sendFile = nullptr;
+                fileBuf.clear();
+                filePos = 0;
+                fire(BufferedSocketListener::TransmitDone());
+                return true;
+            }
+
+            fileBuf.resize(fileChunk);
+            size_t bytesRead = fileBuf.size();
+            size_t actual = sendFile->read(&fileBuf[0], bytesRead);
+
+            if(bytesRead > 0) {
+                fire(BufferedSocketListener::BytesSent(), bytesRead, 0);
+            }
+
+            if(actual == 0) {
+                fileDone = true;
+            }
+            fileBuf.resize(actual);
+            filePos = 0;
+            continue;
+        }
+
+        int written = -1;
+        if(lastWritten == -1) {
+            // workaround for OpenSSL (crashes when previous write failed and now retrying with different writeSize)
+            try {
+                written = sock->write(&fileBuf[filePos], lastWriteSize);
+            } catch(const Exception&) {
+                // ...
+            }
+        } else {
+            lastWriteSize = min(writeChunk, fileBuf.size() - filePos);
+            written = ThrottleManager::getInstance()->write(sock.get(), &fileBuf[filePos], lastWriteSize, &sendRound);
+        }
+        lastWritten = written;
+
+        if(written <= 0)
+            return false;
+
+        filePos += written;
+        budget -= min(budget, static_cast<size_t>(written));
+        fire(BufferedSocketListener::BytesSent(), 0, written);
+    }
+    return false;
+}
+
+void BufferedSocket::reactorAbortSend() {
+    sendFile = nullptr;
+    fileBuf.clear();
+    filePos = 0;
+    sendBuf.clear();
+    sendPos = 0;
+}
+
+void BufferedSocket::reactorWatch() {
+    int events = 0;
+    if(sock.get() && sock->sock != INVALID_SOCKET) {
+        if(handshake != HANDSHAKE_NONE) {
+            // the handshake consumes everything that is available, so edges are enough here
+            events = Socket::WAIT_READ | Socket::WAIT_WRITE | SocketReactor::Worker::WAIT_EDGE;
+        } else if(state == RUNNING) {
+            events = (readPaused || readRound) ? 0 : Socket::WAIT_READ;
+            if(sendFile ? !sendRound : !sendBuf.empty())
+                events |= Socket::WAIT_WRITE;
+        }
+    }
+
+    if(events != watching) {
+        worker->watch(this, sock.get() ? sock->sock : INVALID_SOCKET, watching, events);
+        watching = events;
+    }
 }
 
 } // namespace dcpp
@@ -26,6 +26,7 @@
 #include "Util.h"
 #include "Socket.h"
 #include "Atomic.h"
+#include "SocketReactor.h"
 
 namespace dcpp {
 
@@ -96,6 +97,15 @@ public:
 
     void disconnect(bool graceless = false) noexcept { Lock l(cs); if(graceless) disconnecting = true; addTask(DISCONNECT, 0); }
 
+    /**
+     * Stop reading from the socket until resumeRead(); data that was already read is still
+     * delivered. Meant for listeners that can't keep up with the peer, the socket's receive
+     * window then slows it down.
+     */
+    void pauseRead() noexcept { readPaused = true; }
+    /** May be called from any thread */
+    void resumeRead() noexcept;
+
     string getLocalIp() const { return sock->getLocalIp(); }
     uint16_t getLocalPort() const { return sock->getLocalPort(); }
 
@@ -133,6 +143,14 @@ private:
         InputStream* stream;
     };
 
+    enum Handshakes {
+        HANDSHAKE_NONE,
+        HANDSHAKE_CONNECT,
+        HANDSHAKE_ACCEPT
+    };
+
+    friend class SocketReactor::Worker;
+
     BufferedSocket(char aSeparator);
 
     virtual ~BufferedSocket();
@@ -154,15 +172,51 @@ private:
     std::unique_ptr<Socket> sock;
     State state;
     bool disconnecting;
+    bool started;
+    std::atomic<bool> readPaused;
+    Semaphore resumeSem;
+
+    // Event loop engine state, only touched by the owning SocketReactor thread
+    SocketReactor::Worker* worker;
+    bool queued;                // protected by the worker's lock
+    Handshakes handshake;
+    uint64_t handshakeEnd;
+    int watching;
+    size_t sendPos;
+    InputStream* sendFile;
+    int fileFd;
+    int64_t fileLeft;
+    ByteVector fileBuf;
+    size_t filePos;
+    size_t fileChunk;
+    size_t writeChunk;
+    bool fileDone;
+    int lastWritten;
+    size_t lastWriteSize;
+    /** Ticks at which a throttled read / send may go on, 0 when not throttled */
+    uint64_t readRound;
+    uint64_t sendRound;
+    /** Tick the worker is to process the socket again at, 0 for none */
+    uint64_t timerAt;
 
     virtual int run();
 
     void threadConnect(const string& aAddr, uint16_t aPort, uint16_t localPort, NatRoles natRole, bool proxy);
     void threadAccept();
-    void threadRead();
+    bool threadRead();
     void threadSendFile(InputStream* is);
+    void threadSendFileDirect(InputStream* is, int fd, int64_t left, size_t bufSize);
     void threadSendData();
 
+    void startEngine(bool blockingConnect);
+    bool reactorStep(int events) noexcept;
+    bool reactorPending() const { return handshake != HANDSHAKE_NONE; }
+    void reactorHandshake();
+    bool reactorSendData();
+    bool reactorSendFile();
+    void reactorWatch();
+    void reactorAbortSend();
+
     void fail(const string& aError);
     static Atomic<long,memory_ordering_strong> sockets;
 
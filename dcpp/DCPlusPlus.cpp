@@ -35,6 +35,7 @@
 #include "FinishedManager.h"
 #include "ResourceManager.h"
 #include "ThrottleManager.h"
+#include "SocketReactor.h"
 #include "ADLSearch.h"
 //#include "WindowManager.h"
 #include "StringTokenizer.h"
@@ -101,6 +102,9 @@ void startup(void (*f)(void*, const string&), void* p) {
     DebugManager::newInstance();
 
     SettingsManager::getInstance()->load();
+    if(SETTING(SOCKET_ENGINE) == SettingsManager::SOCKET_ENGINE_REACTOR && SocketReactor::isAvailable()) {
+        SocketReactor::newInstance();
+    }
 #ifdef USE_MINIUPNP
     UPnPManager::getInstance()->runMiniUPnP();
 #endif
@@ -128,7 +132,7 @@ void startup(void (*f)(void*, const string&), void* p) {
             File::copyFile(XmlListFileName + ".bak", XmlListFileName);
         } catch(const FileException&) { }
     }
-    ShareManager::getInstance()->refresh(true, false, true);
+    ShareManager::getInstance()->refresh(true, false, true, BOOLSETTING(SHARE_INCREMENTAL_REFRESH));
     if(f != NULL)
         (*f)(p, _("Download Queue"));
     QueueManager::getInstance()->loadQueue();
@@ -154,6 +158,7 @@ void shutdown() {
     UPnPManager::getInstance()->close();
 
     BufferedSocket::waitShutdown();
+    SocketReactor::deleteInstance();
     //WindowManager::getInstance()->prepareSave();
     QueueManager::getInstance()->saveQueue(true);
     ClientManager::getInstance()->saveUsers();
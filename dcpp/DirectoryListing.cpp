@@ -25,7 +25,6 @@
 
 #include "StringTokenizer.h"
 #include "SimpleXML.h"
-#include "FilteredFile.h"
 #include "BZUtils.h"
 #include "CryptoManager.h"
 #include "ShareManager.h"
@@ -48,6 +47,51 @@ DirectoryListing::~DirectoryListing() {
     delete root;
 }
 
+DirectoryListing::Arena::~Arena() {
+    for_each(blocks.begin(), blocks.end(), free);
+}
+
+void* DirectoryListing::Arena::allocate(size_t n) {
+    // good enough for the pointers and 64-bit integers of File
+    n = (n + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    if(n > left) {
+        // a big directory gets a block of its own, the rest of the current one is still used
+        size_t bytes = max(n, (size_t)BLOCK_BYTES);
+        uint8_t* b = (uint8_t*)malloc(bytes);
+        if(!b)
+            throw std::bad_alloc();
+        blocks.push_back(b);
+        total += bytes;
+        if(bytes > BLOCK_BYTES)
+            return b;
+        cur = b;
+        left = bytes;
+    }
+    void* p = cur;
+    cur += n;
+    left -= n;
+    return p;
+}
+
+const char* DirectoryListing::Arena::copy(const string& s) {
+    char* p = (char*)allocate(s.size() + 1);
+    memcpy(p, s.c_str(), s.size() + 1);
+    return p;
+}
+
+DirectoryListing::File* DirectoryListing::newFile(Directory* aDir, const string& aName, int64_t aSize, const TTHValue& aTTH) {
+    return new (arena.allocate(sizeof(File))) File(aDir, arena.copy(aName), aSize, aTTH);
+}
+
+DirectoryListing::File* DirectoryListing::copyFile(const File& aFile, bool adls) {
+    return new (arena.allocate(sizeof(File))) File(aFile, adls);
+}
+
+const MediaInfo& DirectoryListing::File::getMediaInfo() const {
+    static const Extra none;
+    return extra ? extra->mediaInfo : none.mediaInfo;
+}
+
 UserPtr DirectoryListing::getUserFromFilename(const string& fileName) {
     // General file list name format: [username].[CID].[xml|xml.bz2]
 
@@ -80,24 +124,9 @@ UserPtr DirectoryListing::getUserFromFilename(const string& fileName) {
     return ClientManager::getInstance()->getUser(cid);
 }
 
-void DirectoryListing::loadFile(const string& name) {
-    string txt;
-
-    // For now, we detect type by ending...
-    string ext = Util::getFileExt(name);
-
-    dcpp::File ff(name, dcpp::File::READ, dcpp::File::OPEN);
-    if(Util::stricmp(ext, ".bz2") == 0) {
-        FilteredInputStream<UnBZFilter, false> f(&ff);
-        loadXML(f, false);
-    } else if(Util::stricmp(ext, ".xml") == 0) {
-        loadXML(ff, false);
-    }
-}
-
 class ListLoader : public dcpp::SimpleXMLReader::CallBack {
 public:
-    ListLoader(DirectoryListing::Directory* root, bool aUpdating) : cur(root),
+    ListLoader(DirectoryListing& aList, DirectoryListing::Directory* root, bool aUpdating) : list(aList), cur(root),
                                                                     base("/"),
                                                                     inListing(false),
                                                                     updating(aUpdating),
@@ -113,6 +142,7 @@ public:
 
     const string& getBase() const { return base; }
 private:
+    DirectoryListing& list;
     DirectoryListing::Directory* cur;
 
     StringMap params;
@@ -128,8 +158,27 @@ string DirectoryListing::updateXML(const string& xml) {
     return loadXML(mis, true);
 }
 
+void DirectoryListing::loadFile(const string& name) {
+    ListLoader ll(*this, getRoot(), false);
+    parseFile(name, ll);
+}
+
+void DirectoryListing::parseFile(const string& name, SimpleXMLReader::CallBack& callback) {
+    // For now, we detect type by ending...
+    string ext = Util::getFileExt(name);
+    size_t maxSize = SETTING(MAX_FILELIST_SIZE) ? (size_t)SETTING(MAX_FILELIST_SIZE)*1024*1024 : 0;
+
+    dcpp::File ff(name, dcpp::File::READ, dcpp::File::OPEN);
+    if(Util::stricmp(ext, ".bz2") == 0) {
+        BZBlockReader f(&ff);
+        dcpp::SimpleXMLReader(&callback).parse(f, maxSize);
+    } else if(Util::stricmp(ext, ".xml") == 0) {
+        dcpp::SimpleXMLReader(&callback).parse(ff, maxSize);
+    }
+}
+
 string DirectoryListing::loadXML(InputStream& is, bool updating) {
-    ListLoader ll(getRoot(), updating);
+    ListLoader ll(*this, getRoot(), updating);
 
     dcpp::SimpleXMLReader(&ll).parse(is, SETTING(MAX_FILELIST_SIZE) ? (size_t)SETTING(MAX_FILELIST_SIZE)*1024*1024 : 0);
 
@@ -171,8 +220,9 @@ void ListLoader::startTag(const string& name, StringPairList& attribs, bool simp
                 for(auto i = cur->files.cbegin(), iend = cur->files.cend(); i != iend; ++i) {
                     auto& file = **i;
                     /// @todo comparisons should be case-insensitive but it takes too long - add a cache
-                    if(file.getTTH() == tth || file.getName() == n) {
-                        file.setName(n);
+                    if(file.getTTH() == tth || n == file.name) {
+                        if(n != file.name)
+                            file.name = list.arena.copy(n);
                         file.setSize(size);
                         file.setTTH(tth);
                         return;
@@ -180,7 +230,7 @@ void ListLoader::startTag(const string& name, StringPairList& attribs, bool simp
                 }
             }
 
-            DirectoryListing::File* f = new DirectoryListing::File(cur, n, size, tth);
+            DirectoryListing::File* f = list.newFile(cur, n, size, tth);
 
             string l_ts = "";
 
@@ -194,12 +244,15 @@ void ListLoader::startTag(const string& name, StringPairList& attribs, bool simp
             }
 
             if (!l_ts.empty()){
-                f->setTS(atol(l_ts.c_str()));
-                f->setHit(atol(getAttrib(attribs, sHIT, 3).c_str()));
-                f->mediaInfo.video_info = getAttrib(attribs, sMVideo, 3);
-                f->mediaInfo.audio_info = getAttrib(attribs, sMAudio, 3);
-                f->mediaInfo.resolution = getAttrib(attribs, sWH, 3);
-                f->mediaInfo.bitrate    = atoi(getAttrib(attribs, sBR, 4).c_str());
+                list.extras.push_back(DirectoryListing::File::Extra());
+                DirectoryListing::File::Extra& e = list.extras.back();
+                e.ts = atol(l_ts.c_str());
+                e.hit = atol(getAttrib(attribs, sHIT, 3).c_str());
+                e.mediaInfo.video_info = getAttrib(attribs, sMVideo, 3);
+                e.mediaInfo.audio_info = getAttrib(attribs, sMAudio, 3);
+                e.mediaInfo.resolution = getAttrib(attribs, sWH, 3);
+                e.mediaInfo.bitrate    = atoi(getAttrib(attribs, sBR, 4).c_str());
+                f->extra = &e;
             }
 
             cur->files.push_back(f);
@@ -265,6 +318,10 @@ void ListLoader::startTag(const string& name, StringPairList& attribs, bool simp
 void ListLoader::endTag(const string& name, const string&) {
     if(inListing) {
         if(name == sDirectory) {
+            if(!updating) {
+                // no more files are coming for it
+                cur->files.shrink_to_fit();
+            }
             cur = cur->getParent();
         } else if(name == sFileListing) {
             // cur should be root now...
@@ -366,7 +423,7 @@ struct HashContained {
     HashContained(const DirectoryListing::Directory::TTHSet& l) : tl(l) { }
     const DirectoryListing::Directory::TTHSet& tl;
     bool operator()(const DirectoryListing::File::Ptr i) const {
-        return tl.count((i->getTTH())) && (DeleteFunction()(i), true);
+        return tl.count((i->getTTH())) > 0;
     }
 private:
     HashContained& operator=(HashContained&);
@@ -23,6 +23,7 @@
 #include "FastAlloc.h"
 #include "MerkleTree.h"
 #include "Streams.h"
+#include "SimpleXMLReader.h"
 #include "MediaInfo.h"
 
 namespace dcpp {
@@ -34,41 +35,54 @@ class DirectoryListing : boost::noncopyable
 public:
     class Directory;
 
-    class File : public FastAlloc<File> {
+    /**
+     * Files live in the arena of their listing, next to the other files of their directory, and
+     * their names in its string storage; they are freed with the listing, never one by one.
+     */
+    class File : boost::noncopyable {
     public:
         typedef File* Ptr;
         struct FileSort {
             bool operator()(const Ptr& a, const Ptr& b) const {
-                return Util::stricmp(a->getName().c_str(), b->getName().c_str()) < 0;
+                return Util::stricmp(a->name, b->name) < 0;
             }
         };
         typedef vector<Ptr> List;
         typedef List::iterator Iter;
 
-        File(Directory* aDir, const string& aName, int64_t aSize, const TTHValue& aTTH) noexcept :
-            name(aName), size(aSize), parent(aDir), tthRoot(aTTH), adls(false)
-        {
-        }
+        /** What lists with media info have on top of the rest, kept aside as most lists have none */
+        struct Extra {
+            Extra() : ts(0), hit(0) { mediaInfo.bitrate = 0; }
+            uint64_t ts;
+            uint64_t hit;
+            MediaInfo mediaInfo;
+        };
 
-        File(const File& rhs, bool _adls = false) : name(rhs.name), size(rhs.size), parent(rhs.parent), tthRoot(rhs.tthRoot), adls(_adls)
+        /** @param aName Owned by the listing */
+        File(Directory* aDir, const char* aName, int64_t aSize, const TTHValue& aTTH) noexcept :
+            size(aSize), parent(aDir), tthRoot(aTTH), adls(false), name(aName), extra(NULL)
         {
         }
 
-        File& operator=(const File& rhs) {
-            name = rhs.name; size = rhs.size; parent = rhs.parent; tthRoot = rhs.tthRoot;
-            return *this;
+        File(const File& rhs, bool _adls) : size(rhs.size), parent(rhs.parent), tthRoot(rhs.tthRoot), adls(_adls), name(rhs.name), extra(rhs.extra)
+        {
         }
 
-        ~File() { }
+        string getName() const { return name; }
+        uint64_t getTS() const { return extra ? extra->ts : 0; }
+        uint64_t getHit() const { return extra ? extra->hit : 0; }
+        const MediaInfo& getMediaInfo() const;
 
-        GETSET(string, name, Name);
         GETSET(int64_t, size, Size);
         GETSET(Directory*, parent, Parent);
         GETSET(TTHValue, tthRoot, TTH);
         GETSET(bool, adls, Adls);
-        GETSET(uint64_t, ts, TS);
-        GETSET(uint64_t, hit, Hit);
-        MediaInfo mediaInfo;
+    private:
+        friend class ListLoader;
+        friend bool operator==(DirectoryListing::File::Ptr a, const string& b);
+
+        const char* name;
+        const Extra* extra;
     };
 
     class Directory : public FastAlloc<Directory>, boost::noncopyable {
@@ -91,8 +105,8 @@ public:
             : name(aName), parent(aParent), adls(_adls), complete(aComplete) { }
 
         virtual ~Directory() {
+            // the files belong to the listing
             for_each(directories.begin(), directories.end(), DeleteFunction());
-            for_each(files.begin(), files.end(), DeleteFunction());
         }
 
         size_t getTotalFileCount(bool adls = false);
@@ -133,6 +147,9 @@ public:
     string updateXML(const std::string&);
     string loadXML(InputStream& xml, bool updating);
 
+    /** Run a callback over a list file, plain or bzip2-compressed, without building the tree */
+    static void parseFile(const string& name, SimpleXMLReader::CallBack& callback);
+
     void download(const string& aDir, const string& aTarget, bool highPrio);
     void download(Directory* aDir, const string& aTarget, bool highPrio);
     void download(File* aFile, const string& aTarget, bool view, bool highPrio);
@@ -157,14 +174,42 @@ public:
 
     Directory* find(const string& aName, Directory* current);
 
+    /** A copy of aFile kept by the listing, for the ADLSearch directories */
+    File* copyFile(const File& aFile, bool adls);
+
+    /** @return Bytes held for the files and their names */
+    size_t getArenaSize() const { return arena.getSize(); }
+
 private:
     friend class ListLoader;
 
-    Directory* root;
+    /** Memory handed out from large blocks and only freed all at once */
+    class Arena : boost::noncopyable {
+    public:
+        Arena() : cur(NULL), left(0), total(0) { }
+        ~Arena();
+
+        void* allocate(size_t n);
+        const char* copy(const string& s);
+        size_t getSize() const { return total; }
+
+    private:
+        enum { BLOCK_BYTES = 256 * 1024 };
 
+        vector<uint8_t*> blocks;
+        uint8_t* cur;
+        size_t left;
+        size_t total;
+    };
+
+    File* newFile(Directory* aDir, const string& aName, int64_t aSize, const TTHValue& aTTH);
+
+    Directory* root;
+    Arena arena;
+    deque<File::Extra> extras;
 };
 
 inline bool operator==(DirectoryListing::Directory::Ptr a, const string& b) { return Util::stricmp(a->getName(), b) == 0; }
-inline bool operator==(DirectoryListing::File::Ptr a, const string& b) { return Util::stricmp(a->getName(), b) == 0; }
+inline bool operator==(DirectoryListing::File::Ptr a, const string& b) { return Util::stricmp(a->name, b.c_str()) == 0; }
 
 } // namespace dcpp
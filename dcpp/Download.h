@@ -30,6 +30,8 @@ namespace dcpp {
 
 using std::string;
 
+class WriteBehindOutputStream;
+
 /**
  * Comes as an argument in the DownloadManagerListener functions.
  * Use it to retrieve information about the ongoing transfer.
@@ -66,6 +68,8 @@ public:
 
     GETSET(string, tempTarget, TempTarget);
     GETSET(OutputStream*, file, File);
+    /** The write queue stage of file, if any */
+    GETSET(WriteBehindOutputStream*, writeBehind, WriteBehind);
     GETSET(bool, treeValid, TreeValid);
 private:
     Download(const Download&);
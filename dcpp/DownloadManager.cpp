@@ -28,6 +28,7 @@
 #include "FilteredFile.h"
 #include "MerkleCheckOutputStream.h"
 #include "UserConnection.h"
+#include "WriteBehindOutputStream.h"
 #include "ZUtils.h"
 #include "extra/ipfilter.h"
 #include <limits>
@@ -41,6 +42,8 @@
 namespace dcpp {
 
 static const string DOWNLOAD_AREA = "Downloads";
+// Threads writing the downloads with a write queue, shared by all of them
+static const size_t WRITER_THREADS = 2;
 
 DownloadManager::DownloadManager() {
     TimerManager::getInstance()->addListener(this);
@@ -262,6 +265,22 @@ void DownloadManager::startData(UserConnection* aSource, int64_t start, int64_t
 
         d->setFile(new MerkleStream(d->getTigerTree(), d->getFile(), d->getStartPos()));
         d->setFlag(Download::FLAG_TTH_CHECK);
+
+        if(SETTING(DOWNLOAD_WRITE_QUEUE) > 0) {
+            // the tree check and the disk writes are done by the writers, the socket stops
+            // reading while they are behind
+            ThreadPool* pool;
+            {
+                Lock l(cs);
+                if(!writers)
+                    writers.reset(new ThreadPool("DownloadWriter", WRITER_THREADS));
+                pool = writers.get();
+            }
+            WriteBehindOutputStream* wb = new WriteBehindOutputStream(d->getFile(), *pool, SETTING(DOWNLOAD_WRITE_QUEUE) * 1024,
+                [aSource](bool pause) { if(pause) aSource->pauseRead(); else aSource->resumeRead(); });
+            d->setFile(wb);
+            d->setWriteBehind(wb);
+        }
     }
 
     // Check that we don't get too many bytes
@@ -429,6 +448,15 @@ void DownloadManager::removeDownload(Download* d) {
             } catch(const Exception&) {
             }
         }
+
+        if(d->getWriteBehind()) {
+            // what was queued after a failed write never reached the file
+            int64_t written = d->getWriteBehind()->getWritten();
+            if(written < d->getPos()) {
+                d->resetPos();
+                d->addPos(written, 0);
+            }
+        }
     }
 
     {
@@ -26,6 +26,7 @@
 #include "Singleton.h"
 #include "MerkleTree.h"
 #include "Speaker.h"
+#include "ThreadPool.h"
 
 namespace dcpp {
 
@@ -58,6 +59,8 @@ private:
     CriticalSection cs;
     DownloadList downloads;
     UserConnectionList idlers;
+    /** Writes and checks the received data when the write queue is enabled, created on first use */
+    unique_ptr<ThreadPool> writers;
 
     void removeConnection(UserConnectionPtr aConn);
     void removeDownload(Download* aDown);
@@ -146,6 +146,32 @@ size_t File::flush() {
     return 0;
 }
 
+size_t File::writeAt(const void* buf, size_t len, int64_t aPos) {
+    OVERLAPPED ov = { 0 };
+    ov.Offset = (DWORD)(aPos & 0xffffffff);
+    ov.OffsetHigh = (DWORD)(aPos >> 32);
+    DWORD x;
+    if(!::WriteFile(h, buf, (DWORD)len, &x, &ov)) {
+        throw FileException(Util::translateError(GetLastError()));
+    }
+    dcassert(x == len);
+    return x;
+}
+
+bool File::allocate(int64_t aSize) noexcept {
+    // NTFS allocates the clusters when the end of the file is moved
+    try {
+        setSize(aSize);
+        return true;
+    } catch(const FileException&) {
+        return false;
+    }
+}
+
+void File::prefetch(int64_t /*pos*/, int64_t /*len*/) noexcept {
+    // the cache manager reads ahead of sequential reads on its own
+}
+
 void File::renameFile(const string& source, const string& target) {
     if(!::MoveFileW(Text::utf8ToWide(source).c_str(), Text::utf8ToWide(target).c_str())) {
         // Can't move, try copy/delete...
@@ -179,6 +205,33 @@ int64_t File::getSize(const string& aFileName) noexcept {
     }
 }
 
+uint32_t File::getLastModified(const string& aFileName) noexcept {
+    WIN32_FIND_DATAW fd;
+    HANDLE hFind;
+
+    // directories can't be found with the trailing separator
+    string name = aFileName;
+    if(!name.empty() && name[name.size() - 1] == PATH_SEPARATOR)
+        name.erase(name.size() - 1);
+
+    hFind = FindFirstFileW(Text::utf8ToWide(name).c_str(), &fd);
+
+    if (hFind == INVALID_HANDLE_VALUE) {
+        return 0;
+    } else {
+        FindClose(hFind);
+        return convertTime(&fd.ftLastWriteTime);
+    }
+}
+
+string File::getDevice(const string& aFileName) noexcept {
+    wchar_t buf[MAX_PATH + 1];
+    if(!::GetVolumePathNameW(Text::utf8ToWide(aFileName).c_str(), buf, MAX_PATH + 1))
+        return Util::emptyString;
+
+    return Text::wideToUtf8(buf);
+}
+
 void File::ensureDirectory(const string& aFile) noexcept {
     // Skip the first dir...
     tstring file;
@@ -216,6 +269,11 @@ File::File(const string& aFileName, int access, int mode) {
     if(mode & TRUNCATE) {
         m |= O_TRUNC;
     }
+#ifdef O_DIRECT
+    if(mode & DIRECT) {
+        m |= O_DIRECT;
+    }
+#endif
 
     string filename = Text::fromUtf8(aFileName);
 
@@ -301,6 +359,35 @@ size_t File::write(const void* buf, size_t len) {
     return len;
 }
 
+size_t File::writeAt(const void* buf, size_t len, int64_t aPos) {
+    const char* pointer = (const char*)buf;
+    size_t left = len;
+
+    while(left > 0) {
+        ssize_t result = ::pwrite(h, pointer, left, (off_t)aPos);
+        if(result == -1) {
+            if(errno != EINTR) {
+                throw FileException(Util::translateError(errno));
+            }
+        } else {
+            pointer += result;
+            left -= result;
+            aPos += result;
+        }
+    }
+    return len;
+}
+
+bool File::allocate(int64_t aSize) noexcept {
+#ifdef __linux__
+    // unlike posix_fallocate, never falls back to writing the file full of zeros
+    return ::fallocate(h, 0, 0, (off_t)aSize) == 0;
+#else
+    (void)aSize;
+    return false;
+#endif
+}
+
 // some ftruncate implementations can't extend files like SetEndOfFile,
 // not sure if the client code needs this...
 int File::extendFile(int64_t len) noexcept {
@@ -343,6 +430,14 @@ size_t File::flush() {
     return 0;
 }
 
+void File::prefetch(int64_t pos, int64_t len) noexcept {
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(h, pos, len, POSIX_FADV_WILLNEED);
+#else
+    (void)pos; (void)len;
+#endif
+}
+
 /**
  * ::rename seems to have problems when source and target is on different partitions
  * from "man 2 rename":
@@ -390,6 +485,22 @@ int64_t File::getSize(const string& aFileName) noexcept {
     return s.st_size;
 }
 
+uint32_t File::getLastModified(const string& aFileName) noexcept {
+    struct stat s;
+    if(stat(Text::fromUtf8(aFileName).c_str(), &s) == -1)
+        return 0;
+
+    return (uint32_t)s.st_mtime;
+}
+
+string File::getDevice(const string& aFileName) noexcept {
+    struct stat s;
+    if(stat(Text::fromUtf8(aFileName).c_str(), &s) == -1)
+        return Util::emptyString;
+
+    return Util::toString(static_cast<uint64_t>(s.st_dev));
+}
+
 void File::ensureDirectory(const string& aFile) noexcept {
     string file = Text::fromUtf8(aFile);
     string::size_type start = 0;
@@ -403,6 +514,13 @@ bool File::isAbsolute(const string& path) noexcept {
     return path.size() > 1 && path[0] == '/';
 }
 
+#ifdef __linux__
+int File::getFileHandle(int64_t& maxBytes) {
+    maxBytes = max((int64_t)0, getSize() - getPos());
+    return h;
+}
+#endif
+
 #endif // !_WIN32
 
 string File::read(size_t len) {
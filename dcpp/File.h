@@ -39,7 +39,12 @@ public:
         OPEN = 0x01,
         CREATE = 0x02,
         TRUNCATE = 0x04,
-        SHARED = 0x08
+        SHARED = 0x08,
+        /**
+         * Bypass the system cache (O_DIRECT): positions, lengths and buffers must be aligned to
+         * the blocks of the device. Ignored where the system doesn't support it (Windows).
+         */
+        DIRECT = 0x10
     };
 
 #ifdef _WIN32
@@ -82,6 +87,21 @@ public:
     virtual size_t write(const void* buf, size_t len);
     virtual size_t flush();
 
+    /** Write at aPos without using the file position, so that several threads may write at once */
+    size_t writeAt(const void* buf, size_t len, int64_t aPos);
+    /**
+     * Reserve disk space for aSize bytes and extend the file to that size.
+     * @return false if the file system can't, the file is left as it was then
+     */
+    bool allocate(int64_t aSize) noexcept;
+
+    /** Hint that the given range will be read soon so that the system starts reading it in the background */
+    void prefetch(int64_t pos, int64_t len) noexcept;
+
+#ifdef __linux__
+    virtual int getFileHandle(int64_t& maxBytes);
+#endif
+
     uint32_t getLastModified() noexcept;
 
     static void copyFile(const string& src, const string& target);
@@ -89,6 +109,10 @@ public:
     static void deleteFile(const string& aFileName) noexcept;
 
     static int64_t getSize(const string& aFileName) noexcept;
+    /** @return Modification time of a file or directory, 0 if it can't be found */
+    static uint32_t getLastModified(const string& aFileName) noexcept;
+    /** @return Identifier of the device (volume) a file or directory is on, empty if it can't be found */
+    static string getDevice(const string& aFileName) noexcept;
 
     static void ensureDirectory(const string& aFile) noexcept;
     static bool isAbsolute(const string& path) noexcept;
@@ -25,8 +25,11 @@
 #include "File.h"
 #include "ZUtils.h"
 #include "SFVReader.h"
+#include "BinaryIO.h"
 
 #ifndef _WIN32
+#include "HashReader.h"
+
 #include <sys/mman.h> // mmap, munmap, madvise
 #include <signal.h>  // for handling read errors from previous trio
 #include <setjmp.h>
@@ -48,6 +51,102 @@ static const uint32_t HASH_FILE_VERSION = 2;
 const int64_t HashManager::MIN_BLOCK_SIZE = 64 * 1024;
 const string HashManager::StreamStore::g_streamName(".gltth");
 
+/*
+ * HashIndex.dat, in native byte order like HashData.dat:
+ *   magic, version, tree count, directory count
+ *   trees sorted by root: root, size, index (in HashData.dat), block size
+ *   directories sorted by path: path, file count, then the files sorted by name: root, timestamp, name
+ *
+ * HashIndex.journal: magic, version, then one type byte and record per change:
+ *   JOURNAL_TREE as in the index, JOURNAL_FILE root, timestamp, full path, JOURNAL_REMOVE full path
+ * A torn record at the end (crash while writing) ends the replay.
+ */
+static const uint32_t INDEX_MAGIC = 0x58444948; // "HIDX"
+static const uint32_t JOURNAL_MAGIC = 0x4c4a4948; // "HIJL"
+static const uint32_t INDEX_VERSION = 1;
+
+/** Don't bother compacting journals smaller than this */
+static const int64_t MIN_COMPACT_SIZE = 4 * 1024 * 1024;
+
+enum { JOURNAL_TREE = 1, JOURNAL_FILE, JOURNAL_REMOVE };
+
+static void putIndexHeader(string& buf, uint64_t trees, uint64_t dirs) {
+    put(buf, INDEX_MAGIC);
+    put(buf, INDEX_VERSION);
+    put(buf, trees);
+    put(buf, dirs);
+}
+
+static bool getIndexHeader(BinaryReader& r, uint64_t& trees, uint64_t& dirs) {
+    uint32_t magic, version;
+    return r.get(magic) && magic == INDEX_MAGIC && r.get(version) && version == INDEX_VERSION &&
+        r.get(trees) && r.get(dirs);
+}
+
+static void putTreeRecord(string& buf, const TTHValue& root, int64_t size, int64_t index, int64_t blockSize) {
+    put(buf, root);
+    put(buf, size);
+    put(buf, index);
+    put(buf, blockSize);
+}
+
+static bool getTreeRecord(BinaryReader& r, TTHValue& root, int64_t& size, int64_t& index, int64_t& blockSize) {
+    return r.get(root) && r.get(size) && r.get(index) && r.get(blockSize);
+}
+
+static void putFileRecord(string& buf, const TTHValue& root, uint32_t timeStamp, const string& name) {
+    put(buf, root);
+    put(buf, timeStamp);
+    put(buf, name);
+}
+
+static bool getFileRecord(BinaryReader& r, TTHValue& root, uint32_t& timeStamp, string& name) {
+    return r.get(root) && r.get(timeStamp) && r.get(name);
+}
+
+/**
+ * Pass the changes recorded in a journal on to the callbacks, in order.
+ * @return Size of the complete records including the header; 0 if the header isn't valid
+ */
+template<typename OnTree, typename OnFile, typename OnRemove>
+static size_t replayJournal(const FileImage& image, OnTree onTree, OnFile onFile, OnRemove onRemove) {
+    BinaryReader r = image.reader();
+
+    uint32_t magic, version;
+    if(!r.get(magic) || magic != JOURNAL_MAGIC || !r.get(version) || version != INDEX_VERSION)
+        return 0;
+
+    TTHValue root;
+    string path;
+    size_t validSize;
+    for(;;) {
+        validSize = r.getPos();
+
+        uint8_t type;
+        if(!r.get(type))
+            break;
+
+        if(type == JOURNAL_TREE) {
+            int64_t size, index, blockSize;
+            if(!getTreeRecord(r, root, size, index, blockSize))
+                break;
+            onTree(root, size, index, blockSize);
+        } else if(type == JOURNAL_FILE) {
+            uint32_t timeStamp;
+            if(!getFileRecord(r, root, timeStamp, path))
+                break;
+            onFile(path, root, timeStamp);
+        } else if(type == JOURNAL_REMOVE) {
+            if(!r.get(path))
+                break;
+            onRemove(path);
+        } else {
+            break;
+        }
+    }
+    return validSize;
+}
+
 inline void HashManager::StreamStore::setCheckSum(TTHStreamHeader& p_header) {
     p_header.magic = g_MAGIC;
     uint32_t l_sum = 0;
@@ -194,6 +293,36 @@ TTHValue HashManager::getTTH(const string& aFileName, int64_t aSize) {
     return *tth;
 }
 
+void HashManager::markUsed(const string& aDir, const StringList& aNames) {
+    Lock l(cs);
+    store.markUsed(aDir, aNames);
+}
+
+void HashManager::checkTTHs(const string& aDir, FileCheckList& aFiles) {
+    Lock l(cs);
+
+    vector<pair<size_t, TTHValue> > legacy;
+    store.checkTTHs(aDir, aFiles, legacy);
+
+    for (auto i = legacy.begin(); i != legacy.end(); ++i) {
+        FileCheck& f = aFiles[i->first];
+        string fileName = aDir + f.name;
+        TigerTree tt(MIN_BLOCK_SIZE);
+        store.getTree(i->second, tt);
+        hashDone(fileName, f.timeStamp, tt, 0, f.size);
+
+        m_streamstore.saveTree(fileName, tt);
+
+        f.root = i->second;
+        f.current = true;
+    }
+
+    for (auto i = aFiles.begin(); i != aFiles.end(); ++i) {
+        if (!i->current)
+            hasher.hashFile(aDir + i->name, i->size);
+    }
+}
+
 const TTHValue* HashManager::getFileTTHif(const string& aFileName) {
     Lock l(cs);
     return store.getTTH(aFileName);
@@ -238,15 +367,12 @@ void HashManager::HashStore::addFile(const string& aFileName, uint32_t aTimeStam
     string fname = Util::getFileName(aFileName);
     string fpath = Util::getFilePath(aFileName);
 
-    FileInfoList& fileList = fileIndex[fpath];
-
-    FileInfoIter j = find(fileList.begin(), fileList.end(), fname);
-    if (j != fileList.end()) {
-        fileList.erase(j);
-    }
+    FileInfo fi(tth.getRoot(), aTimeStamp, aUsed);
+    auto j = fileIndex[fpath].insert(make_pair(fname, fi));
+    if (!j.second)
+        j.first->second = fi;
 
-    fileList.push_back(FileInfo(fname, tth.getRoot(), aTimeStamp, aUsed));
-    dirty = true;
+    journalFile(aFileName, fi);
 }
 
 void HashManager::HashStore::addTree(const TigerTree& tt) noexcept {
@@ -254,8 +380,9 @@ void HashManager::HashStore::addTree(const TigerTree& tt) noexcept {
         try {
             File f(getDataFile(), File::READ | File::WRITE, File::OPEN);
             int64_t index = saveTree(f, tt);
-            treeIndex.insert(make_pair(tt.getRoot(), TreeInfo(tt.getFileSize(), index, tt.getBlockSize())));
-            dirty = true;
+            TreeInfo ti(tt.getFileSize(), index, tt.getBlockSize());
+            treeIndex.insert(make_pair(tt.getRoot(), ti));
+            journalTree(tt.getRoot(), ti);
         } catch (const FileException& e) {
             LogManager::getInstance()->message(str(F_("Error saving hash data: %1%") % e.getError()));
         }
@@ -328,13 +455,13 @@ bool HashManager::HashStore::checkTTH(const string& aFileName, int64_t aSize, ui
     string fpath = Util::getFilePath(aFileName);
     DirIter i = fileIndex.find(fpath);
     if (i != fileIndex.end()) {
-        FileInfoIter j = find(i->second.begin(), i->second.end(), fname);
+        FileInfoIter j = i->second.find(fname);
         if (j != i->second.end()) {
-            FileInfo& fi = *j;
+            FileInfo& fi = j->second;
             TreeIter ti = treeIndex.find(fi.getRoot());
             if (ti == treeIndex.end() || ti->second.getSize() != aSize || fi.getTimeStamp() != aTimeStamp) {
                 i->second.erase(j);
-                dirty = true;
+                journalRemove(aFileName);
                 return false;
             }
             return true;
@@ -349,15 +476,69 @@ const TTHValue* HashManager::HashStore::getTTH(const string& aFileName) {
 
     DirIter i = fileIndex.find(fpath);
     if (i != fileIndex.end()) {
-        FileInfoIter j = find(i->second.begin(), i->second.end(), fname);
+        FileInfoIter j = i->second.find(fname);
         if (j != i->second.end()) {
-            j->setUsed(true);
-            return &(j->getRoot());
+            j->second.setUsed(true);
+            return &(j->second.getRoot());
         }
     }
     return NULL;
 }
 
+void HashManager::HashStore::checkTTHs(const string& aDir, FileCheckList& aFiles, vector<pair<size_t, TTHValue> >& aLegacy) {
+    DirIter i = fileIndex.find(aDir);
+    FileInfoList* files = i != fileIndex.end() ? &i->second : NULL;
+    FileInfoList* lowerFiles = NULL;
+    bool lowerChecked = false;
+
+    for (size_t k = 0; k < aFiles.size(); ++k) {
+        FileCheck& f = aFiles[k];
+        if (files) {
+            FileInfoIter j = files->find(f.name);
+            if (j != files->end()) {
+                FileInfo& fi = j->second;
+                TreeIter ti = treeIndex.find(fi.getRoot());
+                if (ti == treeIndex.end() || ti->second.getSize() != f.size || fi.getTimeStamp() != f.timeStamp) {
+                    files->erase(j);
+                    journalRemove(aDir + f.name);
+                } else {
+                    fi.setUsed(true);
+                    f.root = fi.getRoot();
+                    f.current = true;
+                }
+                continue;
+            }
+        }
+
+        // old versions kept the paths in lower case
+        if (!lowerChecked) {
+            lowerChecked = true;
+            DirIter li = fileIndex.find(Text::toLower(aDir));
+            if (li != fileIndex.end())
+                lowerFiles = &li->second;
+        }
+        if (lowerFiles) {
+            FileInfoIter j = lowerFiles->find(Text::toLower(f.name));
+            if (j != lowerFiles->end()) {
+                j->second.setUsed(true);
+                aLegacy.push_back(make_pair(k, j->second.getRoot()));
+            }
+        }
+    }
+}
+
+void HashManager::HashStore::markUsed(const string& aDir, const StringList& aNames) {
+    DirIter i = fileIndex.find(aDir);
+    if (i == fileIndex.end())
+        return;
+
+    for (auto k = aNames.begin(); k != aNames.end(); ++k) {
+        FileInfoIter j = i->second.find(*k);
+        if (j != i->second.end())
+            j->second.setUsed(true);
+    }
+}
+
 void HashManager::HashStore::rebuild() {
     try {
         DirMap newFileIndex;
@@ -365,12 +546,12 @@ void HashManager::HashStore::rebuild() {
 
         for (DirIter i = fileIndex.begin(); i != fileIndex.end(); ++i) {
             for (FileInfoIter j = i->second.begin(); j != i->second.end(); ++j) {
-                if (!j->getUsed())
+                if (!j->second.getUsed())
                     continue;
 
-                TreeIter k = treeIndex.find(j->getRoot());
+                TreeIter k = treeIndex.find(j->second.getRoot());
                 if (k != treeIndex.end()) {
-                    newTreeIndex[j->getRoot()] = k->second;
+                    newTreeIndex[j->second.getRoot()] = k->second;
                 }
             }
         }
@@ -399,8 +580,8 @@ void HashManager::HashStore::rebuild() {
             DirIter fi = newFileIndex.insert(make_pair(i->first, FileInfoList())).first;
 
             for (FileInfoIter j = i->second.begin(); j != i->second.end(); ++j) {
-                if (newTreeIndex.find(j->getRoot()) != newTreeIndex.end()) {
-                    fi->second.push_back(*j);
+                if (newTreeIndex.find(j->second.getRoot()) != newTreeIndex.end()) {
+                    fi->second.insert(*j);
                 }
             }
 
@@ -412,67 +593,308 @@ void HashManager::HashStore::rebuild() {
         File::renameFile(tmpName, origName);
         treeIndex = newTreeIndex;
         fileIndex = newFileIndex;
-        dirty = true;
-        save();
+        writeIndex();
     } catch (const Exception& e) {
         LogManager::getInstance()->message(str(F_("Hashing failed: %1%") % e.getError()));
     }
 }
 
+void HashManager::HashStore::journalTree(const TTHValue& root, const TreeInfo& ti) {
+    journal += static_cast<char>(JOURNAL_TREE);
+    putTreeRecord(journal, root, ti.getSize(), ti.getIndex(), ti.getBlockSize());
+}
+
+void HashManager::HashStore::journalFile(const string& aFileName, const FileInfo& fi) {
+    journal += static_cast<char>(JOURNAL_FILE);
+    putFileRecord(journal, fi.getRoot(), fi.getTimeStamp(), aFileName);
+}
+
+void HashManager::HashStore::journalRemove(const string& aFileName) {
+    journal += static_cast<char>(JOURNAL_REMOVE);
+    put(journal, aFileName);
+}
+
 void HashManager::HashStore::save() {
-    if (dirty) {
+    // the snapshot couldn't be read back, so neither loading nor compacting can use it
+    if (indexBroken && !compacting)
+        writeIndex();
+
+    if (!journal.empty()) {
         try {
-            File ff(getIndexFile() + ".tmp", File::WRITE, File::CREATE | File::TRUNCATE);
-            BufferedOutputStream<false> f(&ff);
+            File f(getJournalFile(), File::WRITE, File::OPEN | File::CREATE);
+            int64_t pos = f.getSize();
+            if (pos <= 0) {
+                string header;
+                put(header, JOURNAL_MAGIC);
+                put(header, INDEX_VERSION);
+                journal.insert(0, header);
+                pos = 0;
+            }
+
+            f.setPos(pos);
+            try {
+                f.write(journal);
+            } catch (const FileException&) {
+                // don't leave a torn record in front of the ones written next time
+                f.setSize(pos);
+                throw;
+            }
 
-            string tmp;
-            string b32tmp;
-
-            f.write(SimpleXML::utf8Header);
-            f.write(LIT("<HashStore Version=\"" HASH_FILE_VERSION_STRING "\">\r\n"));
-
-            f.write(LIT("\t<Trees>\r\n"));
-
-            for (TreeIter i = treeIndex.begin(); i != treeIndex.end(); ++i) {
-                const TreeInfo& ti = i->second;
-                f.write(LIT("\t\t<Hash Type=\"TTH\" Index=\""));
-                f.write(Util::toString(ti.getIndex()));
-                f.write(LIT("\" BlockSize=\""));
-                f.write(Util::toString(ti.getBlockSize()));
-                f.write(LIT("\" Size=\""));
-                f.write(Util::toString(ti.getSize()));
-                f.write(LIT("\" Root=\""));
-                b32tmp.clear();
-                f.write(i->first.toBase32(b32tmp));
-                f.write(LIT("\"/>\r\n"));
+            journalSize = pos + journal.size();
+            journal.clear();
+        } catch (const FileException& e) {
+            LogManager::getInstance()->message(str(F_("Error saving hash data: %1%") % e.getError()));
+        }
+    }
+
+    if (!compacting && journalSize > max(MIN_COMPACT_SIZE, File::getSize(getIndexFile()) / 4)) {
+        string rotated = getJournalFile() + ".old";
+        try {
+            // a journal left over from a failed compaction is folded in first
+            if (!Util::fileExists(rotated)) {
+                File::renameFile(getJournalFile(), rotated);
+                journalSize = 0;
             }
+            startCompaction();
+        } catch (const FileException& e) {
+            LogManager::getInstance()->message(str(F_("Error saving hash data: %1%") % e.getError()));
+        }
+    }
+}
+
+void HashManager::HashStore::startCompaction() {
+    if (!compactor)
+        compactor.reset(new ThreadPool("HashStore", 1, Thread::IDLE));
+
+    compacting = true;
+    compactor->add([this] { compact(); });
+}
 
-            f.write(LIT("\t</Trees>\r\n\t<Files>\r\n"));
-
-            for (DirIter i = fileIndex.begin(); i != fileIndex.end(); ++i) {
-                const string& dir = i->first;
-                for (FileInfoIter j = i->second.begin(); j != i->second.end(); ++j) {
-                    const FileInfo& fi = *j;
-                    f.write(LIT("\t\t<File Name=\""));
-                    f.write(SimpleXML::escape(dir + fi.getFileName(), tmp, true));
-                    f.write(LIT("\" TimeStamp=\""));
-                    f.write(Util::toString(fi.getTimeStamp()));
-                    f.write(LIT("\" Root=\""));
-                    b32tmp.clear();
-                    f.write(fi.getRoot().toBase32(b32tmp));
-                    f.write(LIT("\"/>\r\n"));
+void HashManager::HashStore::compact() noexcept {
+    string rotated = getJournalFile() + ".old";
+    string tmpName = getIndexFile() + ".tmp";
+
+    try {
+        // the journal is small next to the index, so it's sorted in memory and merged with the
+        // (sorted) index while that is copied over
+        struct Change {
+            Change() : timeStamp(0), removed(false) { }
+            TTHValue root;
+            uint32_t timeStamp;
+            bool removed;
+        };
+        typedef map<string, Change> ChangeMap;
+
+        map<TTHValue, TreeInfo> trees;
+        map<string, ChangeMap> dirs;
+
+        replayJournal(FileImage(rotated),
+            [&](const TTHValue& root, int64_t size, int64_t index, int64_t blockSize) {
+                trees[root] = TreeInfo(size, index, blockSize);
+            },
+            [&](const string& aFileName, const TTHValue& root, uint32_t timeStamp) {
+                Change& c = dirs[Util::getFilePath(aFileName)][Util::getFileName(aFileName)];
+                c.root = root;
+                c.timeStamp = timeStamp;
+                c.removed = false;
+            },
+            [&](const string& aFileName) {
+                dirs[Util::getFilePath(aFileName)][Util::getFileName(aFileName)].removed = true;
+            });
+
+        unique_ptr<FileImage> old;
+        if (Util::fileExists(getIndexFile()))
+            old.reset(new FileImage(getIndexFile()));
+
+        BinaryReader r = old ? old->reader() : BinaryReader(nullptr, 0);
+        uint64_t oldTrees = 0, oldDirs = 0;
+        if (old && !getIndexHeader(r, oldTrees, oldDirs))
+            throw HashException(_("Invalid hash index"));
+
+        uint64_t treeCount = 0, dirCount = 0;
+        {
+            File ff(tmpName, File::WRITE, File::CREATE | File::TRUNCATE);
+            BufferedOutputStream<false> f(&ff);
+            string buf;
+
+            putIndexHeader(buf, 0, 0);
+            f.write(buf);
+
+            auto writeTree = [&](const TTHValue& root, const TreeInfo& ti) {
+                buf.clear();
+                putTreeRecord(buf, root, ti.getSize(), ti.getIndex(), ti.getBlockSize());
+                f.write(buf);
+                ++treeCount;
+            };
+
+            auto j = trees.begin();
+            for (uint64_t i = 0; i < oldTrees; ++i) {
+                TTHValue root;
+                int64_t size, index, blockSize;
+                if (!getTreeRecord(r, root, size, index, blockSize))
+                    throw HashException(_("Invalid hash index"));
+
+                for (; j != trees.end() && j->first < root; ++j)
+                    writeTree(j->first, j->second);
+                if (j != trees.end() && j->first == root)
+                    continue;
+                writeTree(root, TreeInfo(size, index, blockSize));
+            }
+            for (; j != trees.end(); ++j)
+                writeTree(j->first, j->second);
+
+            string name, files;
+            auto writeDir = [&](const string& aDir, uint32_t oldFiles, const ChangeMap& changes) {
+                files.clear();
+                uint32_t n = 0;
+
+                auto c = changes.begin();
+                auto writeChange = [&] {
+                    if (!c->second.removed) {
+                        putFileRecord(files, c->second.root, c->second.timeStamp, c->first);
+                        ++n;
+                    }
+                    ++c;
+                };
+
+                for (uint32_t k = 0; k < oldFiles; ++k) {
+                    TTHValue root;
+                    uint32_t timeStamp;
+                    if (!getFileRecord(r, root, timeStamp, name))
+                        throw HashException(_("Invalid hash index"));
+
+                    while (c != changes.end() && c->first < name)
+                        writeChange();
+                    if (c != changes.end() && c->first == name) {
+                        writeChange();
+                        continue;
+                    }
+                    putFileRecord(files, root, timeStamp, name);
+                    ++n;
+                }
+                while (c != changes.end())
+                    writeChange();
+
+                if (n > 0) {
+                    buf.clear();
+                    put(buf, aDir);
+                    put(buf, n);
+                    f.write(buf);
+                    f.write(files);
+                    ++dirCount;
+                }
+            };
+
+            const ChangeMap none;
+            string dir;
+            auto d = dirs.begin();
+            for (uint64_t i = 0; i < oldDirs; ++i) {
+                uint32_t count;
+                if (!r.get(dir) || !r.get(count))
+                    throw HashException(_("Invalid hash index"));
+
+                for (; d != dirs.end() && d->first < dir; ++d)
+                    writeDir(d->first, 0, d->second);
+                if (d != dirs.end() && d->first == dir) {
+                    writeDir(dir, count, d->second);
+                    ++d;
+                } else {
+                    writeDir(dir, count, none);
                 }
             }
-            f.write(LIT("\t</Files>\r\n</HashStore>"));
+            for (; d != dirs.end(); ++d)
+                writeDir(d->first, 0, d->second);
+
             f.flush();
-            ff.close();
-            File::deleteFile( getIndexFile());
-            File::renameFile(getIndexFile() + ".tmp", getIndexFile());
+            buf.clear();
+            putIndexHeader(buf, treeCount, dirCount);
+            ff.setPos(0);
+            ff.write(buf);
+        }
 
-            dirty = false;
-        } catch (const FileException& e) {
-            LogManager::getInstance()->message(str(F_("Error saving hash data: %1%") % e.getError()));
+        old.reset();
+        File::deleteFile(getIndexFile());
+        File::renameFile(tmpName, getIndexFile());
+        File::deleteFile(rotated);
+    } catch (const HashException& e) {
+        File::deleteFile(tmpName);
+        LogManager::getInstance()->message(str(F_("Error saving hash data: %1%") % e.getError()));
+        indexBroken = true;
+    } catch (const Exception& e) {
+        File::deleteFile(tmpName);
+        LogManager::getInstance()->message(str(F_("Error saving hash data: %1%") % e.getError()));
+    }
+
+    compacting = false;
+}
+
+void HashManager::HashStore::writeIndex() {
+    // a compaction still running would only be replaced by this snapshot
+    compactor.reset();
+    compacting = false;
+
+    try {
+        vector<TreeMap::const_iterator> trees;
+        trees.reserve(treeIndex.size());
+        for (auto i = treeIndex.cbegin(); i != treeIndex.cend(); ++i)
+            trees.push_back(i);
+        sort(trees.begin(), trees.end(), [](const TreeMap::const_iterator& a, const TreeMap::const_iterator& b) {
+            return a->first < b->first;
+        });
+
+        vector<DirMap::const_iterator> dirs;
+        for (auto i = fileIndex.cbegin(); i != fileIndex.cend(); ++i) {
+            if (!i->second.empty())
+                dirs.push_back(i);
+        }
+        sort(dirs.begin(), dirs.end(), [](const DirMap::const_iterator& a, const DirMap::const_iterator& b) {
+            return a->first < b->first;
+        });
+
+        string tmpName = getIndexFile() + ".tmp";
+        {
+            File ff(tmpName, File::WRITE, File::CREATE | File::TRUNCATE);
+            BufferedOutputStream<false> f(&ff);
+            string buf;
+
+            putIndexHeader(buf, trees.size(), dirs.size());
+            f.write(buf);
+
+            for (auto i = trees.begin(); i != trees.end(); ++i) {
+                const TreeInfo& ti = (*i)->second;
+                buf.clear();
+                putTreeRecord(buf, (*i)->first, ti.getSize(), ti.getIndex(), ti.getBlockSize());
+                f.write(buf);
+            }
+
+            vector<FileInfoList::const_iterator> files;
+            for (auto i = dirs.begin(); i != dirs.end(); ++i) {
+                files.clear();
+                for (auto j = (*i)->second.cbegin(); j != (*i)->second.cend(); ++j)
+                    files.push_back(j);
+                sort(files.begin(), files.end(), [](const FileInfoList::const_iterator& a, const FileInfoList::const_iterator& b) {
+                    return a->first < b->first;
+                });
+
+                buf.clear();
+                put(buf, (*i)->first);
+                put(buf, static_cast<uint32_t>(files.size()));
+                for (auto j = files.begin(); j != files.end(); ++j)
+                    putFileRecord(buf, (*j)->second.getRoot(), (*j)->second.getTimeStamp(), (*j)->first);
+                f.write(buf);
+            }
+            f.flush();
         }
+
+        File::deleteFile(getIndexFile());
+        File::renameFile(tmpName, getIndexFile());
+        File::deleteFile(getJournalFile());
+        File::deleteFile(getJournalFile() + ".old");
+        journal.clear();
+        journalSize = 0;
+        indexBroken = false;
+    } catch (const FileException& e) {
+        LogManager::getInstance()->message(str(F_("Error saving hash data: %1%") % e.getError()));
     }
 }
 
@@ -498,17 +920,108 @@ private:
 };
 
 void HashManager::HashStore::load() {
+    Util::migrate(getIndexFile());
+    Util::migrate(getJournalFile());
+    Util::migrate(getXmlIndexFile());
+
     try {
-        Util::migrate(getIndexFile());
+        if (Util::fileExists(getIndexFile())) {
+            try {
+                loadIndex();
+            } catch (const HashException&) {
+                // keep what could be read; the journals still apply on top of it
+                indexBroken = true;
+                throw;
+            }
+        } else if (Util::fileExists(getXmlIndexFile())) {
+            // first start after the switch from HashIndex.xml; that file is left alone for older versions
+            loadXml();
+            writeIndex();
+        }
+    } catch (const Exception& e) {
+        LogManager::getInstance()->message(str(F_("Error loading hash data: %1%") % e.getError()));
+    }
 
-        HashLoader l(*this);
-        File f(getIndexFile(), File::READ, File::OPEN);
-        SimpleXMLReader(&l).parse(f);
-    } catch (const Exception&) {
-        // ...
+    string rotated = getJournalFile() + ".old";
+    if (Util::fileExists(rotated))
+        loadJournal(rotated);
+    if (Util::fileExists(getJournalFile()))
+        loadJournal(getJournalFile());
+
+    journalSize = max(File::getSize(getJournalFile()), (int64_t)0);
+
+    if (indexBroken)
+        writeIndex();
+    else if (Util::fileExists(rotated)) // a compaction was interrupted
+        startCompaction();
+}
+
+void HashManager::HashStore::loadIndex() {
+    FileImage image(getIndexFile());
+    BinaryReader r = image.reader();
+
+    uint64_t trees, dirs;
+    if (!getIndexHeader(r, trees, dirs))
+        throw HashException(_("Invalid hash index"));
+
+    TTHValue root;
+    treeIndex.reserve(trees);
+    for (uint64_t i = 0; i < trees; ++i) {
+        int64_t size, index, blockSize;
+        if (!getTreeRecord(r, root, size, index, blockSize))
+            throw HashException(_("Invalid hash index"));
+        treeIndex.insert(make_pair(root, TreeInfo(size, index, blockSize)));
+    }
+
+    string dir, name;
+    fileIndex.reserve(dirs);
+    for (uint64_t i = 0; i < dirs; ++i) {
+        uint32_t count;
+        if (!r.get(dir) || !r.get(count))
+            throw HashException(_("Invalid hash index"));
+
+        FileInfoList& files = fileIndex[dir];
+        files.reserve(files.size() + count);
+        for (uint32_t j = 0; j < count; ++j) {
+            uint32_t timeStamp;
+            if (!getFileRecord(r, root, timeStamp, name))
+                throw HashException(_("Invalid hash index"));
+            files.insert(make_pair(name, FileInfo(root, timeStamp, false)));
+        }
+    }
+}
+
+void HashManager::HashStore::loadJournal(const string& name) {
+    try {
+        int64_t validSize = replayJournal(FileImage(name),
+            [this](const TTHValue& root, int64_t size, int64_t index, int64_t blockSize) {
+                treeIndex[root] = TreeInfo(size, index, blockSize);
+            },
+            [this](const string& aFileName, const TTHValue& root, uint32_t timeStamp) {
+                FileInfoList& fileList = fileIndex[Util::getFilePath(aFileName)];
+                fileList.erase(Util::getFileName(aFileName));
+                fileList.insert(make_pair(Util::getFileName(aFileName), FileInfo(root, timeStamp, false)));
+            },
+            [this](const string& aFileName) {
+                DirIter i = fileIndex.find(Util::getFilePath(aFileName));
+                if (i != fileIndex.end())
+                    i->second.erase(Util::getFileName(aFileName));
+            });
+
+        // cut off a torn record, or nothing appended after it would ever be read
+        if (validSize < File::getSize(name))
+            File(name, File::WRITE, File::OPEN).setSize(validSize);
+    } catch (const Exception& e) {
+        LogManager::getInstance()->message(str(F_("Error loading hash data: %1%") % e.getError()));
     }
 }
 
+void HashManager::HashStore::loadXml() {
+    HashLoader l(*this);
+    File f(getXmlIndexFile(), File::READ, File::OPEN);
+    SimpleXMLReader(&l).parse(f);
+}
+
 static const string sHashStore = "HashStore";
 static const string sversion = "version"; // Oops, v1 was like this
 static const string sVersion = "Version";
@@ -552,8 +1065,8 @@ void HashLoader::startTag(const string& name, StringPairList& attribs, bool simp
                 string fname = Util::getFileName(file);
                 string fpath = Util::getFilePath(file);
 
-                store.fileIndex[fpath].push_back(HashManager::HashStore::FileInfo(fname, TTHValue(root), timeStamp,
-                    false));
+                store.fileIndex[fpath].insert(make_pair(fname, HashManager::HashStore::FileInfo(TTHValue(root), timeStamp,
+                    false)));
             }
         } else if (name == sTrees) {
             inTrees = !simple;
@@ -570,7 +1083,7 @@ void HashLoader::endTag(const string& name, const string&) {
 }
 
 HashManager::HashStore::HashStore() :
-    dirty(false) {
+    journalSize(0), compacting(false), indexBroken(false) {
 
     Util::migrate(getDataFile());
 
@@ -583,6 +1096,11 @@ HashManager::HashStore::HashStore() :
     }
 }
 
+HashManager::HashStore::~HashStore() {
+    // let a running compaction finish
+    compactor.reset();
+}
+
 /**
  * Creates the data files for storing hash values.
  * The data file is very simple in its format. The first 8 bytes
@@ -676,6 +1194,12 @@ void HashManager::Hasher::instantPause() {
     }
 }
 
+void HashManager::Hasher::waitResume() {
+    while(isPaused() && !stop) {
+        Thread::sleep(100);
+    }
+}
+
 #ifdef _WIN32
 #define BUF_SIZE (256*1024)
 
@@ -805,6 +1329,47 @@ static void sigbus_handler(int signum
 #endif
 }
 
+bool HashManager::Hasher::readHash(const string& filename, TigerTree& tth, int64_t size, CRC32Filter* xcrc32) {
+    const int maxHashSpeed = SETTING(MAX_HASH_SPEED);
+    try {
+        HashReader reader(filename, size, static_cast<HashReader::Mode>(SETTING(HASH_READ_MODE)), BOOLSETTING(HASH_DIRECT_IO));
+
+        uint64_t lastRead = GET_TICK();
+        const uint8_t* buf;
+        size_t n;
+        while((buf = reader.next(n)) != NULL) {
+            // the blocks that are read ahead are few, so holding back the hashing holds back the reading as well
+            if(maxHashSpeed > 0) {
+                uint64_t now = GET_TICK();
+                uint64_t minTime = n * 1000LL / (maxHashSpeed * 1024LL * 1024LL);
+                if(lastRead + minTime > now) {
+                    Thread::sleep(minTime - (now - lastRead));
+                }
+                lastRead = lastRead + minTime;
+            } else {
+                lastRead = GET_TICK();
+            }
+
+            tth.update(buf, n);
+            if(xcrc32)
+                (*xcrc32)(buf, n);
+
+            {
+                Lock l(cs);
+                currentSize = max(currentSize - static_cast<int64_t>(n), static_cast<int64_t>(0));
+            }
+
+            instantPause();
+            if(stop)
+                return false;
+        }
+        return true;
+    } catch(const Exception& e) {
+        dcdebug("Error reading file %s: %s\n", filename.c_str(), e.getError().c_str());
+        return false;
+    }
+}
+
 bool HashManager::Hasher::fastHash(const string& filename, uint8_t* , TigerTree& tth, int64_t size, CRC32Filter* xcrc32) {
     instantPause();
 
@@ -815,6 +1380,13 @@ bool HashManager::Hasher::fastHash(const string& filename, uint8_t* , TigerTree&
         return true;
     }
 
+    if(SETTING(HASH_READ_MODE) != HashReader::MODE_MMAP) {
+        bool ok = readHash(filename, tth, size, xcrc32);
+        if(ok)
+            streamStore.saveTree(filename, tth);
+        return ok;
+    }
+
     static const int64_t BUF_BYTES = (SETTING(HASH_BUFFER_SIZE_MB) >= 1)? SETTING(HASH_BUFFER_SIZE_MB)*1024*1024 : 0x800000;
     static const int64_t BUF_SIZE = BUF_BYTES - (BUF_BYTES % getpagesize());
 
@@ -936,23 +1508,264 @@ bool HashManager::Hasher::fastHash(const string& filename, uint8_t* , TigerTree&
 }
 
 #endif // !_WIN32
+// Files at least this big are split into parts hashed on all hasher threads at once
+#define PARALLEL_HASH_SIZE (64*1024*1024)
+// Size of such a part (rounded to a multiple of the tree block size)
+#define PARALLEL_SEGMENT_SIZE (16*1024*1024)
+#define SEGMENT_BUF_SIZE (1024*1024)
+
+#ifndef _WIN32
+static int64_t getHashBufSize() {
+    static const int64_t BUF_BYTES = (SETTING(HASH_BUFFER_SIZE_MB) >= 1)? SETTING(HASH_BUFFER_SIZE_MB)*1024*1024 : 0x800000;
+    static const int64_t BUF_SIZE = BUF_BYTES - (BUF_BYTES % getpagesize());
+    return BUF_SIZE;
+}
+#define BUF_SIZE getHashBufSize()
+#endif
+
+void HashManager::Hasher::processFile(HashJob& job, uint8_t* buf, bool virtualBuf, bool pooled) {
+    const string& fname = job.fileName;
+    int64_t size = File::getSize(fname);
+    try {
+        File f(fname, File::READ, File::OPEN);
+        int64_t bs = max(TigerTree::calcBlockSize(f.getSize(), 10), MIN_BLOCK_SIZE);
+        uint64_t start = GET_TICK();
+        uint32_t timestamp = f.getLastModified();
+        TigerTree slowTTH(bs);
+        TigerTree* tth = &slowTTH;
+
+        CRC32Filter crc32;
+        SFVReader sfv(fname);
+        CRC32Filter* xcrc32 = 0;
+        if(sfv.hasCRC())
+            xcrc32 = &crc32;
+
+        TigerTree fastTTH(bs);
+        tth = &fastTTH;
+
+        // fastHash relies on process wide signal handling, so pool threads always read the file
+#ifdef _WIN32
+        if(pooled || !virtualBuf || !BOOLSETTING(FAST_HASH) || !fastHash(fname, buf, fastTTH, size, xcrc32)) {
+#else
+        (void)virtualBuf;
+        if(pooled || !BOOLSETTING(FAST_HASH) || !fastHash(fname, 0, fastTTH, size, xcrc32)) {
+#endif
+            ByteVector poolBuf;
+            size_t bufSize = BUF_SIZE;
+            if(pooled) {
+                poolBuf.resize(static_cast<size_t>(max(min(size, static_cast<int64_t>(bufSize)), static_cast<int64_t>(1))));
+                buf = &poolBuf[0];
+                bufSize = poolBuf.size();
+            }
+
+            tth = &slowTTH;
+            crc32 = CRC32Filter();
+            uint64_t lastRead = GET_TICK();
+            size_t n = 0;
+            do {
+                size_t readSize = bufSize;
+                if(SETTING(MAX_HASH_SPEED)> 0) {
+                    uint64_t now = GET_TICK();
+                    uint64_t minTime = n * 1000LL / (SETTING(MAX_HASH_SPEED) * 1024LL * 1024LL);
+                    if(lastRead + minTime> now) {
+                        Thread::sleep(minTime - (now - lastRead));
+                    }
+                    lastRead = lastRead + minTime;
+                } else {
+                    lastRead = GET_TICK();
+                }
+                n = f.read(buf, readSize);
+                tth->update(buf, n);
+                if(xcrc32)
+                    (*xcrc32)(buf, n);
+
+                {
+                    Lock l(cs);
+                    currentSize = max(static_cast<uint64_t>(currentSize - n), static_cast<uint64_t>(0));
+                }
+
+                if(pooled)
+                    waitResume();
+                else
+                    instantPause();
+            } while (n> 0 && !stop);
+        }
+
+        f.close();
+        tth->finalize();
+        uint64_t end = GET_TICK();
+        int64_t speed = 0;
+        if(end> start) {
+            speed = size * _LL(1000) / (end - start);
+        }
+        if(xcrc32 && xcrc32->getValue() != sfv.getCRC()) {
+            LogManager::getInstance()->message(str(F_("%1% not shared; calculated CRC32 does not match the one found in SFV file.") % Util::addBrackets(fname)));
+        } else {
+            job.tth = *tth;
+            job.timeStamp = timestamp;
+            job.speed = speed;
+            job.size = size;
+            job.ok = !stop;
+        }
+    } catch(const FileException& e) {
+        LogManager::getInstance()->message(str(F_("Error hashing %1%: %2%") % Util::addBrackets(fname) % e.getError()));
+    }
+}
+
+bool HashManager::Hasher::hashSegment(const string& fname, int64_t start, int64_t len, TigerTree& tt) {
+    File f(fname, File::READ, File::OPEN);
+    f.setPos(start);
+
+    ByteVector buf(static_cast<size_t>(min(len, static_cast<int64_t>(SEGMENT_BUF_SIZE))));
+    while(len > 0) {
+        waitResume();
+        if(stop)
+            return false;
+
+        // the tree wants whole base blocks, so don't pass on short reads
+        size_t n = static_cast<size_t>(min(len, static_cast<int64_t>(buf.size())));
+        for(size_t pos = 0; pos < n; ) {
+            size_t m = n - pos;
+            if(f.read(&buf[pos], m) == 0)
+                throw FileException(_("File changed while hashing"));
+            pos += m;
+        }
+
+        tt.update(&buf[0], n);
+        len -= n;
+
+        Lock l(cs);
+        currentSize = max(currentSize - static_cast<int64_t>(n), static_cast<int64_t>(0));
+    }
+
+    tt.finalize();
+    return true;
+}
+
+/**
+ * Every leaf only depends on its own block, so the file is cut into block aligned parts
+ * hashed on the pool threads and their leaves are joined into the final tree afterwards.
+ */
+void HashManager::Hasher::processParallel(HashJob& job) {
+    const string& fname = job.fileName;
+    try {
+        File f(fname, File::READ, File::OPEN);
+        const int64_t size = f.getSize();
+        const uint32_t timestamp = f.getLastModified();
+        f.close();
+
+        const int64_t bs = max(TigerTree::calcBlockSize(size, 10), MIN_BLOCK_SIZE);
+        const int64_t segmentSize = max(bs, PARALLEL_SEGMENT_SIZE / bs * bs);
+        const size_t segments = static_cast<size_t>((size + segmentSize - 1) / segmentSize);
+        uint64_t start = GET_TICK();
+
+        struct Segment {
+            Segment(int64_t aBlockSize) : tt(aBlockSize), ok(false) { }
+            TigerTree tt;
+            bool ok;
+            string error;
+        };
+        vector<Segment> parts(segments, Segment(bs));
+        Semaphore done;
+
+        for(size_t i = 0; i < segments; ++i) {
+            const int64_t pos = i * segmentSize;
+            const int64_t len = min(segmentSize, size - pos);
+            Segment& part = parts[i];
+            pool->add([this, &fname, &part, &done, pos, len] {
+                try {
+                    part.ok = hashSegment(fname, pos, len, part.tt);
+                } catch(const FileException& e) {
+                    part.error = e.getError();
+                }
+                done.signal();
+            });
+        }
+        for(size_t i = 0; i < segments; ++i)
+            done.wait();
+
+        ByteVector leaves;
+        leaves.reserve(TigerTree::calcBlocks(size, bs) * TigerTree::BYTES);
+        for(auto& part: parts) {
+            if(!part.ok) {
+                if(!part.error.empty())
+                    throw FileException(part.error);
+                return;
+            }
+            for(auto& leaf: part.tt.getLeaves())
+                leaves.insert(leaves.end(), leaf.data, leaf.data + TigerTree::BYTES);
+        }
+
+        job.tth = TigerTree(size, bs, &leaves[0]);
+        job.timeStamp = timestamp;
+        job.size = size;
+        uint64_t end = GET_TICK();
+        if(end > start)
+            job.speed = size * _LL(1000) / (end - start);
+        job.ok = true;
+    } catch(const FileException& e) {
+        LogManager::getInstance()->message(str(F_("Error hashing %1%: %2%") % Util::addBrackets(fname) % e.getError()));
+    }
+}
+
+void HashManager::Hasher::jobFinished(HashJob& job) {
+    if(job.ok && !stop)
+        HashManager::getInstance()->hashDone(job.fileName, job.timeStamp, job.tth, job.speed, job.size);
+}
+
+/**
+ * Passes on the results of pool jobs in the order the files were taken, waiting
+ * until no more than maxPending jobs are left.
+ */
+void HashManager::Hasher::finishJobs(size_t maxPending) {
+    for(;;) {
+        HashJob* job = nullptr;
+        {
+            Lock l(cs);
+            if(jobs.empty())
+                return;
+            if(jobs.front()->done) {
+                job = jobs.front();
+                jobs.pop_front();
+            } else if(jobs.size() <= maxPending) {
+                return;
+            }
+        }
+
+        if(job) {
+            jobFinished(*job);
+            delete job;
+        } else {
+            jobDone.wait();
+        }
+    }
+}
+
 int HashManager::Hasher::run() {
     setThreadPriority(Thread::IDLE);
     setThreadName("Hasher");
     uint8_t* buf = NULL;
     bool virtualBuf = true;
     string fname;
+    int64_t fsize = 0;
     bool last = false;
+
+    if(SETTING(HASHER_THREADS) > 1)
+        pool.reset(new ThreadPool("Hasher", SETTING(HASHER_THREADS), Thread::IDLE));
+
     pause();
     for(;;) {
 
         if (w.empty()) {
+            // whatever the pool is still busy with must be passed on before going to sleep
+            finishJobs(0);
             s.wait();
         }
 
         if(stop)
             break;
         if(rebuild) {
+            finishJobs(0);
             HashManager::getInstance()->doRebuild();
             rebuild = false;
             LogManager::getInstance()->message(_("Hash database rebuilt"));
@@ -962,7 +1775,8 @@ int HashManager::Hasher::run() {
             Lock l(cs);
             if(!w.empty()) {
                 currentFile = fname = w.begin()->first;
-                currentSize = w.begin()->second;
+                fsize = w.begin()->second;
+                currentSize += fsize;
                 w.erase(w.begin());
                 last = w.empty();
             } else {
@@ -970,113 +1784,88 @@ int HashManager::Hasher::run() {
                 fname.clear();
             }
         }
-        running = true;
         instantPause();
 
         if(!fname.empty()) {
-            int64_t size = File::getSize(fname);
-#ifdef _WIN32
-            if(buf == NULL) {
-                virtualBuf = true;
-                buf = (uint8_t*)VirtualAlloc(NULL, 2*BUF_SIZE, MEM_COMMIT, PAGE_READWRITE);
-            }
-#else
-            static const int64_t BUF_BYTES = (SETTING(HASH_BUFFER_SIZE_MB) >= 1)? SETTING(HASH_BUFFER_SIZE_MB)*1024*1024 : 0x800000;
-            static const int64_t BUF_SIZE = BUF_BYTES - (BUF_BYTES % getpagesize());
-#endif
-
-            if(buf == NULL) {
-                virtualBuf = false;
-                buf = new uint8_t[BUF_SIZE];
-            }
-            try {
-                File f(fname, File::READ, File::OPEN);
-                int64_t bs = max(TigerTree::calcBlockSize(f.getSize(), 10), MIN_BLOCK_SIZE);
-                uint64_t start = GET_TICK();
-                uint32_t timestamp = f.getLastModified();
-                TigerTree slowTTH(bs);
-                TigerTree* tth = &slowTTH;
-
-                CRC32Filter crc32;
-                SFVReader sfv(fname);
-                CRC32Filter* xcrc32 = 0;
-                if(sfv.hasCRC())
-                xcrc32 = &crc32;
-
-                TigerTree fastTTH(bs);
-                tth = &fastTTH;
-
-#ifdef _WIN32
-                if(!virtualBuf || !BOOLSETTING(FAST_HASH) || !fastHash(fname, buf, fastTTH, size, xcrc32)) {
-#else
-                if(!BOOLSETTING(FAST_HASH) || !fastHash(fname, 0, fastTTH, size, xcrc32)) {
-#endif
-                    tth = &slowTTH;
-                    crc32 = CRC32Filter();
-                    uint64_t lastRead = GET_TICK();
-                    size_t n = 0;
-                    do {
-                        size_t bufSize = BUF_SIZE;
-                        if(SETTING(MAX_HASH_SPEED)> 0) {
-                            uint64_t now = GET_TICK();
-                            uint64_t minTime = n * 1000LL / (SETTING(MAX_HASH_SPEED) * 1024LL * 1024LL);
-                            if(lastRead + minTime> now) {
-                                Thread::sleep(minTime - (now - lastRead));
-                            }
-                            lastRead = lastRead + minTime;
-                        } else {
-                            lastRead = GET_TICK();
-                        }
-                        n = f.read(buf, bufSize);
-                        tth->update(buf, n);
-                        if(xcrc32)
-                            (*xcrc32)(buf, n);
-
-                        {
-                            Lock l(cs);
-                            currentSize = max(static_cast<uint64_t>(currentSize - n), static_cast<uint64_t>(0));
-                        }
-
-                    instantPause();
-                    } while (n> 0 && !stop);
-                }
-
-                f.close();
-                tth->finalize();
-                uint64_t end = GET_TICK();
-                int64_t speed = 0;
-                if(end> start) {
-                    speed = size * _LL(1000) / (end - start);
-                }
-                if(xcrc32 && xcrc32->getValue() != sfv.getCRC()) {
-                    LogManager::getInstance()->message(str(F_("%1% not shared; calculated CRC32 does not match the one found in SFV file.") % Util::addBrackets(fname)));
+            HashJob* job = new HashJob(fname);
+            // a hash speed limit makes several readers pointless
+            if(pool && SETTING(MAX_HASH_SPEED) <= 0) {
+                if(fsize >= PARALLEL_HASH_SIZE && !SFVReader(fname).hasCRC()) {
+                    finishJobs(0);
+                    running = true;
+                    processParallel(*job);
+                    jobFinished(*job);
+                    delete job;
                 } else {
-                    HashManager::getInstance()->hashDone(fname, timestamp, *tth, speed, size);
+                    // keep every thread busy without taking too many files off the queue
+                    finishJobs(pool->size() * 2 - 1);
+                    {
+                        Lock l(cs);
+                        jobs.push_back(job);
+                    }
+                    pool->add([this, job] {
+                        processFile(*job, NULL, false, true);
+                        Lock l(cs);
+                        job->done = true;
+                        jobDone.signal();
+                    });
                 }
-                } catch(const FileException& e) {
-                    LogManager::getInstance()->message(str(F_("Error hashing %1%: %2%") % Util::addBrackets(fname) % e.getError()));
+            } else {
+                finishJobs(0);
+#ifdef _WIN32
+                if(buf == NULL) {
+                    virtualBuf = true;
+                    buf = (uint8_t*)VirtualAlloc(NULL, 2*BUF_SIZE, MEM_COMMIT, PAGE_READWRITE);
+                }
+#endif
+                if(buf == NULL) {
+                    virtualBuf = false;
+                    buf = new uint8_t[BUF_SIZE];
                 }
+                running = true;
+                processFile(*job, buf, virtualBuf, false);
+                jobFinished(*job);
+                delete job;
             }
-            {
-                Lock l(cs);
+        }
+        {
+            Lock l(cs);
+            running = false;
+            if(jobs.empty()) {
                 currentFile.clear();
                 currentSize = 0;
             }
-            running = false;
-            if(buf != NULL && (last || stop)) {
-                if(virtualBuf) {
+        }
+        if(buf != NULL && (last || stop)) {
+            if(virtualBuf) {
 #ifdef _WIN32
-                    VirtualFree(buf, 0, MEM_RELEASE);
+                VirtualFree(buf, 0, MEM_RELEASE);
 #endif
-                } else {
-                    delete [] buf;
-                }
-                buf = NULL;
+            } else {
+                delete [] buf;
             }
+            buf = NULL;
         }
-        return 0;
     }
 
+    // pool threads see stop and drop what they were doing
+    pool.reset();
+    for(auto job: jobs)
+        delete job;
+    jobs.clear();
+
+    if(buf != NULL) {
+        if(virtualBuf) {
+#ifdef _WIN32
+            VirtualFree(buf, 0, MEM_RELEASE);
+#endif
+        } else {
+            delete [] buf;
+        }
+    }
+    return 0;
+}
+
 HashManager::HashPauser::HashPauser() {
     resume = !HashManager::getInstance()->isHashingPaused();
 }
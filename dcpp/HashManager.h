@@ -29,6 +29,9 @@
 #include "Text.h"
 #include "Streams.h"
 #include "HashManagerListener.h"
+#include "ThreadPool.h"
+
+#include <atomic>
 
 #ifdef USE_XATTR
 #include "attr/attributes.h"
@@ -71,6 +74,28 @@ public:
     /** @return TTH root */
     TTHValue getTTH(const string& aFileName, int64_t aSize);
 
+    /** A file found while listing a directory, see checkTTHs() */
+    struct FileCheck {
+        FileCheck(const string& aName, int64_t aSize, uint32_t aTimeStamp) :
+            name(aName), size(aSize), timeStamp(aTimeStamp), current(false) { }
+
+        string name;
+        int64_t size;
+        uint32_t timeStamp;
+        /** Set to the TTH root when the hash is current */
+        TTHValue root;
+        bool current;
+    };
+    typedef vector<FileCheck> FileCheckList;
+
+    /**
+     * checkTTH() and getTTH() for all the files of the directory aDir (ending with a separator)
+     * in one pass; the files whose hash isn't current are queued for hashing.
+     */
+    void checkTTHs(const string& aDir, FileCheckList& aFiles);
+    /** Keep the hashes of files shared again without being checked, as when their directory is unchanged */
+    void markUsed(const string& aDir, const StringList& aNames);
+
     /** eiskaltdc++ **/
     const TTHValue* getFileTTHif(const string& aFileName);
 
@@ -130,6 +155,10 @@ private:
         void stopHashing(const string& baseDir);
         virtual int run();
         bool fastHash(const string& fname, uint8_t* buf, TigerTree& tth, int64_t size, CRC32Filter* xcrc32);
+#ifndef _WIN32
+        /** Hash the file read by a HashReader, the HashReadMode other than mmap */
+        bool readHash(const string& fname, TigerTree& tth, int64_t size, CRC32Filter* xcrc32);
+#endif
         void getStats(string& curFile, int64_t& bytesLeft, size_t& filesLeft);
         void shutdown() { stop = true; if(paused){ s.signal(); resume();} s.signal(); }
         void scheduleRebuild() { rebuild = true; if(paused) s.signal(); s.signal(); }
@@ -151,14 +180,50 @@ private:
         string currentFile;
         int64_t currentSize;
 
+        /** A file taken off the work map; results are passed on to hashDone in the order the files were taken */
+        struct HashJob {
+            HashJob(const string& aFileName) : fileName(aFileName), done(false), ok(false), timeStamp(0), size(0), speed(0) { }
+
+            string fileName;
+            bool done;
+            bool ok;
+            uint32_t timeStamp;
+            int64_t size;
+            int64_t speed;
+            TigerTree tth;
+        };
+
+        /** Worker threads, only present when more than one hasher thread is configured */
+        unique_ptr<ThreadPool> pool;
+        /** Jobs handed to the pool that haven't been passed on yet; protected by cs */
+        deque<HashJob*> jobs;
+        /** Signalled each time a pool job completes */
+        Semaphore jobDone;
+
+        void processFile(HashJob& job, uint8_t* buf, bool virtualBuf, bool pooled);
+        void processParallel(HashJob& job);
+        bool hashSegment(const string& fname, int64_t start, int64_t len, TigerTree& tt);
+        void finishJobs(size_t maxPending);
+        void jobFinished(HashJob& job);
+
         void instantPause();
+        /** Pause point for pool threads, which must leave the semaphore to the hasher thread */
+        void waitResume();
     };
 
     friend class Hasher;
 
+    /**
+     * File -> root and root -> tree mappings.
+     * The mappings are kept in HashIndex.dat, a sorted snapshot that is mapped and read in one
+     * pass at startup, plus HashIndex.journal which records the changes since. save() only
+     * appends to the journal; once it has grown large enough, it's folded into a new snapshot
+     * in the background.
+     */
     class HashStore {
     public:
         HashStore();
+        ~HashStore();
         void addFile(const string& aFileName, uint32_t aTimeStamp, const TigerTree& tth, bool aUsed);
 
         void load();
@@ -167,12 +232,18 @@ private:
         void rebuild();
 
         bool checkTTH(const string& aFileName, int64_t aSize, uint32_t aTimeStamp);
+        /**
+         * Check the files of aDir, marking the current ones used. The ones without any entry
+         * but one under the lower case name of old versions are returned in aLegacy.
+         */
+        void checkTTHs(const string& aDir, FileCheckList& aFiles, vector<pair<size_t, TTHValue> >& aLegacy);
+        void markUsed(const string& aDir, const StringList& aNames);
 
         void addTree(const TigerTree& tt) noexcept;
         const TTHValue* getTTH(const string& aFileName);
         bool getTree(const TTHValue& root, TigerTree& tth);
         size_t getBlockSize(const TTHValue& root) const;
-        bool isDirty() { return dirty; }
+        bool isDirty() { return !journal.empty(); }
     private:
         /** Root -> tree mapping info, we assume there's only one tree for each root (a collision would mean we've broken tiger...) */
         struct TreeInfo {
@@ -189,18 +260,16 @@ private:
         /** File -> root mapping info */
         struct FileInfo {
         public:
-            FileInfo(const string& aFileName, const TTHValue& aRoot, uint32_t aTimeStamp, bool aUsed) :
-                fileName(aFileName), root(aRoot), timeStamp(aTimeStamp), used(aUsed) { }
-
-            bool operator==(const string& name) { return name == fileName; }
+            FileInfo(const TTHValue& aRoot, uint32_t aTimeStamp, bool aUsed) :
+                root(aRoot), timeStamp(aTimeStamp), used(aUsed) { }
 
-            GETSET(string, fileName, FileName);
             GETSET(TTHValue, root, Root);
             GETSET(uint32_t, timeStamp, TimeStamp);
             GETSET(bool, used, Used);
         };
 
-        typedef vector<FileInfo> FileInfoList;
+        /** The files of a directory by name */
+        typedef unordered_map<string, FileInfo> FileInfoList;
         typedef FileInfoList::iterator FileInfoIter;
 
         typedef unordered_map<string, FileInfoList> DirMap;
@@ -214,14 +283,37 @@ private:
         DirMap fileIndex;
         TreeMap treeIndex;
 
-        bool dirty;
+        /** Journal records not written yet */
+        string journal;
+        /** Size of the journal file that hasn't been folded into the snapshot */
+        int64_t journalSize;
+        /** Set while the rotated journal is being folded into the snapshot */
+        std::atomic<bool> compacting;
+        /** Set when the snapshot turned out to be damaged; the next save writes a fresh one */
+        std::atomic<bool> indexBroken;
+        unique_ptr<ThreadPool> compactor;
+
+        void journalTree(const TTHValue& root, const TreeInfo& ti);
+        void journalFile(const string& aFileName, const FileInfo& fi);
+        void journalRemove(const string& aFileName);
+
+        void loadIndex();
+        void loadJournal(const string& name);
+        void loadXml();
+        /** Write the whole store as a new snapshot and drop the journals */
+        void writeIndex();
+        void startCompaction();
+        /** Fold the rotated journal into the snapshot; runs on the compactor thread */
+        void compact() noexcept;
 
         void createDataFile(const string& name);
 
         bool loadTree(File& dataFile, const TreeInfo& ti, const TTHValue& root, TigerTree& tt);
         int64_t saveTree(File& dataFile, const TigerTree& tt);
 
-        string getIndexFile() { return Util::getPath(Util::PATH_USER_CONFIG) + "HashIndex.xml"; }
+        string getIndexFile() { return Util::getPath(Util::PATH_USER_CONFIG) + "HashIndex.dat"; }
+        string getJournalFile() { return Util::getPath(Util::PATH_USER_CONFIG) + "HashIndex.journal"; }
+        string getXmlIndexFile() { return Util::getPath(Util::PATH_USER_CONFIG) + "HashIndex.xml"; }
         string getDataFile() { return Util::getPath(Util::PATH_USER_CONFIG) + "HashData.dat"; }
     };
 
@@ -0,0 +1,397 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "stdinc.h"
+
+#ifndef _WIN32
+
+#include "HashReader.h"
+
+#include "format.h"
+#include "Text.h"
+#include "Util.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(HAVE_IO_URING)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#ifdef __NR_io_uring_setup
+#define USE_IO_URING
+#endif
+#endif
+
+namespace dcpp {
+
+// O_DIRECT wants the buffers, offsets and lengths aligned to the logical block size of the device
+#define DIRECT_ALIGN 4096
+
+#ifdef USE_IO_URING
+struct HashReader::Uring {
+    Uring() : fd(-1), sqRing(MAP_FAILED), cqRing(MAP_FAILED), sqes(static_cast<io_uring_sqe*>(MAP_FAILED)),
+        sqRingSize(0), cqRingSize(0), sqesSize(0), cqes(NULL), inFlight(0) { }
+
+    int fd;
+    void* sqRing;
+    void* cqRing;
+    io_uring_sqe* sqes;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    size_t sqesSize;
+
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    io_uring_cqe* cqes;
+
+    iovec iov[BLOCKS];
+    int inFlight;
+};
+#else
+struct HashReader::Uring { };
+#endif
+
+HashReader::HashReader(const string& aFile, int64_t aSize, Mode aMode, bool aDirect) :
+    fd(-1), size(aSize), queued(0), mode(aMode), direct(false), current(-1), stopping(false), uring(NULL)
+{
+    for(size_t i = 0; i < BLOCKS; ++i) {
+        blocks[i].buf = NULL;
+        blocks[i].len = 0;
+        blocks[i].ready = false;
+    }
+
+    const string path = Text::fromUtf8(aFile);
+#ifdef O_DIRECT
+    if(aDirect) {
+        fd = ::open(path.c_str(), O_RDONLY | O_DIRECT);
+        direct = fd != -1;
+    }
+#endif
+    if(fd == -1) {
+        fd = ::open(path.c_str(), O_RDONLY);
+        if(fd == -1) {
+            throw HashReaderException(Util::translateError(errno));
+        }
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    if(!direct) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+#endif
+
+    try {
+        for(size_t i = 0; i < BLOCKS; ++i) {
+            void* p;
+            if(posix_memalign(&p, DIRECT_ALIGN, BLOCK_BYTES) != 0) {
+                throw HashReaderException(Util::translateError(ENOMEM));
+            }
+            blocks[i].buf = static_cast<uint8_t*>(p);
+        }
+
+        if(mode == MODE_URING && initUring()) {
+            for(size_t i = 0; i < BLOCKS && queue(blocks[i]); ++i) {
+                submitUring(blocks[i]);
+            }
+        } else {
+            mode = MODE_THREAD;
+            for(size_t i = 0; i < BLOCKS; ++i) {
+                freeBlocks.signal();
+            }
+            start();
+        }
+    } catch(const Exception&) {
+        closeUring();
+        for(size_t i = 0; i < BLOCKS; ++i) {
+            free(blocks[i].buf);
+        }
+        ::close(fd);
+        throw;
+    }
+}
+
+HashReader::~HashReader() {
+    if(mode == MODE_THREAD) {
+        stopping = true;
+        freeBlocks.signal();
+        join();
+    }
+
+    // the reads still running write to the buffers
+    closeUring();
+
+    for(size_t i = 0; i < BLOCKS; ++i) {
+        free(blocks[i].buf);
+    }
+    ::close(fd);
+}
+
+const uint8_t* HashReader::next(size_t& len) {
+    len = 0;
+    if(current >= 0) {
+        Block& prev = blocks[current];
+        if(prev.len == 0) {
+            return NULL;
+        }
+
+        if(mode == MODE_URING) {
+            if(queue(prev)) {
+                submitUring(prev);
+            }
+        } else {
+            freeBlocks.signal();
+        }
+    }
+
+    current = (current + 1) % BLOCKS;
+    Block& b = blocks[current];
+    if(mode == MODE_URING) {
+        waitUring(b);
+    } else {
+        readBlocks.wait();
+    }
+
+    if(b.len == 0) {
+        return NULL;
+    }
+    if(b.done < 0) {
+        throw HashReaderException(Util::translateError(static_cast<int>(-b.done)));
+    }
+    if(b.done < static_cast<int64_t>(b.len)) {
+        throw HashReaderException(_("File changed while hashing"));
+    }
+
+    len = b.len;
+    return b.buf;
+}
+
+bool HashReader::queue(Block& b) {
+    b.pos = queued;
+    b.len = static_cast<size_t>(min(static_cast<int64_t>(BLOCK_BYTES), size - queued));
+    b.done = 0;
+    b.ready = b.len == 0;
+    queued += b.len;
+    return b.len > 0;
+}
+
+int HashReader::run() {
+    setThreadName("HashReader");
+
+    for(size_t i = 0; ; ++i) {
+        freeBlocks.wait();
+        if(stopping)
+            break;
+
+        Block& b = blocks[i % BLOCKS];
+        const bool more = queue(b);
+        if(more) {
+            readBlock(b);
+        }
+        readBlocks.signal();
+        if(!more)
+            break;
+    }
+    return 0;
+}
+
+void HashReader::readBlock(Block& b) noexcept {
+    // with O_DIRECT the end of the file has to be read as a whole aligned block as well
+    const size_t end = direct ? (b.len + DIRECT_ALIGN - 1) & ~static_cast<size_t>(DIRECT_ALIGN - 1) : b.len;
+    while(b.done < static_cast<int64_t>(b.len)) {
+        ssize_t n = ::pread(fd, b.buf + b.done, end - b.done, b.pos + b.done);
+        if(n == -1) {
+            if(errno == EINTR)
+                continue;
+            b.done = -errno;
+            break;
+        }
+        if(n == 0)
+            break;
+        b.done += n;
+    }
+    b.ready = true;
+}
+
+#ifdef USE_IO_URING
+
+bool HashReader::initUring() noexcept {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int rfd = static_cast<int>(syscall(__NR_io_uring_setup, BLOCKS, &p));
+    if(rfd == -1) {
+        dcdebug("io_uring_setup failed: %s\n", Util::translateError(errno).c_str());
+        return false;
+    }
+
+    unique_ptr<Uring> u(new Uring);
+    u->fd = rfd;
+    u->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = false;
+#ifdef IORING_FEAT_SINGLE_MMAP
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        single = true;
+        u->sqRingSize = u->cqRingSize = max(u->sqRingSize, u->cqRingSize);
+    }
+#endif
+
+    u->sqRing = mmap(0, u->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQ_RING);
+    if(u->sqRing != MAP_FAILED) {
+        u->cqRing = single ? u->sqRing : mmap(0, u->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_CQ_RING);
+    }
+    if(u->cqRing != MAP_FAILED) {
+        u->sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+        u->sqes = static_cast<io_uring_sqe*>(mmap(0, u->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQES));
+    }
+
+    uring = u.release();
+    if(uring->sqes == MAP_FAILED) {
+        dcdebug("Mapping the io_uring failed: %s\n", Util::translateError(errno).c_str());
+        closeUring();
+        return false;
+    }
+
+    uint8_t* sq = static_cast<uint8_t*>(uring->sqRing);
+    uring->sqTail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    uring->sqMask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    uring->sqArray = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+
+    uint8_t* cq = static_cast<uint8_t*>(uring->cqRing);
+    uring->cqHead = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    uring->cqTail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    uring->cqMask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    uring->cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+    return true;
+}
+
+void HashReader::submitUring(Block& b) noexcept {
+    const size_t i = &b - blocks;
+    const size_t end = direct ? (b.len + DIRECT_ALIGN - 1) & ~static_cast<size_t>(DIRECT_ALIGN - 1) : b.len;
+    uring->iov[i].iov_base = b.buf + b.done;
+    uring->iov[i].iov_len = end - b.done;
+
+    // there's never more than one read per block, so the ring can't be full
+    const unsigned tail = *uring->sqTail;
+    const unsigned slot = tail & *uring->sqMask;
+    io_uring_sqe& sqe = uring->sqes[slot];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_READV;
+    sqe.fd = fd;
+    sqe.off = b.pos + b.done;
+    sqe.addr = reinterpret_cast<uintptr_t>(&uring->iov[i]);
+    sqe.len = 1;
+    sqe.user_data = i;
+    uring->sqArray[slot] = slot;
+    __atomic_store_n(uring->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+    int ret;
+    do {
+        ret = static_cast<int>(syscall(__NR_io_uring_enter, uring->fd, 1, 0, 0, NULL, 0));
+    } while(ret == -1 && errno == EINTR);
+
+    if(ret == 1) {
+        uring->inFlight++;
+    } else {
+        // the entry is left in the ring; don't queue anything after it, the hasher stops at this block
+        b.done = ret == -1 ? -errno : -EIO;
+        b.ready = true;
+        size = queued;
+    }
+}
+
+void HashReader::waitUring(Block& b) {
+    while(!b.ready) {
+        reapUring();
+    }
+}
+
+void HashReader::reapUring() {
+    unsigned head = *uring->cqHead;
+    const unsigned tail = __atomic_load_n(uring->cqTail, __ATOMIC_ACQUIRE);
+    if(head == tail) {
+        if(syscall(__NR_io_uring_enter, uring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1 && errno != EINTR) {
+            throw HashReaderException(Util::translateError(errno));
+        }
+        return;
+    }
+
+    for(; head != tail; ++head) {
+        const io_uring_cqe& cqe = uring->cqes[head & *uring->cqMask];
+        Block& x = blocks[cqe.user_data];
+        uring->inFlight--;
+        if(cqe.res < 0) {
+            x.done = cqe.res;
+            x.ready = true;
+        } else if(cqe.res == 0) {
+            x.ready = true;
+        } else {
+            x.done += cqe.res;
+            x.ready = x.done >= static_cast<int64_t>(x.len);
+            if(!x.ready) {
+                // a short read; ask for the rest
+                submitUring(x);
+            }
+        }
+    }
+    __atomic_store_n(uring->cqHead, head, __ATOMIC_RELEASE);
+}
+
+void HashReader::closeUring() noexcept {
+    if(!uring)
+        return;
+
+    try {
+        while(uring->inFlight > 0) {
+            reapUring();
+        }
+    } catch(const Exception&) {
+        // the ring itself is broken, nothing is going to complete
+    }
+
+    if(uring->sqes != MAP_FAILED)
+        munmap(uring->sqes, uring->sqesSize);
+    if(uring->cqRing != MAP_FAILED && uring->cqRing != uring->sqRing)
+        munmap(uring->cqRing, uring->cqRingSize);
+    if(uring->sqRing != MAP_FAILED)
+        munmap(uring->sqRing, uring->sqRingSize);
+    ::close(uring->fd);
+
+    delete uring;
+    uring = NULL;
+}
+
+#else // !USE_IO_URING
+
+bool HashReader::initUring() noexcept {
+    return false;
+}
+
+void HashReader::submitUring(Block&) noexcept { }
+void HashReader::waitUring(Block&) { }
+void HashReader::reapUring() { }
+void HashReader::closeUring() noexcept { }
+
+#endif // !USE_IO_URING
+
+} // namespace dcpp
+
+#endif // !_WIN32
@@ -0,0 +1,108 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#ifndef _WIN32
+
+#include "typedefs.h"
+#include "Exception.h"
+#include "Semaphore.h"
+#include "Thread.h"
+
+namespace dcpp {
+
+STANDARD_EXCEPTION(HashReaderException);
+
+/**
+ * Reads a file from the start to a given size ahead of the hasher: a few blocks are kept in
+ * flight, so that reading the next ones overlaps hashing the current one. The reads are queued
+ * with io_uring where the system supports it and done by a thread of the reader otherwise.
+ */
+class HashReader : private Thread
+{
+public:
+    /** How the hasher reads files, the HashReadMode setting */
+    enum Mode {
+        MODE_MMAP,
+        MODE_THREAD,
+        MODE_URING
+    };
+
+    /**
+     * @param aMode MODE_URING falls back to MODE_THREAD when io_uring is not available
+     * @param aDirect Bypass the page cache (O_DIRECT) if the file system allows it
+     */
+    HashReader(const string& aFile, int64_t aSize, Mode aMode, bool aDirect);
+    virtual ~HashReader();
+
+    /**
+     * @return The next block of the file or NULL after the last one; it stays valid until the
+     * following call. Throws HashReaderException when the file can't be read to the end.
+     */
+    const uint8_t* next(size_t& len);
+
+    Mode getMode() const { return mode; }
+    bool isDirect() const { return direct; }
+
+private:
+    enum { BLOCKS = 4, BLOCK_BYTES = 2 * 1024 * 1024 };
+
+    struct Block {
+        uint8_t* buf;
+        int64_t pos;
+        size_t len;
+        /** Bytes read so far, or -errno */
+        int64_t done;
+        bool ready;
+    };
+
+    virtual int run();
+
+    /** Queue the read of the block after the last one queued; false at the end of the file */
+    bool queue(Block& b);
+    void readBlock(Block& b) noexcept;
+
+    bool initUring() noexcept;
+    void submitUring(Block& b) noexcept;
+    void waitUring(Block& b);
+    /** Take the reads that completed, waiting for one if there are none */
+    void reapUring();
+    void closeUring() noexcept;
+
+    int fd;
+    int64_t size;
+    int64_t queued;
+    Mode mode;
+    bool direct;
+
+    Block blocks[BLOCKS];
+    /** The block returned by the last next(), -1 before the first call */
+    int current;
+
+    /** MODE_THREAD: blocks the reader may fill and blocks filled for the hasher */
+    Semaphore freeBlocks;
+    Semaphore readBlocks;
+    volatile bool stopping;
+
+    /** MODE_URING */
+    struct Uring;
+    Uring* uring;
+};
+
+} // namespace dcpp
+
+#endif // !_WIN32
@@ -97,19 +97,25 @@ public:
         if(len == 0 && !(leaves.empty() && blocks.empty()))
             return;
 
-        do {
-            size_t n = min(baseBlockSize, len-i);
-            Hasher h;
-            h.update(&zero, 1);
-            h.update(buf + i, n);
-            if((int64_t)baseBlockSize < blockSize) {
-                blocks.push_back(make_pair(MerkleValue(h.finalize()), baseBlockSize));
-                reduceBlocks();
-            } else {
-                leaves.push_back(MerkleValue(h.finalize()));
-            }
-            i += n;
-        } while(i < len);
+        // Whole base blocks are hashed a batch at a time
+        uint8_t hashes[LEAF_BATCH * BYTES];
+        while(len - i >= LEAF_BATCH * baseBlockSize) {
+            Hasher::hashLeaves(buf + i, baseBlockSize, LEAF_BATCH, hashes);
+            for(size_t j = 0; j < LEAF_BATCH; ++j)
+                addBase(MerkleValue(hashes + j * BYTES));
+            i += LEAF_BATCH * baseBlockSize;
+        }
+
+        if(i < len || len == 0) {
+            do {
+                size_t n = min(baseBlockSize, len-i);
+                Hasher h;
+                h.update(&zero, 1);
+                h.update(buf + i, n);
+                addBase(MerkleValue(h.finalize()));
+                i += n;
+            } while(i < len);
+        }
         fileSize += len;
     }
 
@@ -196,6 +202,18 @@ private:
         return MerkleValue(h.finalize());
     }
 
+    /** Number of base blocks passed to Hasher::hashLeaves at once */
+    static const size_t LEAF_BATCH = 16;
+
+    void addBase(const MerkleValue& aHash) {
+        if((int64_t)baseBlockSize < blockSize) {
+            blocks.push_back(make_pair(aHash, baseBlockSize));
+            reduceBlocks();
+        } else {
+            leaves.push_back(aHash);
+        }
+    }
+
     void reduceBlocks() {
         while(blocks.size() > 1) {
             MerkleBlock& a = blocks[blocks.size()-2];
@@ -0,0 +1,104 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "stdinc.h"
+
+#include "MultiStringSearch.h"
+
+#include "Text.h"
+
+namespace dcpp {
+
+MultiStringSearch::MultiStringSearch() : nodes(1) {
+}
+
+bool MultiStringSearch::add(const string& aPattern) {
+    if(patterns.size() >= MAX_PATTERNS)
+        return false;
+
+    const Mask bit = Mask(1) << patterns.size();
+    patterns.push_back(Text::toLower(aPattern));
+
+    uint32_t n = 0;
+    for(auto c: patterns.back()) {
+        uint32_t next = child(n, static_cast<uint8_t>(c));
+        if(!next) {
+            next = static_cast<uint32_t>(nodes.size());
+            auto& edges = nodes[n].next;
+            edges.insert(lower_bound(edges.begin(), edges.end(), make_pair(static_cast<uint8_t>(c), uint32_t(0))),
+                make_pair(static_cast<uint8_t>(c), next));
+            nodes.push_back(Node());
+        }
+        n = next;
+    }
+    nodes[n].out |= bit;
+    return true;
+}
+
+void MultiStringSearch::prepare() {
+    // Breadth first, so the fail node of a node is always done before the node itself
+    vector<uint32_t> queue;
+    for(auto& e: nodes[0].next) {
+        nodes[e.second].fail = 0;
+        queue.push_back(e.second);
+    }
+
+    for(size_t i = 0; i < queue.size(); ++i) {
+        const uint32_t n = queue[i];
+        nodes[n].out |= nodes[nodes[n].fail].out;
+        for(auto& e: nodes[n].next) {
+            uint32_t f = nodes[n].fail;
+            while(f && !child(f, e.first))
+                f = nodes[f].fail;
+            nodes[e.second].fail = child(f, e.first);
+            queue.push_back(e.second);
+        }
+    }
+}
+
+uint32_t MultiStringSearch::child(uint32_t aNode, uint8_t c) const noexcept {
+    for(auto& e: nodes[aNode].next) {
+        if(e.first == c)
+            return e.second;
+        if(e.first > c)
+            break;
+    }
+    return 0;
+}
+
+uint32_t MultiStringSearch::step(uint32_t aNode, uint8_t c) const noexcept {
+    for(;;) {
+        uint32_t next = child(aNode, c);
+        if(next || !aNode)
+            return next;
+        aNode = nodes[aNode].fail;
+    }
+}
+
+MultiStringSearch::Mask MultiStringSearch::match(const string& aLowerText, Mask aWanted) const noexcept {
+    // Empty patterns end at the root and are found in anything
+    Mask found = nodes[0].out;
+    uint32_t n = 0;
+    for(auto c: aLowerText) {
+        if((found & aWanted) == aWanted)
+            break;
+        n = step(n, static_cast<uint8_t>(c));
+        found |= nodes[n].out;
+    }
+    return found;
+}
+
+} // namespace dcpp
@@ -0,0 +1,74 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "typedefs.h"
+#include "noexcept.h"
+
+namespace dcpp {
+
+/**
+ * Matches a set of substrings against a text in a single pass (Aho-Corasick). Patterns are
+ * lower cased when added and the text is expected in lower case already (see Text::toLower),
+ * so matching a name doesn't allocate anything.
+ */
+class MultiStringSearch {
+public:
+    /** One bit per pattern, in the order they were added */
+    typedef uint64_t Mask;
+    static const size_t MAX_PATTERNS = 64;
+
+    MultiStringSearch();
+
+    /** @return false when there's no room for another pattern */
+    bool add(const string& aPattern);
+    /** Build the automaton; call after the last add and before matching. */
+    void prepare();
+
+    size_t size() const { return patterns.size(); }
+    bool empty() const { return patterns.empty(); }
+    const string& getPattern(size_t i) const { return patterns[i]; }
+    /** Bits of all patterns added so far */
+    Mask getAll() const { return patterns.size() == MAX_PATTERNS ? ~Mask(0) : (Mask(1) << patterns.size()) - 1; }
+
+    /**
+     * @param aLowerText Text in lower case
+     * @param aWanted Stop as soon as all of these have been found
+     * @return Patterns found in the text
+     */
+    Mask match(const string& aLowerText, Mask aWanted) const noexcept;
+    /** Whether every pattern is found in the (lower case) text */
+    bool matchAll(const string& aLowerText) const noexcept { return match(aLowerText, getAll()) == getAll(); }
+
+private:
+    struct Node {
+        Node() : fail(0), out(0) { }
+        /** Byte -> next node, sorted by byte */
+        vector<pair<uint8_t, uint32_t>> next;
+        uint32_t fail;
+        /** Patterns ending here, including those reached through fail */
+        Mask out;
+    };
+
+    uint32_t step(uint32_t aNode, uint8_t c) const noexcept;
+    uint32_t child(uint32_t aNode, uint8_t c) const noexcept;
+
+    vector<Node> nodes;
+    StringList patterns;
+};
+
+} // namespace dcpp
@@ -285,6 +285,10 @@ int64_t QueueItem::getDownloadedBytes() const {
 }
 
 void QueueItem::addSegment(const Segment& segment) {
+    addSegment(done, segment);
+}
+
+void QueueItem::addSegment(SegmentSet& done, const Segment& segment) {
     done.insert(segment);
 
     // Consolidate segments
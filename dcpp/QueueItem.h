@@ -24,6 +24,7 @@
 #include "Flags.h"
 #include "forward.h"
 #include "Segment.h"
+#include "SharedFile.h"
 
 namespace dcpp {
 
@@ -138,13 +139,13 @@ public:
     QueueItem(const string& aTarget, int64_t aSize, Priority aPriority, int aFlag,
         time_t aAdded, const TTHValue& tth) :
         Flags(aFlag), target(aTarget), size(aSize),
-        priority(aPriority), added(aAdded), tthRoot(tth), nextPublishingTime(0)
+        priority(aPriority), added(aAdded), tthRoot(tth), nextPublishingTime(0), autoSearchIndex(0)
     { }
 
     QueueItem(const QueueItem& rhs) :
         Flags(rhs), done(rhs.done), downloads(rhs.downloads), target(rhs.target),
         size(rhs.size), priority(rhs.priority), added(rhs.added), tthRoot(rhs.tthRoot),
-        nextPublishingTime(rhs.nextPublishingTime), sources(rhs.sources), badSources(rhs.badSources),
+        nextPublishingTime(rhs.nextPublishingTime), autoSearchIndex(rhs.autoSearchIndex), sources(rhs.sources), badSources(rhs.badSources),
         tempTarget(rhs.tempTarget)
 
     { }
@@ -210,6 +211,8 @@ public:
 
 
     void addSegment(const Segment& segment);
+    /** Add a segment to a set of downloaded ones, merging it with its neighbours */
+    static void addSegment(SegmentSet& done, const Segment& segment);
     void resetDownloaded() { done.clear(); }
 
     bool isFinished() const {
@@ -243,6 +246,10 @@ public:
     GETSET(time_t, added, Added);
     GETSET(TTHValue, tthRoot, TTH);
     GETSET(uint64_t, nextPublishingTime, NextPublishingTime);
+    /** When the file queue last looked at the item for an automatic search, 0 if never */
+    GETSET(uint64_t, autoSearchIndex, AutoSearchIndex);
+    /** The temporary target, open while segments of it are being downloaded */
+    GETSET(SharedFile::Ptr, tempFile, TempFile);
 private:
     QueueItem& operator=(const QueueItem&);
 
@@ -100,16 +100,38 @@ QueueItem* QueueManager::FileQueue::add(const string& aTarget, int64_t aSize,
 }
 
 void QueueManager::FileQueue::add(QueueItem* qi) {
+    insertTarget(qi);
+    tthIndex.insert(make_pair(qi->getTTH(), qi));
+    sizeIndex.insert(make_pair(qi->getSize(), qi));
+    updateAutoSearch(qi);
+}
+
+void QueueManager::FileQueue::insertTarget(QueueItem* qi) {
     if(lastInsert == queue.end())
         lastInsert = queue.insert(make_pair(const_cast<string*>(&qi->getTarget()), qi)).first;
     else
         lastInsert = queue.insert(lastInsert, make_pair(const_cast<string*>(&qi->getTarget()), qi));
 }
 
+template<typename Map, typename Key>
+void QueueManager::FileQueue::unindex(Map& m, const Key& k, QueueItem* qi) {
+    auto range = m.equal_range(k);
+    for(auto i = range.first; i != range.second; ++i) {
+        if(i->second == qi) {
+            m.erase(i);
+            return;
+        }
+    }
+    dcassert(0);
+}
+
 void QueueManager::FileQueue::remove(QueueItem* qi) {
     if(lastInsert != queue.end() && Util::stricmp(*lastInsert->first, qi->getTarget()) == 0)
         ++lastInsert;
     queue.erase(const_cast<string*>(&qi->getTarget()));
+    unindex(tthIndex, qi->getTTH(), qi);
+    unindex(sizeIndex, qi->getSize(), qi);
+    autoSearch.erase(make_pair(qi->getAutoSearchIndex(), qi));
     delete qi;
 }
 
@@ -119,73 +141,72 @@ QueueItem* QueueManager::FileQueue::find(const string& target) {
 }
 
 void QueueManager::FileQueue::find(QueueItem::List& sl, int64_t aSize, const string& suffix) {
-    for(QueueItem::StringIter i = queue.begin(); i != queue.end(); ++i) {
-        if(i->second->getSize() == aSize) {
-            const string& t = i->second->getTarget();
-            if(suffix.empty() || (suffix.length() < t.length() &&
-                Util::stricmp(suffix.c_str(), t.c_str() + (t.length() - suffix.length())) == 0) )
-                sl.push_back(i->second);
-        }
+    auto range = sizeIndex.equal_range(aSize);
+    for(auto i = range.first; i != range.second; ++i) {
+        const string& t = i->second->getTarget();
+        if(suffix.empty() || (suffix.length() < t.length() &&
+            Util::stricmp(suffix.c_str(), t.c_str() + (t.length() - suffix.length())) == 0) )
+            sl.push_back(i->second);
     }
 }
 
 void QueueManager::FileQueue::find(QueueItem::List& ql, const TTHValue& tth) {
-    for(QueueItem::StringIter i = queue.begin(); i != queue.end(); ++i) {
-        QueueItem* qi = i->second;
-        if(qi->getTTH() == tth) {
-            ql.push_back(qi);
-        }
+    auto range = tthIndex.equal_range(tth);
+    for(auto i = range.first; i != range.second; ++i) {
+        ql.push_back(i->second);
     }
 }
 
 bool QueueManager::FileQueue::exists(const TTHValue& tth) const {
-    for(QueueItem::StringMap::const_iterator i = queue.begin(); i != queue.end(); ++i)
-        if(i->second->getTTH() == tth)
-            return true;
-    return false;
+    return tthIndex.find(tth) != tthIndex.end();
+}
+
+bool QueueManager::FileQueue::isAutoSearchable(const QueueItem* qi) {
+    return !qi->isSet(QueueItem::FLAG_USER_LIST) && qi->getPriority() != QueueItem::PAUSED;
+}
+
+void QueueManager::FileQueue::updateAutoSearch(QueueItem* qi) {
+    if(isAutoSearchable(qi)) {
+        autoSearch.insert(make_pair(qi->getAutoSearchIndex(), qi));
+    } else {
+        autoSearch.erase(make_pair(qi->getAutoSearchIndex(), qi));
+    }
+}
+
+namespace {
+/** Items findAutoSearch() looks at per call; the next call goes on with the ones after them */
+const size_t AUTO_SEARCH_LOOKAHEAD = 64;
 }
 
-static QueueItem* findCandidate(QueueItem* cand, QueueItem::StringIter start, QueueItem::StringIter end, const StringList& recent) {
-    for(QueueItem::StringIter i = start; i != end; ++i) {
+QueueItem* QueueManager::FileQueue::findAutoSearch() {
+    QueueItem* cand = NULL;
+    // Everything looked at takes its turn after the others, so a queue where nothing qualifies
+    // (or everything is running) is gone through a part at a time rather than all on each call
+    QueueItem::List looked;
+    for(auto i = autoSearch.begin(); i != autoSearch.end() && looked.size() < AUTO_SEARCH_LOOKAHEAD; ++i) {
         QueueItem* q = i->second;
+        looked.push_back(q);
 
-        // We prefer to search for things that are not running...
-        if((cand != NULL) && q->isRunning())
-            continue;
-        // No finished files
-        if(q->isFinished())
-            continue;
-        // No user lists
-        if(q->isSet(QueueItem::FLAG_USER_LIST))
-            continue;
-        // No paused downloads
-        if(q->getPriority() == QueueItem::PAUSED)
-            continue;
-        // No files that already have more than AUTO_SEARCH_LIMIT online sources
-        if(q->countOnlineUsers() >= SETTING(AUTO_SEARCH_LIMIT))
-            continue;
-        // Did we search for it recently?
-        if(find(recent.begin(), recent.end(), q->getTarget()) != recent.end())
+        // No finished files and no files that already have more than AUTO_SEARCH_LIMIT online sources
+        if(q->isFinished() || q->countOnlineUsers() >= SETTING(AUTO_SEARCH_LIMIT)) {
             continue;
+        }
 
-        cand = q;
-
-        if(cand->isWaiting())
+        // We prefer to search for things that are not running...
+        if(q->isWaiting()) {
+            cand = q;
             break;
+        }
+        if(cand == NULL) {
+            cand = q;
+        }
     }
-    return cand;
-}
-
-QueueItem* QueueManager::FileQueue::findAutoSearch(StringList& recent) {
-    // We pick a start position at random, hoping that we will find something to search for...
-    QueueItem::StringMap::size_type start = (QueueItem::StringMap::size_type)Util::rand((uint32_t)queue.size());
 
-    QueueItem::StringIter i = queue.begin();
-    advance(i, start);
-
-    QueueItem* cand = findCandidate(NULL, i, queue.end(), recent);
-    if(cand == NULL || cand->isRunning()) {
-        cand = findCandidate(cand, queue.begin(), i, recent);
+    for(auto i = looked.begin(); i != looked.end(); ++i) {
+        QueueItem* q = *i;
+        autoSearch.erase(make_pair(q->getAutoSearchIndex(), q));
+        q->setAutoSearchIndex(++autoSearchCount);
+        autoSearch.insert(make_pair(q->getAutoSearchIndex(), q));
     }
     return cand;
 }
@@ -195,7 +216,7 @@ void QueueManager::FileQueue::move(QueueItem* qi, const string& aTarget) {
         lastInsert = queue.end();
     queue.erase(const_cast<string*>(&qi->getTarget()));
     qi->setTarget(aTarget);
-    add(qi);
+    insertTarget(qi);
 }
 
 bool QueueManager::getQueueInfo(const UserPtr& aUser, string& aTarget, int64_t& aSize, int& aFlags) noexcept {
@@ -464,6 +485,7 @@ int QueueManager::Rechecker::run() {
 
             //Clear segments
             q->resetDownloaded();
+            qm->store.changed(q);
 
             tempTarget = q->getTempTarget();
         }
@@ -628,15 +650,9 @@ void QueueManager::on(TimerManagerListener::Minute, uint64_t aTick) noexcept {
 #endif
 
         if(BOOLSETTING(AUTO_SEARCH) && (aTick >= nextSearch) && (fileQueue.getSize() > 0)) {
-            // We keep 30 recent searches to avoid duplicate searches
-            while((recent.size() >= fileQueue.getSize()) || (recent.size() > 30)) {
-                recent.erase(recent.begin());
-            }
-
-            QueueItem* qi = fileQueue.findAutoSearch(recent);
+            QueueItem* qi = fileQueue.findAutoSearch();
             if(qi) {
                 searchString = qi->getTTH().toBase32();
-                recent.push_back(qi->getTarget());
                 nextSearch = aTick + (SETTING(AUTO_SEARCH_TIME) * 60000);
                 if (BOOLSETTING(REPORT_ALTERNATES))
                     LogManager::getInstance()->message(str(F_("Searching TTH alternates for: %1%")%Util::getFileName(qi->getTargetFileName())));
@@ -725,7 +741,9 @@ void QueueManager::add(const string& aTarget, int64_t aSize, const TTHValue& roo
     {
         q = fileQueue.add(target, aSize, 0, QueueItem::DEFAULT/*QueueItem::Priority*/, Util::emptyString/*aTempTarget*/,
                 GET_TIME()/*time_t aAdded*/, root/*TTHValue& root*/);
+        store.changed(q);
         fire(QueueManagerListener::Added(), q);
+        setDirty();
     } else {
         if(q->getSize() != aSize)
         {
@@ -802,6 +820,7 @@ void QueueManager::add(const string& aTarget, int64_t aSize, const TTHValue& roo
         QueueItem* q = fileQueue.find(target);
         if(q == NULL) {
             q = fileQueue.add(target, aSize, aFlags, QueueItem::DEFAULT, tempTarget, GET_TIME(), root);
+            store.changed(q);
             fire(QueueManagerListener::Added(), q);
         } else {
             if(q->getSize() != aSize) {
@@ -901,6 +920,12 @@ bool QueueManager::addSource(QueueItem* qi, const HintedUser& aUser, Flags::Mask
         userQueue.add(qi, aUser);
     }
 
+    if(qi->isSource(aUser)) {
+        // a source that was bad before comes back with the hub it had then
+        store.sourceAdded(qi->getTarget(), qi->getSource(aUser)->getUser());
+        newSources.push_back(aUser.user->getCID());
+    }
+
     fire(QueueManagerListener::SourcesUpdated(), qi);
     setDirty();
 
@@ -943,54 +968,133 @@ QueueItem::Priority QueueManager::hasDownload(const UserPtr& aUser) noexcept {
     return qi->getPriority();
 }
 namespace {
-typedef unordered_map<TTHValue, const DirectoryListing::File*> TTHMap;
+/** Enough files to make taking the queue lock worth it, few enough not to hold it for long */
+const size_t MATCH_BATCH = 1024;
 
-// *** WARNING ***
-// Lock(cs) makes sure that there's only one thread accessing this
-static TTHMap tthMap;
-
-void buildMap(const DirectoryListing::Directory* dir) noexcept {
-    for(DirectoryListing::Directory::List::const_iterator j = dir->directories.begin(); j != dir->directories.end(); ++j) {
+void collectFiles(const DirectoryListing::Directory* dir, vector<pair<TTHValue, int64_t> >& files, const std::function<void ()>& flush) {
+    for(auto j = dir->directories.cbegin(); j != dir->directories.cend(); ++j) {
         if(!(*j)->getAdls())
-            buildMap(*j);
+            collectFiles(*j, files, flush);
     }
 
-    for(DirectoryListing::File::List::const_iterator i = dir->files.begin(); i != dir->files.end(); ++i) {
-        const DirectoryListing::File* df = *i;
-        tthMap.insert(make_pair(df->getTTH(), df));
+    for(auto i = dir->files.cbegin(); i != dir->files.cend(); ++i) {
+        files.push_back(make_pair((*i)->getTTH(), (*i)->getSize()));
+        if(files.size() == MATCH_BATCH)
+            flush();
     }
 }
+
+/** Reads the roots and sizes of the files of a list and passes them on in batches, keeping nothing else */
+class MatchLoader : public SimpleXMLReader::CallBack {
+public:
+    typedef vector<pair<TTHValue, int64_t> > Files;
+
+    MatchLoader(const std::function<void (const Files&)>& aHandler) : handler(aHandler) { files.reserve(MATCH_BATCH); }
+
+    virtual void startTag(const string& name, StringPairList& attribs, bool) {
+        if(name != sFile)
+            return;
+        const string& s = getAttrib(attribs, sSize, 1);
+        if(s.empty())
+            return;
+        const string& h = getAttrib(attribs, sTTH, 2);
+        if(h.empty())
+            return;
+        files.push_back(make_pair(TTHValue(h), Util::toInt64(s)));
+        if(files.size() == MATCH_BATCH)
+            flush();
+    }
+    virtual void endTag(const string&, const string&) { }
+
+    void flush() {
+        if(!files.empty()) {
+            handler(files);
+            files.clear();
+        }
+    }
+
+private:
+    static const string sFile;
+    static const string sSize;
+    static const string sTTH;
+
+    std::function<void (const Files&)> handler;
+    Files files;
+};
+
+const string MatchLoader::sFile = "File";
+const string MatchLoader::sSize = "Size";
+const string MatchLoader::sTTH = "TTH";
 }
 
-int QueueManager::matchListing(const DirectoryListing& dl) noexcept {
+int QueueManager::matchFiles(const MatchBatch& files, const HintedUser& aUser, unordered_set<TTHValue>& matched) noexcept {
     int matches = 0;
-    {
-        Lock l(cs);
-        tthMap.clear();
-        buildMap(dl.getRoot());
+    QueueItem::List ql;
 
-        for(QueueItem::StringMap::const_iterator i = fileQueue.getQueue().begin(); i != fileQueue.getQueue().end(); ++i) {
-            QueueItem* qi = i->second;
+    Lock l(cs);
+    for(auto i = files.cbegin(); i != files.cend(); ++i) {
+        if(!fileQueue.exists(i->first) || matched.find(i->first) != matched.end())
+            continue;
+
+        ql.clear();
+        fileQueue.find(ql, i->first);
+        for(auto j = ql.cbegin(); j != ql.cend(); ++j) {
+            QueueItem* qi = *j;
             if(qi->isFinished())
                 continue;
             if(qi->isSet(QueueItem::FLAG_USER_LIST))
                 continue;
-            TTHMap::iterator j = tthMap.find(qi->getTTH());
-            if(j != tthMap.end() && i->second->getSize() == qi->getSize()) {
-                try {
-                    addSource(qi, dl.getUser(), QueueItem::Source::FLAG_FILE_NOT_AVAILABLE);
-                } catch(...) {
-                    // Ignore...
-                }
-                matches++;
+            if(qi->getSize() != i->second)
+                continue;
+            try {
+                addSource(qi, aUser, QueueItem::Source::FLAG_FILE_NOT_AVAILABLE);
+            } catch(...) {
+                // Ignore...
             }
+            matched.insert(i->first);
+            matches++;
         }
     }
+    return matches;
+}
+
+int QueueManager::matchListing(const DirectoryListing& dl) noexcept {
+    int matches = 0;
+    unordered_set<TTHValue> matched;
+    MatchBatch files;
+    auto flush = [&] {
+        matches += matchFiles(files, dl.getUser(), matched);
+        files.clear();
+    };
+
+    collectFiles(dl.getRoot(), files, flush);
+    flush();
+
     if(matches > 0)
         ConnectionManager::getInstance()->getDownloadConnection(dl.getUser());
     return matches;
 }
 
+int QueueManager::matchListing(const string& aFile, const HintedUser& aUser) {
+    int matches = 0;
+    unordered_set<TTHValue> matched;
+    MatchLoader loader([&](const MatchBatch& files) { matches += matchFiles(files, aUser, matched); });
+
+    try {
+        DirectoryListing::parseFile(aFile, loader);
+        loader.flush();
+    } catch(const Exception&) {
+        // sources found before a broken part of the list are kept
+        if(matches > 0)
+            ConnectionManager::getInstance()->getDownloadConnection(aUser);
+        throw;
+    }
+
+    if(matches > 0)
+        ConnectionManager::getInstance()->getDownloadConnection(aUser);
+    return matches;
+}
+
 int64_t QueueManager::getPos(const string& target) noexcept {
     Lock l(cs);
     QueueItem* qi = fileQueue.find(target);
@@ -1032,7 +1136,9 @@ void QueueManager::move(const string& aSource, const string& aTarget) noexcept {
         QueueItem* qt = fileQueue.find(target);
         if(qt == NULL || Util::stricmp(aSource, target) == 0) {
             // Good, update the target and move in the queue...
+            string source = qs->getTarget();
             fileQueue.move(qs, target);
+            store.moved(source, target);
             fire(QueueManagerListener::Moved(), qs, aSource);
             setDirty();
         } else {
@@ -1096,6 +1202,7 @@ Download* QueueManager::getDownload(UserConnection& aSource, bool supportsTrees)
                 } else {
                     // Temp target gone?
                     q->resetDownloaded();
+                    store.changed(q);
                 }
             }
         }
@@ -1159,23 +1266,24 @@ void QueueManager::setFile(Download* d) {
 
         string target = d->getDownloadTarget();
 
-        if(d->getSegment().getStart() > 0) {
-            if(File::getSize(target) != qi->getSize()) {
-                // When trying the download the next time, the resume pos will be reset
-                throw QueueException(_("Target file is missing or wrong size"));
+        // the other segments being downloaded already have the file open
+        SharedFile::Ptr f = qi->getTempFile();
+        if(!f || f->getPath() != target) {
+            if(d->getSegment().getStart() > 0) {
+                if(File::getSize(target) != qi->getSize()) {
+                    // When trying the download the next time, the resume pos will be reset
+                    throw QueueException(_("Target file is missing or wrong size"));
+                }
+            } else {
+                File::ensureDirectory(target);
             }
-        } else {
-            File::ensureDirectory(target);
-        }
-
-        File* f = new File(target, File::WRITE, File::OPEN | File::CREATE | File::SHARED);
 
-        if(f->getSize() != qi->getSize()) {
-            f->setSize(qi->getSize());
+            int64_t directSize = (int64_t)SETTING(DOWNLOAD_DIRECT_IO_SIZE) * 1024 * 1024;
+            f = new SharedFile(target, qi->getSize(), BOOLSETTING(DOWNLOAD_PREALLOCATE), directSize > 0 && qi->getSize() >= directSize);
+            qi->setTempFile(f);
         }
 
-        f->setPos(d->getSegment().getStart());
-        d->setFile(f);
+        d->setFile(new SharedFile::Stream(f, d->getSegment().getStart()));
     } else if(d->getType() == Transfer::TYPE_FULL_LIST) {
         string target = d->getPath();
         File::ensureDirectory(target);
@@ -1232,15 +1340,20 @@ void QueueManager::moveStuckFile(QueueItem* qi) {
     if(!BOOLSETTING(KEEP_FINISHED_FILES)) {
         fire(QueueManagerListener::Removed(), qi);
         fileQueue.remove(qi);
+        store.removed(target);
     } else {
         qi->addSegment(Segment(0, qi->getSize()));
+        store.segmentDone(qi, Segment(0, qi->getSize()));
         fire(QueueManagerListener::StatusUpdated(), qi);
     }
+    setDirty();
 
     fire(QueueManagerListener::RecheckAlreadyFinished(), target);
 }
 
 void QueueManager::rechecked(QueueItem* qi) {
+    store.changed(qi);
+
     fire(QueueManagerListener::RecheckDone(), qi->getTarget());
     fire(QueueManagerListener::StatusUpdated(), qi);
 
@@ -1258,6 +1371,7 @@ void QueueManager::putDownload(Download* aDownload, bool finished) noexcept {
 
         delete aDownload->getFile();
         aDownload->setFile(0);
+        aDownload->setWriteBehind(0);
 
         if(aDownload->getType() == Transfer::TYPE_PARTIAL_LIST) {
             QueueItem* q = fileQueue.find(getListPath(aDownload->getHintedUser()));
@@ -1283,6 +1397,7 @@ void QueueManager::putDownload(Download* aDownload, bool finished) noexcept {
                 fire(QueueManagerListener::Removed(), q);
 
                     userQueue.remove(q);
+                    store.removed(q->getTarget());
                     fileQueue.remove(q);
                 //} else {
                     //userQueue.removeDownload(q, aDownload->getUser());
@@ -1293,6 +1408,11 @@ void QueueManager::putDownload(Download* aDownload, bool finished) noexcept {
             QueueItem* q = fileQueue.find(aDownload->getPath());
 
             if(q) {
+                if(q->getTempFile() && q->getTempFile()->unique()) {
+                    // no other segment is being written, the file may be moved or removed now
+                    q->setTempFile(nullptr);
+                }
+
                 if(aDownload->getType() == Transfer::TYPE_FULL_LIST) {
                     if(aDownload->isSet(Download::FLAG_XML_BZ_LIST)) {
                         q->setFlag(QueueItem::FLAG_XML_BZLIST);
@@ -1325,8 +1445,10 @@ void QueueManager::putDownload(Download* aDownload, bool finished) noexcept {
                         if(aDownload->getType() == Transfer::TYPE_FULL_LIST) {
                             dir = q->getTempTarget();
                             q->addSegment(Segment(0, q->getSize()));
+                            store.segmentDone(q, Segment(0, q->getSize()));
                         } else if(aDownload->getType() == Transfer::TYPE_FILE) {
                             q->addSegment(aDownload->getSegment());
+                            store.segmentDone(q, aDownload->getSegment());
                         }
 
                         if (q->isFinished() && BOOLSETTING(SFV_CHECK)) {
@@ -1348,6 +1470,7 @@ void QueueManager::putDownload(Download* aDownload, bool finished) noexcept {
 
                             if(!BOOLSETTING(KEEP_FINISHED_FILES) || aDownload->getType() == Transfer::TYPE_FULL_LIST) {
                                 fire(QueueManagerListener::Removed(), q);
+                                store.removed(q->getTarget());
                                 fileQueue.remove(q);
                             } else {
                                 fire(QueueManagerListener::StatusUpdated(), q);
@@ -1374,6 +1497,7 @@ void QueueManager::putDownload(Download* aDownload, bool finished) noexcept {
 
                             if(downloaded > 0) {
                                 q->addSegment(Segment(aDownload->getStartPos(), downloaded));
+                                store.segmentDone(q, Segment(aDownload->getStartPos(), downloaded));
                                 setDirty();
                             }
                         }
@@ -1405,6 +1529,20 @@ void QueueManager::putDownload(Download* aDownload, bool finished) noexcept {
 }
 
 void QueueManager::processList(const string& name, const HintedUser& user, int flags) {
+    if(!(flags & QueueItem::FLAG_DIRECTORY_DOWNLOAD)) {
+        // matching alone doesn't need the listing, the list is matched as it is read
+        if(flags & QueueItem::FLAG_MATCH_QUEUE) {
+            try {
+                size_t files = matchListing(name, user);
+                LogManager::getInstance()->message(str(FN_("%1%: Matched %2% file", "%1%: Matched %2% files", files) %
+                    Util::toString(ClientManager::getInstance()->getNicks(user)) % files));
+            } catch(const Exception&) {
+                LogManager::getInstance()->message(str(F_("Unable to open filelist: %1%") % Util::addBrackets(name)));
+            }
+        }
+        return;
+    }
+
     DirectoryListing dirList(user);
     try {
         dirList.loadFile(name);
@@ -1413,23 +1551,22 @@ void QueueManager::processList(const string& name, const HintedUser& user, int f
         return;
     }
 
-    if(flags & QueueItem::FLAG_DIRECTORY_DOWNLOAD) {
-        DirectoryItem::List dl;
-        {
-            Lock l(cs);
-            DirectoryItem::DirectoryPair dp = directories.equal_range(user);
-            for(DirectoryItem::DirectoryIter i = dp.first; i != dp.second; ++i) {
-                dl.push_back(i->second);
-            }
-            directories.erase(user);
+    DirectoryItem::List dl;
+    {
+        Lock l(cs);
+        DirectoryItem::DirectoryPair dp = directories.equal_range(user);
+        for(DirectoryItem::DirectoryIter i = dp.first; i != dp.second; ++i) {
+            dl.push_back(i->second);
         }
+        directories.erase(user);
+    }
 
-        for(DirectoryItem::Iter i = dl.begin(); i != dl.end(); ++i) {
-            DirectoryItem* di = *i;
-            dirList.download(di->getName(), di->getTarget(), false);
-            delete di;
-        }
+    for(DirectoryItem::Iter i = dl.begin(); i != dl.end(); ++i) {
+        DirectoryItem* di = *i;
+        dirList.download(di->getName(), di->getTarget(), false);
+        delete di;
     }
+
     if(flags & QueueItem::FLAG_MATCH_QUEUE) {
         size_t files = matchListing(dirList);
         LogManager::getInstance()->message(str(FN_("%1%: Matched %2% file", "%1%: Matched %2% files", files) %
@@ -1473,6 +1610,7 @@ void QueueManager::remove(const string& aTarget) noexcept {
         if(!q->isFinished()) {
             userQueue.remove(q);
         }
+        store.removed(q->getTarget());
         fileQueue.remove(q);
 
         setDirty();
@@ -1515,6 +1653,7 @@ void QueueManager::removeSource(const string& aTarget, const UserPtr& aUser, int
             userQueue.remove(q, aUser);
         }
         q->removeSource(aUser, reason);
+        store.sourceRemoved(q->getTarget(), aUser);
 
         fire(QueueManagerListener::SourcesUpdated(), q);
         setDirty();
@@ -1546,6 +1685,7 @@ void QueueManager::removeSource(const UserPtr& aUser, int reason) noexcept {
             } else {
                 userQueue.remove(qi, aUser);
                 qi->removeSource(aUser, reason);
+                store.sourceRemoved(qi->getTarget(), aUser);
                 fire(QueueManagerListener::SourcesUpdated(), qi);
                 setDirty();
             }
@@ -1560,6 +1700,7 @@ void QueueManager::removeSource(const UserPtr& aUser, int reason) noexcept {
                 userQueue.remove(qi, aUser);
                 isRunning = true;
                 qi->removeSource(aUser, reason);
+                store.sourceRemoved(qi->getTarget(), aUser);
                 fire(QueueManagerListener::StatusUpdated(), qi);
                 fire(QueueManagerListener::SourcesUpdated(), qi);
                 setDirty();
@@ -1588,6 +1729,8 @@ void QueueManager::setPriority(const string& aTarget, QueueItem::Priority p) noe
                                 q->getOnlineUsers(getConn);
             }
             userQueue.setPriority(q, p);
+            fileQueue.updateAutoSearch(q);
+            store.priorityChanged(q->getTarget(), p);
             setDirty();
             fire(QueueManagerListener::StatusUpdated(), q);
         }
@@ -1603,95 +1746,24 @@ void QueueManager::saveQueue(bool force) noexcept {
     return;
 
     std::vector<CID> cids;
-
-    try {
+    {
         Lock l(cs);
-
-        File ff(getQueueFile() + ".tmp", File::WRITE, File::CREATE | File::TRUNCATE);
-        BufferedOutputStream<false> f(&ff);
-
-        f.write(SimpleXML::utf8Header);
-        f.write(LIT("<Downloads Version=\"" EISKALTDCPP_VERSION "\">\r\n"));
-        string tmp;
-        string b32tmp;
-        for(QueueItem::StringIter i = fileQueue.getQueue().begin(); i != fileQueue.getQueue().end(); ++i) {
-            QueueItem* qi = i->second;
-            if(!qi->isSet(QueueItem::FLAG_USER_LIST)
-                || (qi->isSet(QueueItem::FLAG_USER_LIST)
-                    && SETTING(KEEP_LISTS))) {
-                f.write(LIT("\t<Download Target=\""));
-                f.write(SimpleXML::escape(qi->getTarget(), tmp, true));
-                f.write(LIT("\" Size=\""));
-                f.write(Util::toString(qi->getSize()));
-                f.write(LIT("\" Priority=\""));
-                f.write(Util::toString((int)qi->getPriority()));
-                f.write(LIT("\" Added=\""));
-                f.write(Util::toString(qi->getAdded()));
-                b32tmp.clear();
-                f.write(LIT("\" TTH=\""));
-                f.write(qi->getTTH().toBase32(b32tmp));
-                if(!qi->getDone().empty()) {
-                    f.write(LIT("\" TempTarget=\""));
-                    f.write(SimpleXML::escape(qi->getTempTarget(), tmp, true));
-                }
-                f.write(LIT("\">\r\n"));
-
-                for(QueueItem::SegmentSet::const_iterator i = qi->getDone().begin(); i != qi->getDone().end(); ++i) {
-                    f.write(LIT("\t\t<Segment Start=\""));
-                    f.write(Util::toString(i->getStart()));
-                    f.write(LIT("\" Size=\""));
-                    f.write(Util::toString(i->getSize()));
-                    f.write(LIT("\"/>\r\n"));
-                }
-
-                for(QueueItem::SourceConstIter j = qi->sources.begin(); j != qi->sources.end(); ++j) {
-                    if(j->isSet(QueueItem::Source::FLAG_PARTIAL)
-#ifdef WITH_DHT
-                                                                || j->getUser().hint == "DHT"
-#endif
-                                                                                              ) continue;
-
-                    const CID& cid = j->getUser().user->getCID();
-                    const string& hint = j->getUser().hint;
-
-                    f.write(LIT("\t\t<Source CID=\""));
-                    f.write(cid.toBase32());
-                    if(!hint.empty()) {
-                        f.write(LIT("\" Hub=\""));
-                        f.write(hint);
-                    }
-                    f.write(LIT("\"/>\r\n"));
-
-                    cids.push_back(cid);
-                }
-
-                f.write(LIT("\t</Download>\r\n"));
-            }
-        }
-
-        f.write("</Downloads>\r\n");
-        f.flush();
-        ff.close();
-        File::deleteFile(getQueueFile());
-        File::renameFile(getQueueFile() + ".tmp", getQueueFile());
-
+        cids.swap(newSources);
         dirty = false;
-    } catch(const FileException&) {
-        // ...
     }
+
+    // The changes were recorded as they were made, so this only appends them to the journal
+    store.flush();
+
     // Put this here to avoid very many saves tries when disk is full...
     lastSave = GET_TICK();
 
     //NOTE: freedcpp, save user cids and nicks to Users.xml see dcplusplus revision 1771
     ClientManager* cm = ClientManager::getInstance();
-//#ifdef _WIN32
-//        std::for_each(cids.begin(), cids.end(), std::bind(&ClientManager::saveUser, cm, std::placeholders::_1));
-//#else
     for (vector<CID>::const_iterator it = cids.begin(); it != cids.end(); ++it)
     {
         cm->saveUser(*it);
     }
-//#endif
 }
 
 class QueueLoader : public SimpleXMLReader::CallBack {
@@ -1708,15 +1780,96 @@ private:
 };
 
 void QueueManager::loadQueue() noexcept {
-    try {
-        QueueLoader l;
-        Util::migrate(getQueueFile());
+    Util::migrate(getQueueFile());
 
-        File f(getQueueFile(), File::READ, File::OPEN);
-        SimpleXMLReader(&l).parse(f);
-        dirty = false;
-    } catch(const Exception&) {
-        // ...
+    if(store.exists()) {
+        QueueStore::ItemMap items;
+        store.load(items);
+        load(items);
+    } else {
+        // First start with the binary queue; Queue.xml is left in place for older versions
+        store.setRecording(false);
+        try {
+            QueueLoader l;
+            File f(getQueueFile(), File::READ, File::OPEN);
+            SimpleXMLReader(&l).parse(f);
+        } catch(const Exception&) {
+            // ...
+        }
+        store.setRecording(true);
+
+        QueueStore::ItemMap items;
+        {
+            Lock l(cs);
+            for(auto i = fileQueue.getQueue().begin(); i != fileQueue.getQueue().end(); ++i) {
+                if(QueueStore::isSaved(i->second))
+                    QueueStore::save(i->second, items[i->second->getTarget()]);
+            }
+        }
+        store.write(items);
+    }
+
+    dirty = false;
+}
+
+void QueueManager::load(const QueueStore::ItemMap& items) {
+    // Items that can't be queued any more, and ones that have to be saved under a different name
+    StringList dropped;
+    StringPairList renamed;
+    StringList paused;
+
+    store.setRecording(false);
+    for(auto i = items.begin(); i != items.end(); ++i) {
+        const QueueStore::Item& item = i->second;
+
+        string target;
+        try {
+            // a file already at the target is left alone; the finished download replaces it
+            target = checkTarget(item.target, /*checkExistence*/ false);
+        } catch(const Exception&) { }
+
+        if(item.size <= 0 || target.empty() || fileQueue.find(target)) {
+            dropped.push_back(item.target);
+            continue;
+        }
+        if(target != item.target)
+            renamed.push_back(make_pair(item.target, target));
+
+        QueueItem::Priority p = (item.priority >= QueueItem::PAUSED && item.priority < QueueItem::LAST) ?
+            static_cast<QueueItem::Priority>(item.priority) : QueueItem::DEFAULT;
+        QueueItem* qi = fileQueue.add(target, item.size, 0, p, item.tempTarget,
+            item.added ? static_cast<time_t>(item.added) : GET_TIME(), item.tth);
+        for(auto j = item.done.begin(); j != item.done.end(); ++j) {
+            if(j->getSize() > 0 && j->getStart() >= 0 && j->getEnd() <= qi->getSize())
+                qi->addSegment(*j);
+        }
+        fire(QueueManagerListener::Added(), qi);
+
+        if(BOOLSETTING(CHECK_TARGETS_PATHS_ON_START) && !Util::fileExists(Util::getFilePath(target)))
+            paused.push_back(target);
+
+        for(auto j = item.sources.begin(); j != item.sources.end(); ++j) {
+            UserPtr user = ClientManager::getInstance()->getUser(j->first);
+            try {
+                HintedUser hintedUser(user, j->second);
+                if(addSource(qi, hintedUser, 0) && user->isOnline())
+                    ConnectionManager::getInstance()->getDownloadConnection(hintedUser);
+            } catch(const Exception&) { }
+        }
+    }
+    store.setRecording(true);
+
+    {
+        Lock l(cs);
+        for(auto i = dropped.begin(); i != dropped.end(); ++i)
+            store.removed(*i);
+        for(auto i = renamed.begin(); i != renamed.end(); ++i)
+            store.moved(i->first, i->second);
+    }
+
+    for(auto i = paused.begin(); i != paused.end(); ++i) {
+        setPriority(*i, QueueItem::PAUSED);
+        LogManager::getInstance()->message(str(F_("Target path for this item is not available: %1%; pause this queue item.") % Util::addBrackets(*i)));
     }
 }
 
@@ -2040,6 +2193,7 @@ bool QueueManager::checkSfv(QueueItem* qi, Download* d) {
 
             File::deleteFile(qi->getTempTarget());
             qi->resetDownloaded();
+            store.changed(qi);
             dcdebug("QueueManager: CRC32 mismatch for %s\n", qi->getTarget().c_str());
             LogManager::getInstance()->message(_("CRC32 inconsistency (SFV-Check)") + ' ' + Util::addBrackets(qi->getTarget()));
 
@@ -2228,10 +2382,9 @@ class ListMatcher : public dcpp::Thread
                     continue;
 
                 HintedUser user(u, Util::emptyString);
-                DirectoryListing dl(user);
                 try {
-                    dl.loadFile(*i);
-                    LogManager::getInstance()->message(str(F_("%1% : Matched %2% files") % Util::toString(ClientManager::getInstance()->getNicks(user)) % QueueManager::getInstance()->matchListing(dl)));
+                    int matches = QueueManager::getInstance()->matchListing(*i, user);
+                    LogManager::getInstance()->message(str(F_("%1% : Matched %2% files") % Util::toString(ClientManager::getInstance()->getNicks(user)) % matches));
                 } catch (const Exception&) { }
             }
             delete this;// Cleanup the thread object
@@ -24,6 +24,7 @@
 #include "User.h"
 #include "File.h"
 #include "QueueItem.h"
+#include "QueueStore.h"
 #include "Singleton.h"
 #include "DirectoryListing.h"
 #include "MerkleTree.h"
@@ -84,6 +85,8 @@ public:
             QueueItem::Priority p = QueueItem::DEFAULT) noexcept;
 
     int matchListing(const DirectoryListing& dl) noexcept;
+    /** Match a list file against the queue as it is read, without loading the listing */
+    int matchListing(const string& aFile, const HintedUser& aUser);
     void matchAllListings();
 
     bool getTTH(const string& name, TTHValue& tth) noexcept;
@@ -190,7 +193,7 @@ private:
     /** All queue items by target */
     class FileQueue {
     public:
-        FileQueue() : lastInsert(queue.end()) { }
+        FileQueue() : lastInsert(queue.end()), autoSearchCount(0) { }
         ~FileQueue() {
             for(QueueItem::StringIter i = queue.begin(); i != queue.end(); ++i)
                 delete i->second;
@@ -211,15 +214,33 @@ private:
         TTHValue* findPFSPubTTH();
 #endif
 
-        QueueItem* findAutoSearch(StringList& recent);
+        /** @return The item to search alternate sources for, taking turns with the others */
+        QueueItem* findAutoSearch();
+        /** Add or remove the item from the auto search order after its priority has changed */
+        void updateAutoSearch(QueueItem* qi);
         size_t getSize() { return queue.size(); }
         QueueItem::StringMap& getQueue() { return queue; }
         void move(QueueItem* qi, const string& aTarget);
         void remove(QueueItem* qi);
     private:
+        typedef unordered_multimap<TTHValue, QueueItem*> TTHMap;
+        typedef unordered_multimap<int64_t, QueueItem*> SizeMap;
+        typedef set<pair<uint64_t, QueueItem*> > AutoSearchSet;
+
+        void insertTarget(QueueItem* qi);
+        template<typename Map, typename Key>
+        static void unindex(Map& m, const Key& k, QueueItem* qi);
+        static bool isAutoSearchable(const QueueItem* qi);
+
         QueueItem::StringMap queue;
         /** A hint where to insert an item... */
         QueueItem::StringIter lastInsert;
+        /** The items of queue by root and by size, neither of which changes while an item is queued */
+        TTHMap tthIndex;
+        SizeMap sizeIndex;
+        /** The items auto search may look for (no file lists, not paused), the ones it looked at longest ago first */
+        AutoSearchSet autoSearch;
+        uint64_t autoSearchCount;
     };
 
     /** All queue items indexed by user (this is a cache for the FileQueue really...) */
@@ -256,16 +277,18 @@ private:
 
     mutable CriticalSection cs;
 
+    /** Saved state of the queue */
+    QueueStore store;
     /** QueueItems by target */
     FileQueue fileQueue;
     /** QueueItems by user */
     UserQueue userQueue;
     /** Directories queued for downloading */
     DirectoryItem::DirectoryMap directories;
-    /** Recent searches list, to avoid searching for the same thing too often */
-    StringList recent;
     /** The queue needs to be saved */
     bool dirty;
+    /** Sources added since the last save, whose users have to be saved too */
+    vector<CID> newSources;
     /** Next search */
     uint64_t nextSearch;
     /** File lists not to delete */
@@ -277,7 +300,14 @@ private:
 
     void processList(const string& name, const HintedUser& user, int flags);
 
+    /** Roots and sizes of list files, matched against the queue a batch at a time */
+    typedef vector<pair<TTHValue, int64_t> > MatchBatch;
+    /** Add the user as a source of the queued files in the batch; roots in matched are not counted again */
+    int matchFiles(const MatchBatch& files, const HintedUser& aUser, unordered_set<TTHValue>& matched) noexcept;
+
     void load(const SimpleXML& aXml);
+    /** Queue what was saved in the binary store */
+    void load(const QueueStore::ItemMap& items);
     void moveFile(const string& source, const string& target);
     static void moveFile_(const string& source, const string& target);
     void moveStuckFile(QueueItem* qi);
@@ -0,0 +1,508 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "stdinc.h"
+
+#include "QueueStore.h"
+
+#include "BinaryIO.h"
+#include "SettingsManager.h"
+#include "Streams.h"
+
+namespace dcpp {
+
+/*
+ * Queue.dat: magic, version, generation, item count, items
+ *   item: target, size, priority, added, root, temp target, segment count, segments (start, size),
+ *         source count, sources (CID, hub hint)
+ *
+ * Queue.journal: magic, version, generation, then one type byte and record per change:
+ *   JOURNAL_ITEM item, JOURNAL_REMOVE target, JOURNAL_MOVE source, target, JOURNAL_PRIORITY target, priority,
+ *   JOURNAL_SEGMENT target, temp target, start, size, JOURNAL_SOURCE_ADD target, CID, hub hint,
+ *   JOURNAL_SOURCE_REMOVE target, CID
+ * A torn record at the end (crash while writing) ends the replay.
+ *
+ * A snapshot of generation n contains the changes of all journals before n. When the journal is
+ * rotated to Queue.journal.old, the next one gets the following generation, which is also the
+ * generation of the snapshot the old one is folded into; so after a crash, replaying every journal
+ * not older than the snapshot gives the right state whether the fold got through or not.
+ */
+static const uint32_t SNAPSHOT_MAGIC = 0x54414451; // "QDAT"
+static const uint32_t JOURNAL_MAGIC = 0x4c4e4a51; // "QJNL"
+static const uint32_t STORE_VERSION = 1;
+
+/** Don't bother compacting journals smaller than this */
+static const int64_t MIN_COMPACT_SIZE = 1024 * 1024;
+
+enum {
+    JOURNAL_ITEM = 1,
+    JOURNAL_REMOVE,
+    JOURNAL_MOVE,
+    JOURNAL_PRIORITY,
+    JOURNAL_SEGMENT,
+    JOURNAL_SOURCE_ADD,
+    JOURNAL_SOURCE_REMOVE
+};
+
+static void putHeader(string& buf, uint32_t magic, uint64_t generation) {
+    put(buf, magic);
+    put(buf, STORE_VERSION);
+    put(buf, generation);
+}
+
+static bool getHeader(BinaryReader& r, uint32_t magic, uint64_t& generation) {
+    uint32_t m, version;
+    return r.get(m) && m == magic && r.get(version) && version == STORE_VERSION && r.get(generation);
+}
+
+static uint64_t readSnapshot(const string& aFile, QueueStore::ItemMap& items);
+
+QueueStore::QueueStore() :
+    path(Util::getPath(Util::PATH_USER_CONFIG)), recording(true), generation(0), journalSize(0), compacting(false)
+{
+}
+
+QueueStore::~QueueStore() {
+    // let a running compaction finish
+    compactor.reset();
+}
+
+bool QueueStore::isSaved(const QueueItem* qi) {
+    return !qi->isSet(QueueItem::FLAG_USER_LIST) || SETTING(KEEP_LISTS);
+}
+
+bool QueueStore::isSaved(const HintedUser& aUser) {
+#ifdef WITH_DHT
+    if(aUser.hint == "DHT")
+        return false;
+#endif
+    return true;
+}
+
+void QueueStore::save(QueueItem* qi, Item& item) {
+    item.target = qi->getTarget();
+    item.size = qi->getSize();
+    item.priority = qi->getPriority();
+    item.added = qi->getAdded();
+    item.tth = qi->getTTH();
+    item.tempTarget = qi->getDone().empty() ? Util::emptyString : qi->getTempTarget();
+    item.done = qi->getDone();
+
+    item.sources.clear();
+    for(auto i = qi->getSources().begin(); i != qi->getSources().end(); ++i) {
+        if(!i->isSet(QueueItem::Source::FLAG_PARTIAL) && isSaved(i->getUser()))
+            item.sources.push_back(make_pair(i->getUser().user->getCID(), i->getUser().hint));
+    }
+}
+
+void QueueStore::putItem(string& buf, const Item& item) {
+    put(buf, item.target);
+    put(buf, item.size);
+    put(buf, static_cast<int32_t>(item.priority));
+    put(buf, item.added);
+    put(buf, item.tth);
+    put(buf, item.tempTarget);
+
+    put(buf, static_cast<uint32_t>(item.done.size()));
+    for(auto i = item.done.begin(); i != item.done.end(); ++i) {
+        put(buf, i->getStart());
+        put(buf, i->getSize());
+    }
+
+    put(buf, static_cast<uint32_t>(item.sources.size()));
+    for(auto i = item.sources.begin(); i != item.sources.end(); ++i) {
+        put(buf, i->first);
+        put(buf, i->second);
+    }
+}
+
+bool QueueStore::getItem(BinaryReader& r, Item& item) {
+    int32_t priority;
+    uint32_t n;
+    if(!r.get(item.target) || !r.get(item.size) || !r.get(priority) || !r.get(item.added) ||
+        !r.get(item.tth) || !r.get(item.tempTarget) || !r.get(n))
+        return false;
+    item.priority = priority;
+
+    item.done.clear();
+    for(uint32_t i = 0; i < n; ++i) {
+        int64_t start, size;
+        if(!r.get(start) || !r.get(size))
+            return false;
+        item.done.insert(Segment(start, size));
+    }
+
+    if(!r.get(n))
+        return false;
+
+    item.sources.clear();
+    for(uint32_t i = 0; i < n; ++i) {
+        CID cid;
+        string hint;
+        if(!r.get(cid) || !r.get(hint))
+            return false;
+        item.sources.push_back(make_pair(cid, hint));
+    }
+    return true;
+}
+
+void QueueStore::changed(QueueItem* qi) {
+    if(!recording || !isSaved(qi))
+        return;
+
+    Item item;
+    save(qi, item);
+
+    FastLock l(cs);
+    pending += static_cast<char>(JOURNAL_ITEM);
+    putItem(pending, item);
+}
+
+void QueueStore::removed(const string& aTarget) {
+    if(!recording)
+        return;
+
+    FastLock l(cs);
+    pending += static_cast<char>(JOURNAL_REMOVE);
+    put(pending, aTarget);
+}
+
+void QueueStore::moved(const string& aSource, const string& aTarget) {
+    if(!recording)
+        return;
+
+    FastLock l(cs);
+    pending += static_cast<char>(JOURNAL_MOVE);
+    put(pending, aSource);
+    put(pending, aTarget);
+}
+
+void QueueStore::priorityChanged(const string& aTarget, QueueItem::Priority p) {
+    if(!recording)
+        return;
+
+    FastLock l(cs);
+    pending += static_cast<char>(JOURNAL_PRIORITY);
+    put(pending, aTarget);
+    put(pending, static_cast<int32_t>(p));
+}
+
+void QueueStore::segmentDone(QueueItem* qi, const Segment& aSegment) {
+    if(!recording || !isSaved(qi))
+        return;
+
+    const string& tempTarget = qi->getTempTarget();
+
+    FastLock l(cs);
+    pending += static_cast<char>(JOURNAL_SEGMENT);
+    put(pending, qi->getTarget());
+    put(pending, tempTarget);
+    put(pending, aSegment.getStart());
+    put(pending, aSegment.getSize());
+}
+
+void QueueStore::sourceAdded(const string& aTarget, const HintedUser& aUser) {
+    if(!recording || !isSaved(aUser))
+        return;
+
+    FastLock l(cs);
+    pending += static_cast<char>(JOURNAL_SOURCE_ADD);
+    put(pending, aTarget);
+    put(pending, aUser.user->getCID());
+    put(pending, aUser.hint);
+}
+
+void QueueStore::sourceRemoved(const string& aTarget, const UserPtr& aUser) {
+    if(!recording)
+        return;
+
+    FastLock l(cs);
+    pending += static_cast<char>(JOURNAL_SOURCE_REMOVE);
+    put(pending, aTarget);
+    put(pending, aUser->getCID());
+}
+
+bool QueueStore::replay(const string& aFile, uint64_t minGeneration, ItemMap& items, uint64_t& gen, int64_t& validSize) {
+    FileImage image(aFile);
+    BinaryReader r = image.reader();
+
+    if(!getHeader(r, JOURNAL_MAGIC, gen) || gen < minGeneration)
+        return false;
+
+    Item item;
+    string target, other;
+    for(;;) {
+        validSize = r.getPos();
+
+        uint8_t type;
+        if(!r.get(type))
+            break;
+
+        if(type == JOURNAL_ITEM) {
+            if(!getItem(r, item))
+                break;
+            items[item.target] = item;
+        } else if(type == JOURNAL_REMOVE) {
+            if(!r.get(target))
+                break;
+            items.erase(target);
+        } else if(type == JOURNAL_MOVE) {
+            if(!r.get(target) || !r.get(other))
+                break;
+            auto i = items.find(target);
+            if(i != items.end()) {
+                Item moved = std::move(i->second);
+                items.erase(i);
+                moved.target = other;
+                items[other] = std::move(moved);
+            }
+        } else if(type == JOURNAL_PRIORITY) {
+            int32_t p;
+            if(!r.get(target) || !r.get(p))
+                break;
+            auto i = items.find(target);
+            if(i != items.end())
+                i->second.priority = p;
+        } else if(type == JOURNAL_SEGMENT) {
+            int64_t start, size;
+            if(!r.get(target) || !r.get(other) || !r.get(start) || !r.get(size))
+                break;
+            auto i = items.find(target);
+            if(i != items.end()) {
+                i->second.tempTarget = other;
+                QueueItem::addSegment(i->second.done, Segment(start, size));
+            }
+        } else if(type == JOURNAL_SOURCE_ADD) {
+            CID cid;
+            if(!r.get(target) || !r.get(cid) || !r.get(other))
+                break;
+            auto i = items.find(target);
+            if(i != items.end()) {
+                auto& sources = i->second.sources;
+                auto j = find_if(sources.begin(), sources.end(), [&cid](const pair<CID, string>& s) { return s.first == cid; });
+                if(j == sources.end())
+                    sources.push_back(make_pair(cid, other));
+            }
+        } else if(type == JOURNAL_SOURCE_REMOVE) {
+            CID cid;
+            if(!r.get(target) || !r.get(cid))
+                break;
+            auto i = items.find(target);
+            if(i != items.end()) {
+                auto& sources = i->second.sources;
+                sources.erase(remove_if(sources.begin(), sources.end(), [&cid](const pair<CID, string>& s) { return s.first == cid; }), sources.end());
+            }
+        } else {
+            break;
+        }
+    }
+
+    return true;
+}
+
+static uint64_t readSnapshot(const string& aFile, QueueStore::ItemMap& items) {
+    FileImage image(aFile);
+    BinaryReader r = image.reader();
+
+    uint64_t gen, count;
+    if(!getHeader(r, SNAPSHOT_MAGIC, gen) || !r.get(count))
+        throw FileException(_("Invalid queue file"));
+
+    items.reserve(count);
+    QueueStore::Item item;
+    for(uint64_t i = 0; i < count; ++i) {
+        if(!QueueStore::getItem(r, item))
+            throw FileException(_("Invalid queue file"));
+        items[item.target] = item;
+    }
+    return gen;
+}
+
+void QueueStore::writeSnapshot(const string& aFile, uint64_t generation, const ItemMap& items) {
+    string tmpName = aFile + ".tmp";
+    {
+        File ff(tmpName, File::WRITE, File::CREATE | File::TRUNCATE);
+        BufferedOutputStream<false> f(&ff);
+
+        string buf;
+        putHeader(buf, SNAPSHOT_MAGIC, generation);
+        put(buf, static_cast<uint64_t>(items.size()));
+        f.write(buf);
+
+        for(auto i = items.begin(); i != items.end(); ++i) {
+            buf.clear();
+            putItem(buf, i->second);
+            f.write(buf);
+        }
+        f.flush();
+    }
+
+    File::deleteFile(aFile);
+    File::renameFile(tmpName, aFile);
+}
+
+bool QueueStore::exists() const {
+    return Util::fileExists(getSnapshotFile()) || Util::fileExists(getJournalFile());
+}
+
+void QueueStore::load(ItemMap& items) {
+    Lock l(fileCs);
+
+    uint64_t snapshotGen = 0;
+    try {
+        if(Util::fileExists(getSnapshotFile()))
+            snapshotGen = readSnapshot(getSnapshotFile(), items);
+    } catch(const Exception& e) {
+        dcdebug("QueueStore: %s\n", e.getError().c_str());
+    }
+    generation = snapshotGen;
+
+    string rotated = getJournalFile() + ".old";
+    bool compact = false;
+    try {
+        uint64_t gen;
+        int64_t validSize;
+        if(Util::fileExists(rotated)) {
+            if(replay(rotated, snapshotGen, items, gen, validSize)) {
+                // the last compaction didn't get through
+                generation = max(generation, gen + 1);
+                compact = true;
+            } else {
+                File::deleteFile(rotated);
+            }
+        }
+        if(Util::fileExists(getJournalFile())) {
+            if(replay(getJournalFile(), snapshotGen, items, gen, validSize)) {
+                generation = max(generation, gen);
+                journalSize = File::getSize(getJournalFile());
+                if(validSize < journalSize) {
+                    // cut off the torn record, or nothing appended after it would ever be read
+                    File(getJournalFile(), File::WRITE, File::OPEN).setSize(validSize);
+                    journalSize = validSize;
+                }
+            } else {
+                // can't continue a journal nobody will read
+                File::deleteFile(getJournalFile());
+            }
+        }
+    } catch(const Exception& e) {
+        dcdebug("QueueStore: %s\n", e.getError().c_str());
+    }
+
+    if(compact)
+        startCompaction();
+}
+
+void QueueStore::write(const ItemMap& items) {
+    Lock l(fileCs);
+
+    // whatever a running compaction would write is replaced anyway
+    compactor.reset();
+    compacting = false;
+
+    {
+        FastLock l(cs);
+        pending.clear();
+    }
+
+    try {
+        writeSnapshot(getSnapshotFile(), generation + 1, items);
+        File::deleteFile(getJournalFile());
+        File::deleteFile(getJournalFile() + ".old");
+        generation++;
+        journalSize = 0;
+    } catch(const Exception& e) {
+        dcdebug("QueueStore: %s\n", e.getError().c_str());
+    }
+}
+
+void QueueStore::flush() noexcept {
+    Lock l(fileCs);
+
+    string buf;
+    {
+        FastLock l(cs);
+        buf.swap(pending);
+    }
+
+    if(!buf.empty()) {
+        try {
+            File f(getJournalFile(), File::WRITE, File::OPEN | File::CREATE);
+            int64_t pos = max(f.getSize(), (int64_t)0);
+            f.setPos(pos);
+            try {
+                if(pos == 0) {
+                    string header;
+                    putHeader(header, JOURNAL_MAGIC, generation);
+                    f.write(header);
+                }
+                f.write(buf);
+            } catch(const FileException&) {
+                // don't leave a torn record in front of the ones written next time
+                f.setSize(pos);
+                throw;
+            }
+            journalSize = f.getSize();
+        } catch(const FileException&) {
+            // keep the changes for the next try
+            FastLock l(cs);
+            pending.insert(0, buf);
+        }
+    }
+
+    if(!compacting && journalSize > max(MIN_COMPACT_SIZE, File::getSize(getSnapshotFile()))) {
+        string rotated = getJournalFile() + ".old";
+        try {
+            // a journal left over from a failed compaction is folded in first
+            if(!Util::fileExists(rotated)) {
+                File::renameFile(getJournalFile(), rotated);
+                generation++;
+                journalSize = 0;
+            }
+            startCompaction();
+        } catch(const FileException& e) {
+            dcdebug("QueueStore: can't rotate the journal: %s\n", e.getError().c_str());
+        }
+    }
+}
+
+void QueueStore::startCompaction() {
+    if(!compactor)
+        compactor.reset(new ThreadPool("QueueStore", 1, Thread::IDLE));
+
+    compacting = true;
+    uint64_t gen = generation;
+    compactor->add([this, gen] {
+        string rotated = getJournalFile() + ".old";
+        try {
+            ItemMap items;
+            uint64_t snapshotGen = 0;
+            if(Util::fileExists(getSnapshotFile()))
+                snapshotGen = readSnapshot(getSnapshotFile(), items);
+            uint64_t rotatedGen;
+            int64_t validSize;
+            replay(rotated, snapshotGen, items, rotatedGen, validSize);
+
+            writeSnapshot(getSnapshotFile(), gen, items);
+            File::deleteFile(rotated);
+        } catch(const Exception& e) {
+            dcdebug("QueueStore: compaction failed: %s\n", e.getError().c_str());
+        }
+        compacting = false;
+    });
+}
+
+} // namespace dcpp
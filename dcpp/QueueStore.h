@@ -0,0 +1,121 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <atomic>
+
+#include "CriticalSection.h"
+#include "QueueItem.h"
+#include "ThreadPool.h"
+
+namespace dcpp {
+
+class BinaryReader;
+
+/**
+ * Persistent state of the download queue.
+ * Queue.dat holds a snapshot of the queue and Queue.journal the changes made since, which the
+ * queue records as they happen; flush() only appends them to the journal. Once the journal has
+ * grown large enough, it's folded into a new snapshot on a background thread, without involving
+ * the live queue at all.
+ */
+class QueueStore : private boost::noncopyable
+{
+public:
+    /** What is saved of a queue item */
+    struct Item {
+        Item() : size(0), priority(QueueItem::DEFAULT), added(0) { }
+
+        string target;
+        int64_t size;
+        int priority;
+        int64_t added;
+        TTHValue tth;
+        string tempTarget;
+        QueueItem::SegmentSet done;
+        vector<pair<CID, string> > sources;
+    };
+    typedef unordered_map<string, Item> ItemMap;
+
+    QueueStore();
+    ~QueueStore();
+
+    /** @return Whether there is anything saved in the binary format */
+    bool exists() const;
+    /** Read the snapshot and replay the journals on top of it */
+    void load(ItemMap& items);
+    /** Replace whatever is saved by these items */
+    void write(const ItemMap& items);
+
+    /**
+     * Changes to the queue; called with the queue locked so that they're recorded in order.
+     * changed() is for additions and anything the others don't cover.
+     */
+    void changed(QueueItem* qi);
+    void removed(const string& aTarget);
+    void moved(const string& aSource, const string& aTarget);
+    void priorityChanged(const string& aTarget, QueueItem::Priority p);
+    void segmentDone(QueueItem* qi, const Segment& aSegment);
+    void sourceAdded(const string& aTarget, const HintedUser& aUser);
+    void sourceRemoved(const string& aTarget, const UserPtr& aUser);
+
+    /** Write the recorded changes to the journal */
+    void flush() noexcept;
+
+    /** Stop recording changes while the queue is filled from what was saved */
+    void setRecording(bool aRecording) { recording = aRecording; }
+
+    /** Fill an item from a queue item */
+    static void save(QueueItem* qi, Item& item);
+    /** @return Whether the item is saved at all */
+    static bool isSaved(const QueueItem* qi);
+    static bool getItem(BinaryReader& r, Item& item);
+
+private:
+    static bool isSaved(const HintedUser& aUser);
+    static void putItem(string& buf, const Item& item);
+    /**
+     * Apply the records of a journal with a generation of at least minGeneration; false if it's older or invalid.
+     * validSize is set to the size of the complete records, which is less than the file size after a crash.
+     */
+    static bool replay(const string& aFile, uint64_t minGeneration, ItemMap& items, uint64_t& generation, int64_t& validSize);
+    static void writeSnapshot(const string& aFile, uint64_t generation, const ItemMap& items);
+
+    /** Fold the rotated journal into a new snapshot on the compactor thread */
+    void startCompaction();
+
+    string getSnapshotFile() const { return path + "Queue.dat"; }
+    string getJournalFile() const { return path + "Queue.journal"; }
+
+    const string path;
+
+    /** Protects pending */
+    FastCriticalSection cs;
+    string pending;
+    bool recording;
+
+    /** Serializes the writers of the journal and snapshot files */
+    CriticalSection fileCs;
+    /** Generation of the journal being written; a snapshot of generation n contains all journals before n */
+    uint64_t generation;
+    int64_t journalSize;
+
+    std::atomic<bool> compacting;
+    unique_ptr<ThreadPool> compactor;
+};
+
+} // namespace dcpp
@@ -99,6 +99,12 @@ const string SettingsManager::settingTags[] =
     "UseADLOnlyOnOwnList", "AllowSimUploads", "CheckTargetsPathsOnStart", "NmdcDebug",
     "ShareSkipZeroByte", "RequireTLS", "LogSpy", "AppUnitBase",
     "LogCmdDebug",
+    "SocketEngine", "SocketIoThreads",
+    "HasherThreads",
+    "ShareIncrementalRefresh", "ShareWatch",
+    "ShareScanThreads", "ShareScanDeviceThreads", "UploadFileCache", "UploadReadAhead",
+    "HashReadMode", "HashDirectIO", "DownloadWriteQueue",
+    "DownloadPreallocate", "DownloadDirectIOSize",
     "SENTRY",
     // Int64
     "TotalUpload", "TotalDownload",
@@ -308,6 +314,20 @@ SettingsManager::SettingsManager()
     setDefault(CHECK_TARGETS_PATHS_ON_START, false);
     setDefault(SHARE_SKIP_ZERO_BYTE, false);
     setDefault(APP_UNIT_BASE, 0);
+    setDefault(SOCKET_ENGINE, SOCKET_ENGINE_THREAD);
+    setDefault(SOCKET_IO_THREADS, 0);   // 0 = pick from the number of CPUs
+    setDefault(HASHER_THREADS, 1);
+    setDefault(SHARE_INCREMENTAL_REFRESH, true);
+    setDefault(SHARE_WATCH, false);
+    setDefault(SHARE_SCAN_THREADS, 4);
+    setDefault(SHARE_SCAN_DEVICE_THREADS, 1);
+    setDefault(UPLOAD_FILE_CACHE, 16);
+    setDefault(UPLOAD_READ_AHEAD, true);
+    setDefault(HASH_READ_MODE, 1);
+    setDefault(HASH_DIRECT_IO, false);
+    setDefault(DOWNLOAD_WRITE_QUEUE, 4096);
+    setDefault(DOWNLOAD_PREALLOCATE, true);
+    setDefault(DOWNLOAD_DIRECT_IO_SIZE, 0);
     setSearchTypeDefaults();
 }
 
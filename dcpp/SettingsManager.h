@@ -118,6 +118,12 @@ public:
         NMDC_DEBUG, SHARE_SKIP_ZERO_BYTE, REQUIRE_TLS, LOG_SPY,
         APP_UNIT_BASE,
         LOG_CMD_DEBUG,
+        SOCKET_ENGINE, SOCKET_IO_THREADS,
+        HASHER_THREADS,
+        SHARE_INCREMENTAL_REFRESH, SHARE_WATCH,
+        SHARE_SCAN_THREADS, SHARE_SCAN_DEVICE_THREADS, UPLOAD_FILE_CACHE, UPLOAD_READ_AHEAD,
+        HASH_READ_MODE, HASH_DIRECT_IO, DOWNLOAD_WRITE_QUEUE,
+        DOWNLOAD_PREALLOCATE, DOWNLOAD_DIRECT_IO_SIZE,
         INT_LAST };
 
     enum Int64Setting { INT64_FIRST = INT_LAST + 1,
@@ -130,6 +136,8 @@ public:
         INCOMING_FIREWALL_PASSIVE };
     enum {  OUTGOING_DIRECT, OUTGOING_SOCKS5 };
 
+    enum {  SOCKET_ENGINE_THREAD, SOCKET_ENGINE_REACTOR };
+
     enum {  MAGNET_AUTO_SEARCH, MAGNET_AUTO_DOWNLOAD };
 
     const string& get(StrSetting key, bool useDefault = true) const {
@@ -37,6 +37,9 @@
 #include "Download.h"
 #include "HashBloom.h"
 #include "SearchResult.h"
+#include "ShareWatcher.h"
+#include "ThreadPool.h"
+#include "BinaryIO.h"
 #include "version.h"
 #ifdef WITH_DHT
 #include "dht/IndexManager.h"
@@ -50,13 +53,17 @@
 #endif
 
 #include <limits>
+#include <thread>
 
 namespace dcpp {
 
 ShareManager::ShareManager() : hits(0), xmlListLen(0), bzXmlListLen(0),
     xmlDirty(true), forceXmlRefresh(false), refreshDirs(false), update(false), initial(true), listN(0), refreshing(false),
-    lastXmlUpdate(0), lastFullUpdate(GET_TICK()), bloom(1<<20)
+    lastXmlUpdate(0), lastFullUpdate(GET_TICK()), shareSize(0), sharedFiles(0), bloom(1<<20), building(0), incremental(false)
 {
+    for(auto& i: typeFiles)
+        i = 0;
+
     SettingsManager::getInstance()->addListener(this);
     TimerManager::getInstance()->addListener(this);
     QueueManager::getInstance()->addListener(this);
@@ -70,6 +77,7 @@ ShareManager::~ShareManager() {
     HashManager::getInstance()->removeListener(this);
 
     join();
+    watcher.reset();
 
     if(bzXmlRef.get()) {
         bzXmlRef.reset();
@@ -79,10 +87,18 @@ ShareManager::~ShareManager() {
 
 ShareManager::Directory::Directory(const string& aName, const ShareManager::Directory::Ptr& aParent) :
     size(0),
-    name(aName),
+    lastWrite(0),
     parent(aParent.get()),
     fileTypes(1 << SearchManager::TYPE_DIRECTORY)
 {
+    setName(aName);
+}
+
+string ShareManager::Directory::foldName(const string& aName) {
+    string lower;
+    if(Text::toLower(aName, lower) == aName)
+        return Util::emptyString;
+    return lower;
 }
 
 string ShareManager::Directory::getADCPath() const noexcept {
@@ -134,13 +150,13 @@ int64_t ShareManager::Directory::getSize() const noexcept {
 }
 
 string ShareManager::toVirtual(const TTHValue& tth) const {
+    Lock l(cs);
     if(tth == bzXmlRoot) {
         return Transfer::USER_LIST_NAME_BZ;
     } else if(tth == xmlRoot) {
         return Transfer::USER_LIST_NAME;
     }
 
-    Lock l(cs);
     auto i = tthIndex.find(tth);
     if(i != tthIndex.end()) {
         return i->second->getADCPath();
@@ -150,14 +166,16 @@ string ShareManager::toVirtual(const TTHValue& tth) const {
 }
 
 string ShareManager::toReal(const string& virtualFile) {
-    Lock l(cs);
     if(virtualFile == "MyList.DcLst") {
         throw ShareException("NMDC-style lists no longer supported, please upgrade your client");
     } else if(virtualFile == Transfer::USER_LIST_NAME_BZ || virtualFile == Transfer::USER_LIST_NAME) {
+        // not under cs, which the generation mostly runs without
         generateXmlList();
+        Lock l(cs);
         return getBZXmlFile();
     }
 
+    Lock l(cs);
     return findFile(virtualFile)->getRealPath();
 }
 
@@ -227,6 +245,7 @@ MemoryInputStream* ShareManager::getTree(const string& virtualFile) const {
 AdcCommand ShareManager::getFileInfo(const string& aFile) {
     if(aFile == Transfer::USER_LIST_NAME) {
         generateXmlList();
+        Lock l(cs);
         AdcCommand cmd(AdcCommand::CMD_RES);
         cmd.addParam("FN", aFile);
         cmd.addParam("SI", Util::toString(xmlListLen));
@@ -234,6 +253,7 @@ AdcCommand ShareManager::getFileInfo(const string& aFile) {
         return cmd;
     } else if(aFile == Transfer::USER_LIST_NAME_BZ) {
         generateXmlList();
+        Lock l(cs);
 
         AdcCommand cmd(AdcCommand::CMD_RES);
         cmd.addParam("FN", aFile);
@@ -355,21 +375,26 @@ static const string SSIZE = "Size";
 static const string STTH = "TTH";
 
 struct ShareLoader : public SimpleXMLReader::CallBack {
-    ShareLoader(ShareManager::DirList& aDirs) : dirs(aDirs), cur(0), depth(0) { }
+    ShareLoader(ShareManager::DirList& aDirs, const vector<uint32_t>& aTimes) : dirs(aDirs), times(aTimes), cur(0), depth(0), dirCount(0) { }
     virtual void startTag(const string& name, StringPairList& attribs, bool simple) {
         if(name == SDIRECTORY) {
             const string& name = getAttrib(attribs, SNAME, 0);
+            // the times are in the order the directories were listed in
+            const uint32_t lastWrite = dirCount < times.size() ? times[dirCount] : 0;
+            dirCount++;
             if(!name.empty()) {
                 if(depth == 0) {
                     for(auto i = dirs.begin(); i != dirs.end(); ++i) {
                         if(Util::stricmp((*i)->getName(), name) == 0) {
                             cur = *i;
+                            cur->lastWrite = lastWrite;
                             break;
                         }
                     }
                 } else if(cur) {
                     cur = ShareManager::Directory::create(name, cur);
                     cur->getParent()->directories[cur->getName()] = cur;
+                    cur->lastWrite = lastWrite;
                 }
             }
 
@@ -402,18 +427,69 @@ struct ShareLoader : public SimpleXMLReader::CallBack {
 
 private:
     ShareManager::DirList& dirs;
+    const vector<uint32_t>& times;
 
     ShareManager::Directory::Ptr cur;
     size_t depth;
+    size_t dirCount;
 };
 
+/*
+ * ShareTimes.dat, in native byte order: magic, version, root of the files.xml.bz2 it belongs to,
+ * directory count, then Directory::lastWrite of each directory in the order of the list.
+ */
+static const uint32_t TIMES_MAGIC = 0x4d495453; // "STIM"
+static const uint32_t TIMES_VERSION = 1;
+
+static string getTimesFile() {
+    return Util::getPath(Util::PATH_USER_CONFIG) + "ShareTimes.dat";
+}
+
+static bool loadTimes(const TTHValue& aRoot, vector<uint32_t>& aTimes) {
+    try {
+        FileImage image(getTimesFile());
+        BinaryReader r = image.reader();
+
+        uint32_t magic, version, count;
+        TTHValue root;
+        if(!r.get(magic) || magic != TIMES_MAGIC || !r.get(version) || version != TIMES_VERSION ||
+            !r.get(root) || root != aRoot || !r.get(count))
+        {
+            return false;
+        }
+
+        aTimes.resize(count);
+        for(auto i = aTimes.begin(); i != aTimes.end(); ++i) {
+            if(!r.get(*i))
+                return false;
+        }
+        return true;
+    } catch(const FileException&) {
+        return false;
+    }
+}
+
 bool ShareManager::loadCache() noexcept {
     try {
-        ShareLoader loader(directories);
+        const string listFile = Util::getPath(Util::PATH_USER_CONFIG) + "files.xml.bz2";
+
+        // The times are only good for the very list they were saved with
+        vector<uint32_t> times;
+        {
+            TigerTree tree(1024*1024*1024);
+            dcpp::File ff(listFile, dcpp::File::READ, dcpp::File::OPEN);
+            const string data = ff.read();
+            tree.update(data.data(), data.size());
+            tree.finalize();
+            if(!loadTimes(tree.getRoot(), times))
+                times.clear();
+        }
+
+        ShareLoader loader(directories, times);
         SimpleXMLReader xml(&loader);
 
-        dcpp::File ff(Util::getPath(Util::PATH_USER_CONFIG) + "files.xml.bz2", dcpp::File::READ, dcpp::File::OPEN);
-        FilteredInputStream<UnBZFilter, false> f(&ff);
+        dcpp::File ff(listFile, dcpp::File::READ, dcpp::File::OPEN);
+        BZBlockReader f(&ff);
 
         xml.parse(f);
 
@@ -578,6 +654,7 @@ void ShareManager::removeDirectory(const string& realPath) {
 
     rebuildIndices();
     setDirty();
+    UploadManager::getInstance()->clearFileCache();
 }
 
 void ShareManager::renameDirectory(const string& realPath, const string& virtualName) {
@@ -608,25 +685,57 @@ int64_t ShareManager::getShareSize(const string& realPath) const noexcept {
     return -1;
 }
 
-int64_t ShareManager::getShareSize() const noexcept {
-    Lock l(cs);
-    int64_t tmp = 0;
-    for(auto i = tthIndex.begin(); i != tthIndex.end(); ++i) {
-        tmp += i->second->getSize();
-    }
-    return tmp;
-}
-
-size_t ShareManager::getSharedFiles() const noexcept {
-    Lock l(cs);
-    return tthIndex.size();
-}
-
-ShareManager::Directory::Ptr ShareManager::buildTree(const string& aName, const Directory::Ptr& aParent) {
+ShareManager::Directory::Ptr ShareManager::buildTree(const string& aName, const Directory::Ptr& aParent, const Directory::Ptr& aOld,
+    bool aRelist, vector<ScanJob>* aSubdirs)
+{
     auto dir = Directory::create(Util::getLastDir(aName), aParent);
 
     auto lastFileIter = dir->files.begin();
 
+    const uint32_t lastWrite = File::getLastModified(aName);
+    Directory::Map subdirs;
+    if(aOld) {
+        // The entries of a directory only change along with its modification time, so an unchanged
+        // one keeps its files; its subdirectories have times of their own to compare.
+        bool unchanged = false;
+        StringList kept;
+        {
+            Lock l(cs);
+            subdirs = aOld->directories;
+            if(!aRelist && lastWrite != 0 && aOld->lastWrite == lastWrite) {
+                unchanged = true;
+                kept.reserve(aOld->files.size());
+                for(auto i = aOld->files.begin(); i != aOld->files.end(); ++i) {
+                    lastFileIter = dir->files.insert(lastFileIter, Directory::File(i->getName(), i->getSize(), dir, i->getTTH()));
+                    kept.push_back(i->getName());
+                }
+            }
+        }
+
+        if(unchanged) {
+            // the hash store only keeps the trees of files that were looked up since it was loaded
+            HashManager::getInstance()->markUsed(aName, kept);
+            dir->lastWrite = lastWrite;
+            for(auto i = subdirs.begin(); i != subdirs.end(); ++i) {
+                const string newName = aName + i->first + PATH_SEPARATOR;
+                if(File::getLastModified(newName) == 0) {
+                    continue;
+                }
+                if(aSubdirs) {
+                    aSubdirs->push_back(ScanJob(newName, dir, i->second));
+                } else {
+                    dir->directories[i->first] = buildTree(newName, dir, i->second);
+                }
+            }
+            return dir;
+        }
+    }
+
+    // Files still to be hashed are added later on; until then the directory isn't complete
+    bool complete = true;
+    // The files are looked up in the hash store all at once, after the listing
+    HashManager::FileCheckList files;
+
     FileFindIter end;
     const string l_skip_list = SETTING(SKIPLIST_SHARE);
 #ifdef _WIN32
@@ -668,7 +777,13 @@ ShareManager::Directory::Ptr ShareManager::buildTree(const string& aName, const
             if((::strcmp(newName.c_str(), SETTING(TEMP_DOWNLOAD_DIRECTORY).c_str()) != 0)
                     && (::strcmp(newName.c_str(), Util::getPath(Util::PATH_USER_CONFIG).c_str()) != 0)
                     && (::strcmp(newName.c_str(), SETTING(LOG_DIRECTORY).c_str()) != 0)) {
-                dir->directories[name] = buildTree(newName, dir);
+                auto j = subdirs.find(name);
+                const auto old = j != subdirs.end() ? j->second : Directory::Ptr();
+                if(aSubdirs) {
+                    aSubdirs->push_back(ScanJob(newName, dir, old));
+                } else {
+                    dir->directories[name] = buildTree(newName, dir, old);
+                }
             }
         } else {
             // Not a directory, assume it's a file...make sure we're not sharing the settings file...
@@ -688,15 +803,24 @@ ShareManager::Directory::Ptr ShareManager::buildTree(const string& aName, const
                 if(Util::stricmp(fileName, SETTING(TLS_PRIVATE_KEY_FILE)) == 0) {
                     continue;
                 }
-                try {
-                    if(HashManager::getInstance()->checkTTH(fileName, size, i->getLastWriteTime()))
-                        lastFileIter = dir->files.insert(lastFileIter, Directory::File(name, size, dir, HashManager::getInstance()->getTTH(fileName, size)));
-                } catch(const HashException&) {
-                }
+                files.push_back(HashManager::FileCheck(name, size, i->getLastWriteTime()));
             }
         }
     }
 
+    HashManager::getInstance()->checkTTHs(aName, files);
+    for(auto i = files.begin(); i != files.end(); ++i) {
+        if(i->current)
+            lastFileIter = dir->files.insert(lastFileIter, Directory::File(i->name, i->size, dir, i->root));
+        else
+            complete = false;
+    }
+
+    // A change within the same second as the listing wouldn't show in the time
+    if(complete && lastWrite + 1 < static_cast<uint32_t>(GET_TIME())) {
+        dir->lastWrite = lastWrite;
+    }
+
     return dir;
 }
 
@@ -738,7 +862,8 @@ bool ShareManager::checkHidden(const string& aName) const
 //NOTE: freedcpp +]
 
 void ShareManager::updateIndices(Directory& dir) {
-    bloom.add(Text::toLower(dir.getName()));
+    bloom.add(dir.getLowerName());
+    nameIndex.add(dir.getLowerName(), &dir);
 
     for(auto i = dir.directories.begin(); i != dir.directories.end(); ++i) {
         updateIndices(*i->second);
@@ -754,12 +879,152 @@ void ShareManager::updateIndices(Directory& dir) {
 void ShareManager::rebuildIndices() {
     tthIndex.clear();
     bloom.clear();
+    nameIndex.clear();
+    retired.clear();
+    dupes.clear();
+
+    shareSize = 0;
+    sharedFiles = 0;
+    for(auto& i: typeFiles)
+        i = 0;
 
     for(auto i = directories.begin(); i != directories.end(); ++i) {
         updateIndices(**i);
     }
 }
 
+bool ShareManager::addIndex(const Directory::File::Set::const_iterator& i, int aType) {
+    if(!tthIndex.insert(make_pair(i->getTTH(), i)).second)
+        return false;
+
+    shareSize += i->getSize();
+    sharedFiles++;
+    typeFiles[aType]++;
+    return true;
+}
+
+void ShareManager::removeIndex(const HashFileIter& j) {
+    const Directory::File& f = *j->second;
+    shareSize -= f.getSize();
+    sharedFiles--;
+    typeFiles[getType(f.getName())]--;
+    tthIndex.erase(j);
+}
+
+namespace {
+    /** Bytes a word is made of; a pattern made of these can only be found inside a single word */
+    inline bool isWordByte(uint8_t c) { return c >= 0x80 || (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+    inline uint32_t trigram(const char* p) { return (uint32_t)(uint8_t)p[0] | ((uint32_t)(uint8_t)p[1] << 8) | ((uint32_t)(uint8_t)p[2] << 16); }
+}
+
+void ShareManager::NameIndex::add(const string& aLowerName, const Directory* aDir) {
+    if(aDir != lastDir) {
+        lastDir = aDir;
+        dirCount++;
+    }
+
+    for(string::size_type i = 0; i < aLowerName.size(); ) {
+        if(!isWordByte(aLowerName[i])) {
+            ++i;
+            continue;
+        }
+        string::size_type j = i;
+        while(j < aLowerName.size() && isWordByte(aLowerName[j]))
+            ++j;
+
+        const string word = aLowerName.substr(i, j - i);
+        auto w = wordIds.find(word);
+        if(w == wordIds.end()) {
+            const uint32_t id = static_cast<uint32_t>(words.size());
+            w = wordIds.insert(make_pair(word, id)).first;
+            words.push_back(Word(word));
+            for(string::size_type k = 0; k + 3 <= word.size(); ++k) {
+                auto& ids = trigrams[trigram(word.data() + k)];
+                if(ids.empty() || ids.back() != id)
+                    ids.push_back(id);
+            }
+        }
+
+        // files of a directory are added one after the other
+        auto& dirs = words[w->second].dirs;
+        if(dirs.empty() || dirs.back() != aDir)
+            dirs.push_back(aDir);
+        i = j;
+    }
+}
+
+void ShareManager::NameIndex::clear() {
+    wordIds.clear();
+    words.clear();
+    trigrams.clear();
+    lastDir = 0;
+    dirCount = 0;
+}
+
+void ShareManager::NameIndex::find(const string& aPattern, size_t aTerm, Candidates& aCandidates) const {
+    // The longest run of word bytes must be inside one word of every matching name
+    string::size_type start = 0, len = 0;
+    for(string::size_type i = 0; i < aPattern.size(); ) {
+        string::size_type j = i;
+        while(j < aPattern.size() && isWordByte(aPattern[j]))
+            ++j;
+        if(j - i > len) {
+            start = i;
+            len = j - i;
+        }
+        i = j + 1;
+    }
+    if(len < 3)
+        return;
+    const string part = aPattern.substr(start, len);
+
+    // Words holding every trigram of the part, starting with the rarest trigram
+    const vector<uint32_t>* rarest = 0;
+    for(string::size_type k = 0; k + 3 <= part.size(); ++k) {
+        auto t = trigrams.find(trigram(part.data() + k));
+        if(t == trigrams.end()) {
+            aCandidates.narrowed |= MultiStringSearch::Mask(1) << aTerm;
+            return;
+        }
+        if(!rarest || t->second.size() < rarest->size())
+            rarest = &t->second;
+    }
+
+    vector<const Word*> found;
+    size_t postings = 0;
+    for(auto id: *rarest) {
+        const Word& w = words[id];
+        if(w.text.find(part) != string::npos) {
+            found.push_back(&w);
+            postings += w.dirs.size();
+        }
+    }
+
+    // Not worth it when the term is all over the share
+    if(postings * 2 > dirCount)
+        return;
+
+    aCandidates.narrowed |= MultiStringSearch::Mask(1) << aTerm;
+    if(aCandidates.dirs.size() <= aTerm)
+        aCandidates.dirs.resize(aTerm + 1);
+    DirSet& dirs = aCandidates.dirs[aTerm];
+    for(auto w: found) {
+        for(auto d: w->dirs) {
+            for(; d && dirs.insert(d).second; d = d->getParent())
+                ;   // Empty
+        }
+    }
+}
+
+bool ShareManager::Directory::isCandidate(MultiStringSearch::Mask aNeed, const NameIndex::Candidates& aCandidates) const noexcept {
+    aNeed &= aCandidates.narrowed;
+    for(size_t i = 0; aNeed; ++i, aNeed >>= 1) {
+        if((aNeed & 1) && (i >= aCandidates.dirs.size() || aCandidates.dirs[i].find(this) == aCandidates.dirs[i].end()))
+            return false;
+    }
+    return true;
+}
+
 void ShareManager::updateIndices(Directory& dir, const Directory::File::Set::iterator& i) {
     const Directory::File& f = *i;
 
@@ -767,7 +1032,9 @@ void ShareManager::updateIndices(Directory& dir, const Directory::File::Set::ite
     if(j == tthIndex.end()) {
         dir.size+=f.getSize();
     } else {
-        if(!SETTING(LIST_DUPES)) {
+        if(SETTING(LIST_DUPES)) {
+            dupes.insert(f.getTTH());
+        } else {
             try {
                 LogManager::getInstance()->message(str(F_("Duplicate file will not be shared: %1% (Size: %2% B) Dupe matched against: %3%")
                 % Util::addBrackets(dir.getRealPath(f.getName())) % Util::toString(f.getSize()) % Util::addBrackets(j->second->getParent()->getRealPath(j->second->getName()))));
@@ -777,10 +1044,12 @@ void ShareManager::updateIndices(Directory& dir, const Directory::File::Set::ite
         }
     }
 
-    dir.addType(getType(f.getName()));
+    const auto type = getType(f.getName());
+    dir.addType(type);
 
-    tthIndex.insert(make_pair(f.getTTH(), i));
-    bloom.add(Text::toLower(f.getName()));
+    addIndex(i, type);
+    bloom.add(f.getLowerName());
+    nameIndex.add(f.getLowerName(), &dir);
 #ifdef WITH_DHT
     dht::IndexManager* im = dht::IndexManager::getInstance();
     if(im && im->isTimeForPublishing())
@@ -788,7 +1057,23 @@ void ShareManager::updateIndices(Directory& dir, const Directory::File::Set::ite
 #endif
 }
 
-void ShareManager::refresh(bool dirs /* = false */, bool aUpdate /* = true */, bool block /* = false */) noexcept {
+void ShareManager::removeIndices(const Directory& dir, vector<TTHValue>& aOrphans) {
+    for(auto i = dir.directories.begin(); i != dir.directories.end(); ++i) {
+        removeIndices(*i->second, aOrphans);
+    }
+
+    // bloom and nameIndex can't forget names, which only makes them find a bit more than there is
+    for(auto i = dir.files.begin(); i != dir.files.end(); ++i) {
+        auto j = tthIndex.find(i->getTTH());
+        if(j != tthIndex.end() && &*j->second == &*i) {
+            if(dupes.find(i->getTTH()) != dupes.end())
+                aOrphans.push_back(i->getTTH());
+            removeIndex(j);
+        }
+    }
+}
+
+void ShareManager::refresh(bool dirs /* = false */, bool aUpdate /* = true */, bool block /* = false */, bool aIncremental /* = false */) noexcept {
     if(refreshing.exchange(true) == true) {
         LogManager::getInstance()->message(_("File list refresh in progress, please wait for it to finish before trying to refresh again"));
         return;
@@ -797,6 +1082,7 @@ void ShareManager::refresh(bool dirs /* = false */, bool aUpdate /* = true */, b
 
     update = aUpdate;
     refreshDirs = dirs;
+    incremental = aIncremental;
     join();
     bool cached = false;
     if(initial) {
@@ -838,15 +1124,38 @@ int ShareManager::run() {
 
         lastFullUpdate = GET_TICK();
 
-        DirList newDirs;
+        {
+            Lock l(cs);
+            building++;
+        }
+
+        vector<pair<string, Directory::Ptr> > roots;
+        StringList names;
         for(auto i = dirs.begin(); i != dirs.end(); ++i) {
             if (checkHidden(i->second)) {
-                Directory::Ptr dp = buildTree(i->second, Directory::Ptr());
-                dp->setName(i->first);
-                newDirs.push_back(dp);
+                // A virtual directory made of several real ones can't be compared to any of them
+                Directory::Ptr old;
+                if(incremental) {
+                    Lock l(cs);
+                    auto j = getByVirtual(i->first);
+                    if(j != directories.end() && count_if(dirs.begin(), dirs.end(),
+                        [&](const StringPair& d) { return Util::stricmp(d.first, i->first) == 0; }) == 1)
+                    {
+                        old = *j;
+                    }
+                }
+
+                roots.push_back(make_pair(i->second, old));
+                names.push_back(i->first);
             }
         }
 
+        DirList newDirs = buildTrees(roots);
+        auto name = names.begin();
+        for(auto i = newDirs.begin(); i != newDirs.end(); ++i, ++name) {
+            (*i)->setName(*name);
+        }
+
         {
             Lock l(cs);
             directories.clear();
@@ -856,12 +1165,17 @@ int ShareManager::run() {
             }
 
             rebuildIndices();
+            finishBuild();
         }
+        // files may have been replaced behind the handles kept open for uploads
+        UploadManager::getInstance()->clearFileCache();
         refreshDirs = false;
 
         LogManager::getInstance()->message(_("File list refresh finished"));
     }
 
+    updateWatcher();
+
     if(update) {
         ClientManager::getInstance()->infoUpdated();
     }
@@ -874,6 +1188,235 @@ int ShareManager::run() {
     return 0;
 }
 
+ShareManager::DirList ShareManager::buildTrees(const vector<pair<string, Directory::Ptr> >& aRoots) {
+    DirList ret;
+    const size_t threads = static_cast<size_t>(max(SETTING(SHARE_SCAN_THREADS), 1));
+    if(threads == 1 || aRoots.empty()) {
+        for(auto i = aRoots.begin(); i != aRoots.end(); ++i) {
+            ret.push_back(buildTree(i->first, Directory::Ptr(), i->second));
+        }
+        return ret;
+    }
+
+    const size_t perDevice = static_cast<size_t>(max(SETTING(SHARE_SCAN_DEVICE_THREADS), 1));
+
+    // The directories of each device are taken off its queue by at most perDevice lanes, which
+    // wait for more while a root of theirs is still being listed and end once all are done
+    struct Device {
+        Device() : running(0), lanes(0) { }
+        deque<ScanJob*> pending;
+        size_t running;
+        size_t lanes;
+        Semaphore s;
+    };
+
+    FastCriticalSection scanCs;
+    deque<ScanJob> jobs;
+    map<string, Device> devices;
+    vector<Device*> order;
+
+    for(auto i = aRoots.begin(); i != aRoots.end(); ++i) {
+        jobs.push_back(ScanJob(i->first, Directory::Ptr(), i->second));
+        const string device = File::getDevice(i->first);
+        if(devices.find(device) == devices.end()) {
+            order.push_back(&devices[device]);
+        }
+        Device& d = devices[device];
+        d.pending.push_back(&jobs.back());
+        d.s.signal();
+    }
+
+    auto lane = [this, perDevice, &scanCs, &jobs](Device& d) {
+        for(;;) {
+            d.s.wait();
+
+            ScanJob* job;
+            {
+                FastLock l(scanCs);
+                if(d.pending.empty())
+                    return;
+                job = d.pending.front();
+                d.pending.pop_front();
+                d.running++;
+            }
+
+            vector<ScanJob> subdirs;
+            if(!job->parent && perDevice > 1) {
+                job->result = buildTree(job->path, Directory::Ptr(), job->old, false, &subdirs);
+            } else {
+                job->result = buildTree(job->path, job->parent, job->old);
+            }
+
+            FastLock l(scanCs);
+            for(auto i = subdirs.begin(); i != subdirs.end(); ++i) {
+                jobs.push_back(*i);
+                d.pending.push_back(&jobs.back());
+                d.s.signal();
+            }
+            d.running--;
+            if(d.pending.empty() && d.running == 0) {
+                for(size_t i = 0; i < d.lanes; ++i)
+                    d.s.signal();
+            }
+        }
+    };
+
+    {
+        size_t lanes = 0;
+        for(auto i = order.begin(); i != order.end(); ++i) {
+            (*i)->lanes = min(perDevice, threads);
+            lanes += (*i)->lanes;
+        }
+
+        // One lane of every device comes first: a pool thread stays with its lane until the device is done
+        ThreadPool pool("ShareScanner", min(lanes, threads), Thread::LOW);
+        for(size_t n = 0; n < perDevice; ++n) {
+            for(auto i = order.begin(); i != order.end(); ++i) {
+                if(n < (*i)->lanes) {
+                    Device& d = **i;
+                    pool.add([&lane, &d] { lane(d); });
+                }
+            }
+        }
+    }
+
+    // Put the subdirectories in their parents in the order they were listed
+    for(auto i = jobs.begin(); i != jobs.end(); ++i) {
+        if(i->parent) {
+            i->parent->directories[i->result->getName()] = i->result;
+        }
+    }
+
+    for(size_t i = 0; i < aRoots.size(); ++i) {
+        ret.push_back(jobs[i].result);
+    }
+    return ret;
+}
+
+bool ShareManager::refreshDirectories(const StringList& aDirs) noexcept {
+    if(refreshing)
+        return false;
+
+    bool changed = false;
+    for(auto i = aDirs.begin(); i != aDirs.end(); ++i) {
+        try {
+            changed |= refreshDirectory(*i);
+        } catch(const Exception& e) {
+            dcdebug("Refreshing %s failed: %s\n", i->c_str(), e.getError().c_str());
+        }
+    }
+
+    if(changed) {
+        ClientManager::getInstance()->infoUpdated();
+    }
+    return true;
+}
+
+bool ShareManager::refreshDirectory(const string& aRealPath) {
+    Directory::Ptr old;
+    {
+        Lock l(cs);
+        for(auto i = shares.begin(); i != shares.end(); ++i) {
+            if(Util::strnicmp(aRealPath, i->first, i->first.length()) == 0) {
+                // what's below a virtual directory made of several real ones is left to a full refresh
+                const string& vName = i->second;
+                if(count_if(shares.begin(), shares.end(), [&](const StringMap::value_type& s) { return Util::stricmp(s.second, vName) == 0; }) == 1) {
+                    old = getDirectory(aRealPath);
+                }
+                break;
+            }
+        }
+    }
+    if(!old)
+        return false;
+
+    {
+        Lock l(cs);
+        building++;
+    }
+
+    Directory::Ptr parent(old->getParent());
+    Directory::Ptr dir = buildTree(aRealPath, parent, old, true);
+
+    Lock l(cs);
+    if(getDirectory(aRealPath) != old) {
+        finishBuild();
+        return false;
+    }
+
+    vector<TTHValue> orphans;
+    removeIndices(*old, orphans);
+    if(parent) {
+        parent->directories[old->getName()] = dir;
+    } else {
+        dir->setName(old->getName());
+        replace(directories.begin(), directories.end(), old, dir);
+    }
+    retired.push_back(old);
+    updateIndices(*dir);
+
+    // Now and then, let go of what was patched out; and a copy of a file that was patched out
+    // is only found by going through the whole tree
+    if(retired.size() > 1000 || any_of(orphans.begin(), orphans.end(),
+        [this](const TTHValue& tth) { return tthIndex.find(tth) == tthIndex.end(); }))
+    {
+        rebuildIndices();
+    }
+
+    finishBuild();
+    setDirty();
+    UploadManager::getInstance()->clearFileCache();
+    return true;
+}
+
+void ShareManager::finishBuild() {
+    if(--building == 0) {
+        for(auto i = hashedWhileBuilding.begin(); i != hashedWhileBuilding.end(); ++i) {
+            addHashed(i->first, i->second);
+        }
+        hashedWhileBuilding.clear();
+    }
+}
+
+void ShareManager::updateWatcher() noexcept {
+    if(!BOOLSETTING(SHARE_WATCH) || !ShareWatcher::isAvailable()) {
+        watcher.reset();
+        return;
+    }
+
+    StringList dirs;
+    {
+        Lock l(cs);
+        for(auto i = shares.begin(); i != shares.end(); ++i) {
+            auto j = getByVirtual(i->second);
+            if(j == directories.end())
+                continue;
+
+            // the real path of every directory below, with the root of the share in front
+            vector<pair<string, const Directory*>> todo(1, make_pair(i->first, j->get()));
+            while(!todo.empty()) {
+                auto d = todo.back();
+                todo.pop_back();
+                dirs.push_back(d.first);
+                for(auto k = d.second->directories.begin(); k != d.second->directories.end(); ++k) {
+                    todo.push_back(make_pair(d.first + k->first + PATH_SEPARATOR, k->second.get()));
+                }
+            }
+        }
+    }
+
+    try {
+        if(!watcher) {
+            watcher.reset(new ShareWatcher([this](const StringList& aDirs) { return refreshDirectories(aDirs); }));
+            watcher->start();
+        }
+        watcher->setDirectories(dirs);
+    } catch(const Exception& e) {
+        LogManager::getInstance()->message(str(F_("Shared directories can't be watched for changes: %1%") % e.getError()));
+        watcher.reset();
+    }
+}
+
 void ShareManager::getBloom(ByteVector& v, size_t k, size_t m, size_t h) const {
     dcdebug("Creating bloom filter, k=%u, m=%u, h=%u\n",
             static_cast<unsigned int>(k), static_cast<unsigned int>(m), static_cast<unsigned int>(h));
@@ -887,41 +1430,132 @@ void ShareManager::getBloom(ByteVector& v, size_t k, size_t m, size_t h) const {
     bloom.copy_to(v);
 }
 
+/**
+ * Cut the text of a file list into pieces of one bzip2 block each. Where to cut depends only on
+ * the lines just before, so the parts of the list that didn't change are cut the same way again.
+ */
+static vector<pair<size_t, size_t>> cutList(const string& xml) {
+    // Cut after lines whose hash is a multiple of this, once a piece has at least the minimum
+    const uint32_t CUT_LINES = 2048;
+    const size_t MIN_PIECE = 64 * 1024;
+    const size_t MAX_PIECE = BZBlockWriter::MAX_BLOCK_INPUT;
+
+    vector<pair<size_t, size_t>> pieces;
+    size_t start = 0;
+    for(size_t pos = 0; pos < xml.size(); ) {
+        size_t end = xml.find('\n', pos);
+        end = end == string::npos ? xml.size() : end + 1;
+
+        if(end - start > MAX_PIECE) {
+            if(pos > start) {
+                pieces.push_back(make_pair(start, pos - start));
+                start = pos;
+            }
+            // one line that long can only be cut anywhere
+            while(end - start > MAX_PIECE) {
+                pieces.push_back(make_pair(start, MAX_PIECE));
+                start += MAX_PIECE;
+            }
+        }
+
+        uint32_t hash = 2166136261U;
+        for(; pos < end; ++pos) {
+            hash = (hash ^ static_cast<uint8_t>(xml[pos])) * 16777619U;
+        }
+        if(hash % CUT_LINES == 0 && pos - start >= MIN_PIECE) {
+            pieces.push_back(make_pair(start, pos - start));
+            start = pos;
+        }
+    }
+    if(start < xml.size() || pieces.empty()) {
+        pieces.push_back(make_pair(start, xml.size() - start));
+    }
+    return pieces;
+}
+
 void ShareManager::generateXmlList() {
-    Lock l(cs);
-    if(forceXmlRefresh || (xmlDirty && (lastXmlUpdate + 15 * 60 * 1000 < GET_TICK() || lastXmlUpdate < lastFullUpdate))) {
-        listN++;
+    // Whoever waited here for another list to be generated finds it up to date
+    Lock gl(listCs);
 
-        try {
-            string tmp2;
-            string indent;
+    // Only the text of the list is made with the share locked; compressing it takes far longer
+    string xml = SimpleXML::utf8Header;
+    string times;
+    int n;
+    {
+        Lock l(cs);
+        if(!(forceXmlRefresh || (xmlDirty && (lastXmlUpdate + 15 * 60 * 1000 < GET_TICK() || lastXmlUpdate < lastFullUpdate))))
+            return;
 
-            string newXmlName = Util::getPath(Util::PATH_USER_CONFIG) + "files" + Util::toString(listN) + ".xml.bz2";
-            {
-                File f(newXmlName, File::WRITE, File::TRUNCATE | File::CREATE);
-                // We don't care about the leaves...
-                CalcOutputStream<TTFilter<1024*1024*1024>, false> bzTree(&f);
-                FilteredOutputStream<BZFilter, false> bzipper(&bzTree);
-                CountOutputStream<false> count(&bzipper);
-                CalcOutputStream<TTFilter<1024*1024*1024>, false> newXmlFile(&count);
-
-                newXmlFile.write(SimpleXML::utf8Header);
-                newXmlFile.write("<FileListing Version=\"1\" CID=\"" + ClientManager::getInstance()->getMe()->getCID().toBase32() + "\" Base=\"/\" Generator=\"" EISKALTDCPP_APPNAME " " EISKALTDCPP_VERSION "\">\r\n");
-                for(auto i = directories.begin(); i != directories.end(); ++i) {
-                    (*i)->toXml(newXmlFile, indent, tmp2, true);
-                }
-                newXmlFile.write("</FileListing>");
-                newXmlFile.flush();
+        n = ++listN;
+
+        string tmp2;
+        string indent;
+        StringOutputStream newXmlFile(xml);
+        newXmlFile.write("<FileListing Version=\"1\" CID=\"" + ClientManager::getInstance()->getMe()->getCID().toBase32() + "\" Base=\"/\" Generator=\"" EISKALTDCPP_APPNAME " " EISKALTDCPP_VERSION "\">\r\n");
+        for(auto i = directories.begin(); i != directories.end(); ++i) {
+            (*i)->toXml(newXmlFile, indent, tmp2, true);
+            (*i)->timesToList(times);
+        }
+        newXmlFile.write("</FileListing>");
+
+        xmlDirty = false;
+        forceXmlRefresh = false;
+        lastXmlUpdate = GET_TICK();
+    }
 
-                xmlListLen = count.getCount();
+    try {
+        // Compress pieces of one bzip2 block each side by side, reusing the blocks of the pieces
+        // that are the same as in the last list
+        const auto pieces = cutList(xml);
+        vector<string> blocks(pieces.size());
+        vector<TTHValue> keys(pieces.size());
+
+        // We don't care about the leaves...
+        TTFilter<1024*1024*1024> xmlTree;
+        {
+            ThreadPool pool("FileList", max(1u, min(static_cast<unsigned>(pieces.size()), std::thread::hardware_concurrency())), Thread::LOW);
+            for(size_t i = 0; i < pieces.size(); ++i) {
+                pool.add([this, &xml, &pieces, &blocks, &keys, i] {
+                    const char* text = xml.data() + pieces[i].first;
+                    TigerHash h;
+                    h.update(text, pieces[i].second);
+                    keys[i] = TTHValue(h.finalize());
+
+                    auto cached = listBlocks.find(keys[i]);
+                    if(cached != listBlocks.end()) {
+                        blocks[i] = cached->second;
+                        return;
+                    }
+                    try {
+                        blocks[i] = BZBlockWriter::compress(text, pieces[i].second);
+                    } catch(const Exception&) {
+                        // left empty, which the writer rejects
+                    }
+                });
+            }
 
-                newXmlFile.getFilter().getTree().finalize();
-                bzTree.getFilter().getTree().finalize();
+            xmlTree(xml.data(), xml.size());
+            xmlTree.getTree().finalize();
+        }
 
-                xmlRoot = newXmlFile.getFilter().getTree().getRoot();
-                bzXmlRoot = bzTree.getFilter().getTree().getRoot();
+        string newXmlName = Util::getPath(Util::PATH_USER_CONFIG) + "files" + Util::toString(n) + ".xml.bz2";
+        TTHValue newBzXmlRoot;
+        {
+            File f(newXmlName, File::WRITE, File::TRUNCATE | File::CREATE);
+            CalcOutputStream<TTFilter<1024*1024*1024>, false> bzTree(&f);
+            BZBlockWriter bz(&bzTree);
+            for(auto i = blocks.begin(); i != blocks.end(); ++i) {
+                bz.append(*i);
             }
-            const string XmlListFileName = Util::getPath(Util::PATH_USER_CONFIG) + "files.xml.bz2";
+            bz.finish();
+
+            bzTree.getFilter().getTree().finalize();
+            newBzXmlRoot = bzTree.getFilter().getTree().getRoot();
+        }
+
+        const string XmlListFileName = Util::getPath(Util::PATH_USER_CONFIG) + "files.xml.bz2";
+        {
+            Lock l(cs);
             if(bzXmlRef.get()) {
                 bzXmlRef.reset();
                 try {
@@ -935,20 +1569,40 @@ void ShareManager::generateXmlList() {
             } catch(const FileException&) {
                 // Ignore, this is for caching only...
             }
-            try {
-                File::copyFile(XmlListFileName, XmlListFileName + ".bak");
-            } catch(const FileException&) { }
             bzXmlRef = unique_ptr<File>(new File(newXmlName, File::READ, File::OPEN));
             setBZXmlFile(newXmlName);
             bzXmlListLen = File::getSize(newXmlName);
-            LogManager::getInstance()->message(str(F_("File list %1% generated") % Util::addBrackets(bzXmlFile)));
-        } catch(const Exception&) {
-            // No new file lists...
+            xmlListLen = xml.size();
+            xmlRoot = xmlTree.getTree().getRoot();
+            bzXmlRoot = newBzXmlRoot;
         }
 
-        xmlDirty = false;
-        forceXmlRefresh = false;
-        lastXmlUpdate = GET_TICK();
+        listBlocks.clear();
+        for(size_t i = 0; i < blocks.size(); ++i) {
+            listBlocks[keys[i]].swap(blocks[i]);
+        }
+
+        if(newXmlName == XmlListFileName) {
+            try {
+                File::copyFile(XmlListFileName, XmlListFileName + ".bak");
+            } catch(const FileException&) { }
+
+            // What an incremental refresh will compare the directories to when the list is loaded next time
+            try {
+                string header;
+                put(header, TIMES_MAGIC);
+                put(header, TIMES_VERSION);
+                put(header, newBzXmlRoot);
+                put(header, static_cast<uint32_t>(times.size() / sizeof(uint32_t)));
+
+                File f(getTimesFile(), File::WRITE, File::TRUNCATE | File::CREATE);
+                f.write(header);
+                f.write(times);
+            } catch(const FileException&) { }
+        }
+        LogManager::getInstance()->message(str(F_("File list %1% generated") % Util::addBrackets(newXmlName)));
+    } catch(const Exception&) {
+        // No new file lists...
     }
 }
 
@@ -1039,6 +1693,13 @@ void ShareManager::Directory::toXml(OutputStream& xmlFile, string& indent, strin
     }
 }
 
+void ShareManager::Directory::timesToList(string& aTimes) const {
+    put(aTimes, lastWrite);
+    for(auto i = directories.begin(); i != directories.end(); ++i) {
+        i->second->timesToList(aTimes);
+    }
+}
+
 void ShareManager::Directory::filesToXml(OutputStream& xmlFile, string& indent, string& tmp2) const {
     for(auto i = files.begin(); i != files.end(); ++i) {
         const Directory::File& f = *i;
@@ -1184,30 +1845,16 @@ SearchManager::TypeModes ShareManager::getType(const string& aFileName) const no
  * has been matched in the directory name. This new stringlist should also be used in all descendants,
  * but not the parents...
  */
-void ShareManager::Directory::search(SearchResultList& aResults, StringSearch::List& aStrings, int aSearchType, int64_t aSize, int aFileType, Client* aClient, StringList::size_type maxResults) const noexcept {
+void ShareManager::Directory::search(SearchResultList& aResults, const MultiStringSearch& aStrings, MultiStringSearch::Mask aNeed, int aSearchType, int64_t aSize, int aFileType, Client* aClient, StringList::size_type maxResults, const NameIndex::Candidates& aCandidates) const noexcept {
     // Skip everything if there's nothing to find here (doh! =)
-    if(!hasType(aFileType))
+    if(!hasType(aFileType) || !isCandidate(aNeed, aCandidates))
         return;
 
-    StringSearch::List* cur = &aStrings;
-    unique_ptr<StringSearch::List> newStr;
-
     // Find any matches in the directory name
-    for(auto k = aStrings.begin(); k != aStrings.end(); ++k) {
-        if(k->match(name)) {
-            if(!newStr.get()) {
-                newStr = unique_ptr<StringSearch::List>(new StringSearch::List(aStrings));
-            }
-            newStr->erase(remove(newStr->begin(), newStr->end(), *k), newStr->end());
-        }
-    }
-
-    if(newStr.get() != 0) {
-        cur = newStr.get();
-    }
+    const MultiStringSearch::Mask need = aNeed & ~aStrings.match(getLowerName(), aNeed);
 
     bool sizeOk = (aSearchType != SearchManager::SIZE_ATLEAST) || (aSize == 0);
-    if( (cur->empty()) &&
+    if( (need == 0) &&
         (((aFileType == SearchManager::TYPE_ANY) && sizeOk) || (aFileType == SearchManager::TYPE_DIRECTORY)) ) {
         // We satisfied all the search words! Add the directory...(NMDC searches don't support directory size)
         SearchResultPtr sr(new SearchResult(SearchResult::TYPE_DIRECTORY, 0, getFullName(), TTHValue()));
@@ -1223,11 +1870,7 @@ void ShareManager::Directory::search(SearchResultList& aResults, StringSearch::L
             } else if(aSearchType == SearchManager::SIZE_ATMOST && aSize < i->getSize()) {
                 continue;
             }
-            auto j = cur->begin();
-            for(; j != cur->end() && j->match(i->getName()); ++j)
-                ;   // Empty
-
-            if(j != cur->end())
+            if((aStrings.match(i->getLowerName(), need) & need) != need)
                 continue;
 
             // Check file type...
@@ -1243,7 +1886,7 @@ void ShareManager::Directory::search(SearchResultList& aResults, StringSearch::L
     }
 
     for(auto l = directories.begin(); (l != directories.end()) && (aResults.size() < maxResults); ++l) {
-        l->second->search(aResults, *cur, aSearchType, aSize, aFileType, aClient, maxResults);
+        l->second->search(aResults, aStrings, need, aSearchType, aSize, aFileType, aClient, maxResults, aCandidates);
     }
 }
 
@@ -1268,17 +1911,23 @@ void ShareManager::search(SearchResultList& results, const string& aString, int
     if(!bloom.match(sl))
         return;
 
-    StringSearch::List ssl;
+    MultiStringSearch ssl;
     for(auto i = sl.begin(); i != sl.end(); ++i) {
-        if(!i->empty()) {
-            ssl.push_back(StringSearch(*i));
+        if(!i->empty() && !ssl.add(*i)) {
+            return;
         }
     }
     if(ssl.empty())
         return;
+    ssl.prepare();
+
+    NameIndex::Candidates candidates;
+    for(size_t i = 0; i < ssl.size(); ++i) {
+        nameIndex.find(ssl.getPattern(i), i, candidates);
+    }
 
     for(auto j = directories.begin(); (j != directories.end()) && (results.size() < maxResults); ++j) {
-        (*j)->search(results, ssl, aSearchType, aSize, aFileType, aClient, maxResults);
+        (*j)->search(results, ssl, ssl.getAll(), aSearchType, aSize, aFileType, aClient, maxResults, candidates);
     }
 }
 
@@ -1286,7 +1935,7 @@ namespace {
     inline uint16_t toCode(char a, char b) { return (uint16_t)a | ((uint16_t)b)<<8; }
 }
 
-ShareManager::AdcSearch::AdcSearch(const StringList& params) : include(&includeX), gt(0),
+ShareManager::AdcSearch::AdcSearch(const StringList& params) : include(0), exclude(0), overflow(false), gt(0),
     lt(numeric_limits<int64_t>::max()), hasRoot(false), isDirectory(false)
 {
     for(auto i = params.begin(); i != params.end(); ++i) {
@@ -1300,9 +1949,9 @@ ShareManager::AdcSearch::AdcSearch(const StringList& params) : include(&includeX
             root = TTHValue(p.substr(2));
             return;
         } else if(toCode('A', 'N') == cmd) {
-            includeX.push_back(StringSearch(p.substr(2)));
+            addTerm(p.substr(2), include);
         } else if(toCode('N', 'O') == cmd) {
-            exclude.push_back(StringSearch(p.substr(2)));
+            addTerm(p.substr(2), exclude);
         } else if(toCode('E', 'X') == cmd) {
             ext.push_back(p.substr(2));
         } else if(toCode('G', 'R') == cmd) {
@@ -1320,14 +1969,15 @@ ShareManager::AdcSearch::AdcSearch(const StringList& params) : include(&includeX
             isDirectory = (p[2] == '2');
         }
     }
+    terms.prepare();
 }
 
-bool ShareManager::AdcSearch::isExcluded(const string& str) {
-    for(auto i = exclude.begin(); i != exclude.end(); ++i) {
-        if(i->match(str))
-            return true;
+void ShareManager::AdcSearch::addTerm(const string& aTerm, MultiStringSearch::Mask& aMask) {
+    if(terms.add(aTerm)) {
+        aMask |= MultiStringSearch::Mask(1) << (terms.size() - 1);
+    } else {
+        overflow = true;
     }
-    return false;
 }
 
 bool ShareManager::AdcSearch::hasExt(const string& name) {
@@ -1344,28 +1994,18 @@ bool ShareManager::AdcSearch::hasExt(const string& name) {
     return false;
 }
 
-void ShareManager::Directory::search(SearchResultList& aResults, AdcSearch& aStrings, StringList::size_type maxResults) const noexcept {
-    StringSearch::List* cur = aStrings.include;
-    StringSearch::List* old = aStrings.include;
-
-    unique_ptr<StringSearch::List> newStr;
+void ShareManager::Directory::search(SearchResultList& aResults, AdcSearch& aStrings, StringList::size_type maxResults, const NameIndex::Candidates& aCandidates) const noexcept {
+    if(!isCandidate(aStrings.include, aCandidates))
+        return;
 
     // Find any matches in the directory name
-    for(auto k = cur->begin(); k != cur->end(); ++k) {
-        if(k->match(name) && !aStrings.isExcluded(name)) {
-            if(!newStr.get()) {
-                newStr = unique_ptr<StringSearch::List>(new StringSearch::List(*cur));
-            }
-            newStr->erase(remove(newStr->begin(), newStr->end(), *k), newStr->end());
-        }
-    }
-
-    if(newStr.get() != 0) {
-        cur = newStr.get();
-    }
+    MultiStringSearch::Mask need = aStrings.include;
+    const MultiStringSearch::Mask found = aStrings.terms.match(getLowerName(), need | aStrings.exclude);
+    if(!aStrings.isExcluded(found))
+        need &= ~found;
 
     bool sizeOk = (aStrings.gt == 0);
-    if( cur->empty() && aStrings.ext.empty() && sizeOk ) {
+    if( need == 0 && aStrings.ext.empty() && sizeOk ) {
         // We satisfied all the search words! Add the directory...
         SearchResultPtr sr(new SearchResult(SearchResult::TYPE_DIRECTORY, getSize(), getFullName(), TTHValue()));
         aResults.push_back(sr);
@@ -1381,14 +2021,8 @@ void ShareManager::Directory::search(SearchResultList& aResults, AdcSearch& aStr
                 continue;
             }
 
-            if(aStrings.isExcluded(i->getName()))
-                continue;
-
-            auto j = cur->begin();
-            for(; j != cur->end() && j->match(i->getName()); ++j)
-                ;   // Empty
-
-            if(j != cur->end())
+            const MultiStringSearch::Mask fileFound = aStrings.terms.match(i->getLowerName(), need | aStrings.exclude);
+            if(aStrings.isExcluded(fileFound) || (fileFound & need) != need)
                 continue;
 
             // Check file type...
@@ -1406,9 +2040,8 @@ void ShareManager::Directory::search(SearchResultList& aResults, AdcSearch& aStr
     }
 
     for(auto l = directories.begin(); (l != directories.end()) && (aResults.size() < maxResults); ++l) {
-        l->second->search(aResults, aStrings, maxResults);
+        l->second->search(aResults, aStrings, maxResults, aCandidates);
     }
-    aStrings.include = old;
 }
 
 void ShareManager::search(SearchResultList& results, const StringList& params, StringList::size_type maxResults) noexcept {
@@ -1428,13 +2061,20 @@ void ShareManager::search(SearchResultList& results, const StringList& params, S
         return;
     }
 
-    for(auto i = srch.includeX.begin(); i != srch.includeX.end(); ++i) {
-        if(!bloom.match(i->getPattern()))
+    if(srch.overflow)
+        return;
+
+    NameIndex::Candidates candidates;
+    for(size_t i = 0; i < srch.terms.size(); ++i) {
+        if(!(srch.include & (MultiStringSearch::Mask(1) << i)))
+            continue;
+        if(!bloom.match(srch.terms.getPattern(i)))
             return;
+        nameIndex.find(srch.terms.getPattern(i), i, candidates);
     }
 
     for(auto j = directories.begin(); (j != directories.end()) && (results.size() < maxResults); ++j) {
-        (*j)->search(results, srch, maxResults);
+        (*j)->search(results, srch, maxResults, candidates);
     }
 }
 
@@ -1468,6 +2108,9 @@ ShareManager::Directory::Ptr ShareManager::getDirectory(const string& fname) {
 }
 
 void ShareManager::on(QueueManagerListener::FileMoved, const string& n) noexcept {
+    // a download may have replaced a shared file that's open for uploads
+    UploadManager::getInstance()->clearFileCache(n);
+
     if(BOOLSETTING(ADD_FINISHED_INSTANTLY)) {
         // Check if finished download is supposed to be shared
         Lock l(cs);
@@ -1487,16 +2130,26 @@ void ShareManager::on(QueueManagerListener::FileMoved, const string& n) noexcept
 
 void ShareManager::on(HashManagerListener::TTHDone, const string& fname, const TTHValue& root) noexcept {
     Lock l(cs);
+    if(building > 0) {
+        hashedWhileBuilding.push_back(make_pair(fname, root));
+    }
+    addHashed(fname, root);
+}
+
+void ShareManager::addHashed(const string& fname, const TTHValue& root) {
     Directory::Ptr d = getDirectory(fname);
     if(d) {
         auto i = d->findFile(Util::getFileName(fname));
         if(i != d->files.end()) {
-            if(root != i->getTTH())
-                tthIndex.erase(i->getTTH());
+            if(root != i->getTTH()) {
+                auto j = tthIndex.find(i->getTTH());
+                if(j != tthIndex.end())
+                    removeIndex(j);
+            }
             // Get rid of false constness...
             auto f = const_cast<Directory::File*>(&(*i));
             f->setTTH(root);
-            tthIndex.insert(make_pair(f->getTTH(), i));
+            addIndex(i, getType(f->getName()));
         } else {
             string name = Util::getFileName(fname);
             int64_t size = File::getSize(fname);
@@ -1511,7 +2164,7 @@ void ShareManager::on(HashManagerListener::TTHDone, const string& fname, const T
 void ShareManager::on(TimerManagerListener::Minute, uint64_t tick) noexcept {
     if (SETTING(AUTO_REFRESH_TIME) > 0) {
         if (lastFullUpdate + SETTING(AUTO_REFRESH_TIME) * 60 * 1000 < tick) {
-            refresh(true, true);
+            refresh(true, true, false, BOOLSETTING(SHARE_INCREMENTAL_REFRESH));
         }
     }
 }
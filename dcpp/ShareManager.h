@@ -25,7 +25,7 @@
 #include "QueueManagerListener.h"
 #include "Exception.h"
 #include "CriticalSection.h"
-#include "StringSearch.h"
+#include "MultiStringSearch.h"
 #include "Singleton.h"
 #include "BloomFilter.h"
 #include "FastAlloc.h"
@@ -33,6 +33,8 @@
 #include "Pointer.h"
 #include "Atomic.h"
 
+#include <atomic>
+
 #ifdef WITH_DHT
 namespace dht {
     class IndexManager;
@@ -48,6 +50,7 @@ class Client;
 class File;
 class OutputStream;
 class MemoryInputStream;
+class ShareWatcher;
 
 struct ShareLoader;
 class ShareManager : public Singleton<ShareManager>, private SettingsManagerListener, private Thread, private TimerManagerListener,
@@ -69,7 +72,8 @@ public:
     StringList getRealPaths(const string& virtualPath);
     TTHValue getTTH(const string& virtualFile) const;
 
-    void refresh(bool dirs = false, bool aUpdate = true, bool block = false) noexcept;
+    /** @param incremental Skip the directories that haven't changed since they were listed */
+    void refresh(bool dirs = false, bool aUpdate = true, bool block = false, bool incremental = false) noexcept;
     void setDirty() { xmlDirty = true; }
 
     void search(SearchResultList& l, const string& aString, int aSearchType, int64_t aSize, int aFileType, Client* aClient, StringList::size_type maxResults) noexcept;
@@ -82,10 +86,14 @@ public:
 
     AdcCommand getFileInfo(const string& aFile);
 
-    int64_t getShareSize() const noexcept;
-    int64_t getShareSize(const string& realPath) const noexcept;
+    /** The totals are kept along with the index; these don't lock */
+    int64_t getShareSize() const noexcept { return shareSize; }
+    size_t getSharedFiles() const noexcept { return sharedFiles; }
+    /** @return Number of files of a SearchManager::TYPE_*, where TYPE_ANY counts those of no other type */
+    size_t getSharedFiles(SearchManager::TypeModes aType) const noexcept { return typeFiles[aType]; }
 
-    size_t getSharedFiles() const noexcept;
+    /** @return Size of the root directory shared from realPath, -1 if there is none */
+    int64_t getShareSize(const string& realPath) const noexcept;
 
     string getShareSizeString() const { return Util::toString(getShareSize()); }
     string getShareSizeString(const string& aDir) const { return Util::toString(getShareSize(aDir)); }
@@ -103,6 +111,7 @@ public:
 
     string getOwnListFile() {
         generateXmlList();
+        Lock l(cs);
         return getBZXmlFile();
     }
 
@@ -115,6 +124,51 @@ public:
     GETSET(string, bzXmlFile, BZXmlFile);
 private:
     struct AdcSearch;
+    class Directory;
+
+    /**
+     * Maps the lower case words of file and directory names to the directories holding them,
+     * so that a search only walks the parts of the share where each of its terms can be found.
+     */
+    class NameIndex {
+    public:
+        typedef unordered_set<const Directory*> DirSet;
+        struct Candidates {
+            Candidates() : narrowed(0) { }
+            /** Search terms that narrow the search down; the others match anywhere */
+            MultiStringSearch::Mask narrowed;
+            /** Search term -> directories whose subtree may match it */
+            vector<DirSet> dirs;
+        };
+
+        NameIndex() : lastDir(0), dirCount(0) { }
+
+        void add(const string& aLowerName, const Directory* aDir);
+        void clear();
+
+        /**
+         * Add the directories that may contain aPattern (search term aTerm) in their own name,
+         * a file name or a name further down to aCandidates; nothing is added when the pattern
+         * can't narrow the search down.
+         */
+        void find(const string& aPattern, size_t aTerm, Candidates& aCandidates) const;
+
+    private:
+        struct Word {
+            Word(const string& aText) : text(aText) { }
+            string text;
+            vector<const Directory*> dirs;
+        };
+
+        unordered_map<string, uint32_t> wordIds;
+        vector<Word> words;
+        /** Three byte sequences of the words -> ids of the words holding them */
+        unordered_map<uint32_t, vector<uint32_t>> trigrams;
+
+        const Directory* lastDir;
+        size_t dirCount;
+    };
+
     class Directory : public FastAlloc<Directory>, public intrusive_ptr_base<Directory>, boost::noncopyable {
     public:
         typedef boost::intrusive_ptr<Directory> Ptr;
@@ -147,14 +201,14 @@ private:
 
             File() : size(0), parent(0) { }
             File(const string& aName, int64_t aSize, const Directory::Ptr& aParent, const TTHValue& aRoot) :
-            name(aName), tth(aRoot), size(aSize), parent(aParent.get()) { }
+            tth(aRoot), size(aSize), parent(aParent.get()) { setName(aName); }
             File(const File& rhs) :
-            name(rhs.getName()), tth(rhs.getTTH()), size(rhs.getSize()), parent(rhs.getParent()) { }
+            name(rhs.name), lowerName(rhs.lowerName), tth(rhs.getTTH()), size(rhs.getSize()), parent(rhs.getParent()) { }
 
             ~File() { }
 
             File& operator=(const File& rhs) {
-                name = rhs.name; size = rhs.size; parent = rhs.parent; tth = rhs.tth;
+                name = rhs.name; lowerName = rhs.lowerName; size = rhs.size; parent = rhs.parent; tth = rhs.tth;
                 return *this;
             }
 
@@ -169,7 +223,17 @@ private:
             string getFullName() const { return parent->getFullName() + name; }
             string getRealPath() const { return parent->getRealPath(name); }
 
-            GETSET(string, name, Name);
+            const string& getName() const { return name; }
+            void setName(const string& aName) { name = aName; lowerName = foldName(aName); }
+            /** The name in lower case, which is what search terms are matched against */
+            const string& getLowerName() const { return lowerName.empty() ? name : lowerName; }
+
+        private:
+            string name;
+            /** Only set when it differs from name, which most names don't */
+            string lowerName;
+
+        public:
             GETSET(TTHValue, tth, TTH);
             GETSET(int64_t, size, Size);
             GETSET(Directory*, parent, Parent);
@@ -178,8 +242,15 @@ private:
         int64_t size;
         Map directories;
         File::Set files;
+        /**
+         * Modification time of the real directory when it was listed, which an incremental refresh
+         * compares to tell whether it needs to be listed again; 0 to always list it.
+         */
+        uint32_t lastWrite;
 
         static Ptr create(const string& aName, const Ptr& aParent = Ptr()) { return Ptr(new Directory(aName, aParent)); }
+        /** @return aName in lower case, or an empty string when it's in lower case already */
+        static string foldName(const string& aName);
 
         bool hasType(uint32_t type) const noexcept {
             return ( (type == SearchManager::TYPE_ANY) || (fileTypes & (1 << type)) );
@@ -192,17 +263,24 @@ private:
 
         int64_t getSize() const noexcept;
 
-        void search(SearchResultList& aResults, StringSearch::List& aStrings, int aSearchType, int64_t aSize, int aFileType, Client* aClient, StringList::size_type maxResults) const noexcept;
-        void search(SearchResultList& aResults, AdcSearch& aStrings, StringList::size_type maxResults) const noexcept;
+        void search(SearchResultList& aResults, const MultiStringSearch& aStrings, MultiStringSearch::Mask aNeed, int aSearchType, int64_t aSize, int aFileType, Client* aClient, StringList::size_type maxResults, const NameIndex::Candidates& aCandidates) const noexcept;
+        void search(SearchResultList& aResults, AdcSearch& aStrings, StringList::size_type maxResults, const NameIndex::Candidates& aCandidates) const noexcept;
+        bool isCandidate(MultiStringSearch::Mask aNeed, const NameIndex::Candidates& aCandidates) const noexcept;
 
         void toXml(OutputStream& xmlFile, string& indent, string& tmp2, bool fullList) const;
         void filesToXml(OutputStream& xmlFile, string& indent, string& tmp2) const;
+        /** Append lastWrite of this directory and those below in the order toXml() lists them */
+        void timesToList(string& aTimes) const;
 
         File::Set::const_iterator findFile(const string& aFile) const { return find_if(files.begin(), files.end(), Directory::File::StringComp(aFile)); }
 
         void merge(const Ptr& source);
 
-        GETSET(string, name, Name);
+        const string& getName() const { return name; }
+        void setName(const string& aName) { name = aName; lowerName = foldName(aName); }
+        /** The name in lower case, which is what search terms are matched against */
+        const string& getLowerName() const { return lowerName.empty() ? name : lowerName; }
+
         GETSET(Directory*, parent, Parent);
     private:
         friend void intrusive_ptr_release(intrusive_ptr_base<Directory>*);
@@ -210,6 +288,10 @@ private:
         Directory(const string& aName, const Ptr& aParent);
         ~Directory() { }
 
+        string name;
+        /** Only set when it differs from name */
+        string lowerName;
+
         /** Set of flags that say which SearchManager::TYPE_* a directory contains */
         uint32_t fileTypes;
 
@@ -226,11 +308,15 @@ private:
     struct AdcSearch {
         AdcSearch(const StringList& params);
 
-        bool isExcluded(const string& str);
+        void addTerm(const string& aTerm, MultiStringSearch::Mask& aMask);
+        bool isExcluded(MultiStringSearch::Mask aFound) const { return (aFound & exclude) != 0; }
         bool hasExt(const string& name);
-        StringSearch::List* include;
-        StringSearch::List includeX;
-        StringSearch::List exclude;
+        /** Both the AN and the NO terms, told apart by the include and exclude masks */
+        MultiStringSearch terms;
+        MultiStringSearch::Mask include;
+        MultiStringSearch::Mask exclude;
+        /** More terms than fit in a mask; nothing can be found then */
+        bool overflow;
         StringList ext;
         StringList noExt;
 
@@ -263,6 +349,10 @@ private:
     uint64_t lastFullUpdate;
 
     mutable CriticalSection cs;
+    /** Serializes the generation of file lists, which runs without cs held for the most part */
+    CriticalSection listCs;
+    /** bzip2 blocks of the last file list by the hash of their text, so unchanged parts aren't compressed again */
+    unordered_map<TTHValue, string> listBlocks;
 
     // List of root directory items
     typedef std::list<Directory::Ptr> DirList;
@@ -279,18 +369,72 @@ private:
     typedef HashFileMap::iterator HashFileIter;
 
     HashFileMap tthIndex;
+    /** Roots of files shared more than once (LIST_DUPES); only one of the copies is in tthIndex */
+    unordered_set<TTHValue> dupes;
+    std::atomic<int64_t> shareSize;
+    std::atomic<size_t> sharedFiles;
+    std::atomic<size_t> typeFiles[SearchManager::TYPE_LAST];
 
     BloomFilter<5> bloom;
+    NameIndex nameIndex;
+    /** Directories patched out of the tree that nameIndex may still point to, until it's rebuilt */
+    vector<Directory::Ptr> retired;
+
+    /** Number of new trees being built, which miss the files hashed meanwhile until they're added again */
+    int building;
+    vector<pair<string, TTHValue>> hashedWhileBuilding;
+
+    bool incremental;
+    unique_ptr<ShareWatcher> watcher;
 
     Directory::File::Set::const_iterator findFile(const string& virtualFile) const;
 
-    Directory::Ptr buildTree(const string& aName, const Directory::Ptr& aParent);
+    /** A directory whose tree is built apart from its parent's, see buildTrees() */
+    struct ScanJob {
+        ScanJob(const string& aPath, const Directory::Ptr& aParent, const Directory::Ptr& aOld) :
+            path(aPath), parent(aParent), old(aOld) { }
+
+        string path;
+        Directory::Ptr parent;
+        Directory::Ptr old;
+        Directory::Ptr result;
+    };
+
+    /**
+     * @param aOld The directory as it was last listed, whose content is kept when it hasn't changed since
+     * @param aRelist List aName itself even if it looks unchanged; only its subdirectories are compared then
+     * @param aSubdirs Where to leave the subdirectories instead of building them
+     */
+    Directory::Ptr buildTree(const string& aName, const Directory::Ptr& aParent, const Directory::Ptr& aOld = Directory::Ptr(),
+        bool aRelist = false, vector<ScanJob>* aSubdirs = NULL);
+    /**
+     * Build the trees of the real directories in aRoots (with their old trees) side by side, at most
+     * SHARE_SCAN_DEVICE_THREADS of them on each device at a time; when that's more than one, the
+     * subdirectories of a root are built apart so that a single root can use them.
+     * @return The trees in the order of aRoots
+     */
+    DirList buildTrees(const vector<pair<string, Directory::Ptr> >& aRoots);
     bool checkHidden(const string& aName) const;
 
     void rebuildIndices();
 
     void updateIndices(Directory& aDirectory);
     void updateIndices(Directory& dir, const Directory::File::Set::iterator& i);
+    /** @param aOrphans Receives the roots that were indexed here and have copies elsewhere */
+    void removeIndices(const Directory& aDirectory, vector<TTHValue>& aOrphans);
+    /** Add a file to tthIndex, or remove it, keeping the totals up to date; false if its TTH is indexed already */
+    bool addIndex(const Directory::File::Set::const_iterator& i, int aType);
+    void removeIndex(const HashFileIter& j);
+
+    /** Patch the directories the watcher saw change into the tree; false while a refresh is running */
+    bool refreshDirectories(const StringList& aDirs) noexcept;
+    bool refreshDirectory(const string& aRealPath);
+    /** With cs held, once a tree that was being built is in place */
+    void finishBuild();
+    /** Put a hashed file into the tree; with cs held */
+    void addHashed(const string& fname, const TTHValue& root);
+    /** Start, stop or update the watcher to the directories of the tree */
+    void updateWatcher() noexcept;
 
     Directory::Ptr merge(const Directory::Ptr& directory);
 
@@ -0,0 +1,194 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "stdinc.h"
+
+#include "ShareWatcher.h"
+
+#include "File.h"
+#include "LogManager.h"
+#include "SettingsManager.h"
+#include "Text.h"
+#include "TimerManager.h"
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+namespace dcpp {
+
+#define POLL_TIMEOUT 250
+// Report the changes once nothing happened for this long...
+#define SETTLE_TIME 3000
+// ...but don't hold them back longer than this while they keep coming
+#define MAX_DELAY 30000
+
+bool ShareWatcher::isAvailable() {
+#ifdef __linux__
+    return true;
+#else
+    return false;
+#endif
+}
+
+ShareWatcher::ShareWatcher(const Callback& aCallback) : callback(aCallback), fd(-1), stopping(false), full(false) {
+#ifdef __linux__
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(fd == -1) {
+        throw ThreadException(Util::translateError(errno));
+    }
+#endif
+}
+
+ShareWatcher::~ShareWatcher() {
+    stopping = true;
+    join();
+
+#ifdef __linux__
+    if(fd != -1)
+        ::close(fd);
+#endif
+}
+
+void ShareWatcher::setDirectories(const StringList& aDirs) noexcept {
+#ifdef __linux__
+    Lock l(cs);
+
+    StringSet keep(aDirs.begin(), aDirs.end());
+    for(auto i = watches.begin(); i != watches.end(); ) {
+        if(keep.find(i->first) == keep.end()) {
+            inotify_rm_watch(fd, i->second);
+            paths.erase(i->second);
+            i = watches.erase(i);
+        } else {
+            ++i;
+        }
+    }
+
+    for(auto i = aDirs.begin(); i != aDirs.end(); ++i) {
+        addWatch(*i);
+    }
+#endif
+}
+
+void ShareWatcher::addTree(const string& aDir) noexcept {
+    if(!addWatch(aDir))
+        return;
+
+    FileFindIter end;
+    for(FileFindIter i(aDir); i != end; ++i) {
+        string name = i->getFileName();
+        if(name.empty() || name == "." || name == ".." || !i->isDirectory())
+            continue;
+        if(!BOOLSETTING(SHARE_HIDDEN) && i->isHidden())
+            continue;
+        if(!BOOLSETTING(FOLLOW_LINKS) && i->isLink())
+            continue;
+        addTree(aDir + name + PATH_SEPARATOR);
+    }
+}
+
+bool ShareWatcher::addWatch(const string& aDir) noexcept {
+#ifdef __linux__
+    if(watches.find(aDir) != watches.end())
+        return true;
+
+    int wd = inotify_add_watch(fd, Text::fromUtf8(aDir).c_str(),
+        IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR);
+    if(wd == -1) {
+        if(errno == ENOSPC && !full) {
+            full = true;
+            LogManager::getInstance()->message(_("Not all shared directories can be watched for changes, the system limit of inotify watches has been reached"));
+        }
+        return false;
+    }
+
+    // the same directory under another name
+    auto i = paths.find(wd);
+    if(i != paths.end())
+        watches.erase(i->second);
+
+    paths[wd] = aDir;
+    watches[aDir] = wd;
+    return true;
+#else
+    return false;
+#endif
+}
+
+int ShareWatcher::run() {
+    setThreadName("ShareWatcher");
+#ifdef __linux__
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(inotify_event))));
+    StringSet changed;
+    uint64_t firstChange = 0, lastChange = 0;
+
+    while(!stopping) {
+        pollfd p = { fd, POLLIN, 0 };
+        if(::poll(&p, 1, POLL_TIMEOUT) > 0) {
+            ssize_t len;
+            while((len = ::read(fd, buf, sizeof(buf))) > 0) {
+                Lock l(cs);
+                for(char* ptr = buf; ptr < buf + len; ) {
+                    const inotify_event* ev = reinterpret_cast<const inotify_event*>(ptr);
+                    ptr += sizeof(inotify_event) + ev->len;
+
+                    if(ev->mask & IN_Q_OVERFLOW) {
+                        // events were lost; any of the directories may have changed
+                        for(auto i = paths.begin(); i != paths.end(); ++i)
+                            changed.insert(i->second);
+                        continue;
+                    }
+
+                    auto i = paths.find(ev->wd);
+                    if(i == paths.end())
+                        continue;
+
+                    if(ev->mask & IN_IGNORED) {
+                        watches.erase(i->second);
+                        paths.erase(i);
+                        continue;
+                    }
+
+                    if((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)) && ev->len > 0) {
+                        addTree(i->second + Text::toUtf8(ev->name) + PATH_SEPARATOR);
+                    }
+                    changed.insert(i->second);
+                }
+
+                lastChange = GET_TICK();
+                if(firstChange == 0)
+                    firstChange = lastChange;
+            }
+        }
+
+        uint64_t tick = GET_TICK();
+        if(!changed.empty() && (tick > lastChange + SETTLE_TIME || tick > firstChange + MAX_DELAY)) {
+            if(callback(StringList(changed.begin(), changed.end()))) {
+                changed.clear();
+                firstChange = 0;
+            } else {
+                // try again once the same time has passed
+                firstChange = lastChange = tick;
+            }
+        }
+    }
+#endif
+    return 0;
+}
+
+} // namespace dcpp
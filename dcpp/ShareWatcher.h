@@ -0,0 +1,66 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <functional>
+
+#include "typedefs.h"
+#include "Thread.h"
+#include "CriticalSection.h"
+
+namespace dcpp {
+
+/**
+ * Watches the shared directories (inotify) and reports the ones whose entries changed, a few
+ * seconds after the changes settle down, so that ShareManager can patch just those directories
+ * instead of refreshing the whole share.
+ */
+class ShareWatcher : public Thread
+{
+public:
+    /** Called on the watcher thread; returns false to be called again with the same directories later */
+    typedef std::function<bool (const StringList&)> Callback;
+
+    /** @return Whether directories can be watched on this platform */
+    static bool isAvailable();
+
+    ShareWatcher(const Callback& aCallback);
+    virtual ~ShareWatcher();
+
+    /** Watch these directories (real paths ending with a separator) and no others */
+    void setDirectories(const StringList& aDirs) noexcept;
+
+private:
+    virtual int run();
+
+    /** Watch aDir and the directories below it; with cs held */
+    void addTree(const string& aDir) noexcept;
+    bool addWatch(const string& aDir) noexcept;
+
+    Callback callback;
+
+    int fd;
+    volatile bool stopping;
+    bool full;
+
+    /** Protects the watches */
+    CriticalSection cs;
+    unordered_map<int, string> paths;
+    unordered_map<string, int> watches;
+};
+
+} // namespace dcpp
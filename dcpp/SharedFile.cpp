@@ -0,0 +1,126 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "stdinc.h"
+
+#include "SharedFile.h"
+
+namespace dcpp {
+
+SharedFile::SharedFile(const string& aPath, int64_t aSize, bool aPreallocate, bool aDirect) :
+    path(aPath), f(aPath, File::WRITE, File::OPEN | File::CREATE | File::SHARED), directOk(false)
+{
+    int64_t size = f.getSize();
+    if(size != aSize) {
+        // reserved at once the file stays in a few extents, in whatever order the segments come
+        if(size > aSize || !aPreallocate || !f.allocate(aSize)) {
+            f.setSize(aSize);
+        }
+    }
+
+#if !defined(_WIN32) && defined(O_DIRECT)
+    if(aDirect) {
+        try {
+            direct.reset(new File(aPath, File::WRITE, File::OPEN | File::SHARED | File::DIRECT));
+            directOk = true;
+        } catch(const FileException&) {
+            // not on this file system
+        }
+    }
+#else
+    (void)aDirect;
+#endif
+}
+
+void SharedFile::write(const void* buf, size_t len, int64_t aPos, bool aDirect) {
+    if(aDirect && directOk) {
+        try {
+            direct->writeAt(buf, len, aPos);
+            return;
+        } catch(const FileException&) {
+            // the file system might want another alignment; a real error shows up again below
+            directOk = false;
+        }
+    }
+    f.writeAt(buf, len, aPos);
+}
+
+SharedFile::Stream::Stream(const Ptr& aFile, int64_t aPos) : file(aFile), pos(aPos), buf(NULL), bufLen(0) {
+#ifndef _WIN32
+    if(file->isDirect()) {
+        void* p;
+        if(posix_memalign(&p, ALIGNMENT, BUFFER_BYTES) == 0) {
+            buf = (uint8_t*)p;
+        }
+    }
+#endif
+}
+
+SharedFile::Stream::~Stream() {
+    try {
+        writeBuffer();
+    } catch(const Exception&) { }
+    free(buf);
+}
+
+size_t SharedFile::Stream::write(const void* wbuf, size_t len) {
+    const uint8_t* b = (const uint8_t*)wbuf;
+    if(!buf) {
+        file->write(b, len, pos, false);
+        pos += len;
+        return len;
+    }
+
+    size_t left = len;
+    while(left > 0) {
+        size_t n;
+        if(bufLen == 0 && pos % ALIGNMENT != 0) {
+            // up to the next block boundary through the cache
+            n = min(left, (size_t)(ALIGNMENT - pos % ALIGNMENT));
+            file->write(b, n, pos, false);
+            pos += n;
+        } else {
+            n = min(left, BUFFER_BYTES - bufLen);
+            memcpy(buf + bufLen, b, n);
+            bufLen += n;
+            if(bufLen == BUFFER_BYTES)
+                writeBuffer();
+        }
+        b += n;
+        left -= n;
+    }
+    return len;
+}
+
+size_t SharedFile::Stream::flush() {
+    writeBuffer();
+    return file->f.flush();
+}
+
+void SharedFile::Stream::writeBuffer() {
+    if(bufLen == 0)
+        return;
+
+    size_t aligned = bufLen - bufLen % ALIGNMENT;
+    if(aligned > 0)
+        file->write(buf, aligned, pos, true);
+    if(aligned < bufLen)
+        file->write(buf + aligned, bufLen - aligned, pos + aligned, false);
+    pos += bufLen;
+    bufLen = 0;
+}
+
+} // namespace dcpp
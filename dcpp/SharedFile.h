@@ -0,0 +1,86 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <atomic>
+
+#include "typedefs.h"
+#include "File.h"
+#include "Pointer.h"
+
+namespace dcpp {
+
+/**
+ * The temporary target of a queued file, opened once for all the segments of it being
+ * downloaded at the same time. Each of them writes at its own position; very large files may
+ * be written around the system cache.
+ */
+class SharedFile : public intrusive_ptr_base<SharedFile>, private boost::noncopyable
+{
+public:
+    typedef boost::intrusive_ptr<SharedFile> Ptr;
+
+    /** Writes one segment, from the position it was created with on */
+    class Stream : public OutputStream {
+    public:
+        using OutputStream::write;
+
+        Stream(const Ptr& aFile, int64_t aPos);
+        /** Writes what is still buffered, so that nothing is lost when a download is cut off */
+        virtual ~Stream();
+
+        virtual size_t write(const void* buf, size_t len);
+        virtual size_t flush();
+
+    private:
+        /** Write the buffer out, the unaligned end of it through the system cache */
+        void writeBuffer();
+
+        Ptr file;
+        /** Where the buffer, or the next write when nothing is buffered, goes in the file */
+        int64_t pos;
+        /** Aligned buffer of BUFFER_BYTES for the direct writes, NULL otherwise */
+        uint8_t* buf;
+        size_t bufLen;
+    };
+
+    /**
+     * Open a file and make it aSize bytes large.
+     * @param aPreallocate Reserve the disk space of the whole file up front where the file
+     * system allows it, instead of extending it sparsely
+     * @param aDirect Write full blocks around the system cache
+     */
+    SharedFile(const string& aPath, int64_t aSize, bool aPreallocate, bool aDirect);
+
+    const string& getPath() const { return path; }
+    bool isDirect() const { return direct.get() != NULL; }
+
+private:
+    /** Alignment and size of direct writes */
+    enum { ALIGNMENT = 4096, BUFFER_BYTES = 1024 * 1024 };
+
+    /** Write through the direct handle if allowed and usable, the cached one otherwise */
+    void write(const void* buf, size_t len, int64_t aPos, bool aDirect);
+
+    string path;
+    File f;
+    unique_ptr<File> direct;
+    /** Cleared when the file system turns out not to take direct writes */
+    std::atomic<bool> directOk;
+};
+
+} // namespace dcpp
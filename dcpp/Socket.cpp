@@ -50,6 +50,11 @@
 #include <net/if.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
 #endif
 
 #ifdef __HAIKU__
@@ -520,6 +525,59 @@ void Socket::writeTo(const string& aAddr, uint16_t aPort, const void* aBuffer, i
  * @return WAIT_*** ored together of the current state.
  * @throw SocketException Select or the connection attempt failed.
  */
+#ifndef _WIN32
+// poll() rather than select() so that descriptors above FD_SETSIZE work with many connections
+int Socket::wait(uint32_t millis, int waitFor) {
+    pollfd pfd;
+    pfd.fd = sock;
+    pfd.events = 0;
+    pfd.revents = 0;
+
+    if(waitFor & WAIT_CONNECT) {
+        dcassert(!(waitFor & WAIT_READ) && !(waitFor & WAIT_WRITE));
+        pfd.events = POLLOUT;
+    } else {
+        if(waitFor & WAIT_READ)
+            pfd.events |= POLLIN;
+        if(waitFor & WAIT_WRITE)
+            pfd.events |= POLLOUT;
+    }
+
+    int result;
+    do {
+        result = poll(&pfd, 1, static_cast<int>(millis));
+    } while (result < 0 && getLastError() == EINTR);
+    check(result);
+
+    // fix buffer overflow during shutdown
+    if(sock == INVALID_SOCKET || result == 0)
+        return WAIT_NONE;
+
+    if(waitFor & WAIT_CONNECT) {
+        if(pfd.revents & (POLLERR | POLLHUP)) {
+            int y = 0;
+            socklen_t z = sizeof(y);
+            check(getsockopt(sock, SOL_SOCKET, SO_ERROR, (char*)&y, &z));
+
+            if(y != 0)
+                throw SocketException(y);
+            // No errors! We're connected (?)...
+            return WAIT_CONNECT;
+        }
+        return (pfd.revents & POLLOUT) ? WAIT_CONNECT : WAIT_NONE;
+    }
+
+    waitFor = WAIT_NONE;
+    if(pfd.revents & (POLLIN | POLLERR | POLLHUP)) {
+        waitFor |= (pfd.events & POLLIN) ? WAIT_READ : WAIT_NONE;
+    }
+    if(pfd.revents & (POLLOUT | POLLERR | POLLHUP)) {
+        waitFor |= (pfd.events & POLLOUT) ? WAIT_WRITE : WAIT_NONE;
+    }
+
+    return waitFor;
+}
+#else
 int Socket::wait(uint32_t millis, int waitFor) {
     timeval tv;
     fd_set rfd, wfd, efd;
@@ -596,6 +654,28 @@ int Socket::wait(uint32_t millis, int waitFor) {
 
     return waitFor;
 }
+#endif
+
+int Socket::sendFile(int aFd, size_t aLen) {
+#ifdef __linux__
+    ssize_t sent;
+    do {
+        sent = ::sendfile(sock, aFd, NULL, aLen);
+    } while (sent < 0 && getLastError() == EINTR);
+
+    check((int)sent, true);
+    if(sent == 0 && aLen > 0) {
+        throw SocketException(_("File changed while being sent"));
+    }
+    if(sent > 0) {
+        stats.totalUp += sent;
+    }
+    return (int)sent;
+#else
+    dcassert(0);
+    throw SocketException(_("Not supported"));
+#endif
+}
 
 bool Socket::waitConnected(uint32_t millis) {
     return wait(millis, Socket::WAIT_CONNECT) == WAIT_CONNECT;
@@ -96,6 +96,13 @@ public:
     void writeAll(const void* aBuffer, int aLen, uint32_t timeout = 0);
     virtual int write(const void* aBuffer, int aLen);
     int write(const string& aData) { return write(aData.data(), (int)aData.length()); }
+    /**
+     * Sends up to aLen bytes, starting at the current position of an open file, without
+     * copying them through user space. Only for plain (non-TLS) sockets, Linux only.
+     * @return Number of bytes sent, -1 if the call would block.
+     * @throw SocketException Send failed or the file ended early.
+     */
+    int sendFile(int aFd, size_t aLen);
     virtual void writeTo(const string& aIp, uint16_t aPort, const void* aBuffer, int aLen, bool proxy = true);
     void writeTo(const string& aIp, uint16_t aPort, const string& aData) { writeTo(aIp, aPort, aData.data(), (int)aData.length()); }
     virtual void shutdown() noexcept;
@@ -178,6 +185,16 @@ public:
 
     GETSET(string, ip, Ip);
     socket_t sock;
+
+    /** Where a connection stands in ThrottleManager's round robin; only used by the thread doing its I/O */
+    struct ThrottleShare {
+        ThrottleShare() : round(0), deficit(0), turn(0) { }
+        uint64_t round;
+        int64_t deficit;
+        uint32_t turn;
+    };
+    ThrottleShare throttleDown;
+    ThrottleShare throttleUp;
 protected:
     int type;
     bool connected;
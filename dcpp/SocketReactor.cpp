@@ -0,0 +1,256 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "stdinc.h"
+
+#include "SocketReactor.h"
+
+#include "BufferedSocket.h"
+#include "SettingsManager.h"
+#include "TimerManager.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+namespace dcpp {
+
+// Same granularity as the thread engine uses for connect / accept timeouts
+#define POLL_TIMEOUT 250
+#define MAX_EVENTS 256
+
+bool SocketReactor::isAvailable() {
+#ifdef __linux__
+    return true;
+#else
+    return false;
+#endif
+}
+
+SocketReactor::SocketReactor() : next(0) {
+#ifdef __linux__
+    int threads = SETTING(SOCKET_IO_THREADS);
+    if(threads <= 0) {
+        threads = min(4, max(1, static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN))));
+    }
+
+    for(int i = 0; i < threads; ++i) {
+        Worker* w = new Worker();
+        w->start();
+        workers.push_back(w);
+    }
+#endif
+}
+
+SocketReactor::~SocketReactor() {
+    for(auto w: workers) {
+        w->stop();
+        w->join();
+        delete w;
+    }
+}
+
+SocketReactor::Worker* SocketReactor::attach() noexcept {
+    FastLock l(cs);
+    dcassert(!workers.empty());
+    return workers[next++ % workers.size()];
+}
+
+SocketReactor::Worker::Worker() : pollFd(-1), wakeFd(-1), stopping(false) {
+#ifdef __linux__
+    pollFd = epoll_create1(EPOLL_CLOEXEC);
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(pollFd == -1 || wakeFd == -1) {
+        throw ThreadException(Util::translateError(errno));
+    }
+
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    epoll_ctl(pollFd, EPOLL_CTL_ADD, wakeFd, &ev);
+#endif
+}
+
+SocketReactor::Worker::~Worker() {
+    dcassert(sockets.empty());
+    if(wakeFd != -1)
+        ::close(wakeFd);
+    if(pollFd != -1)
+        ::close(pollFd);
+}
+
+void SocketReactor::Worker::post(BufferedSocket* aSock) noexcept {
+    bool wake;
+    {
+        FastLock l(cs);
+        if(aSock->queued)
+            return;
+        aSock->queued = true;
+        wake = posted.empty();
+        posted.push_back(aSock);
+    }
+
+    // the I/O thread drains the whole list, so one wakeup per batch is enough
+    if(wake)
+        wakeup();
+}
+
+void SocketReactor::Worker::watch(BufferedSocket* aSock, socket_t aFd, int oldEvents, int newEvents) noexcept {
+#ifdef __linux__
+    if(aFd == INVALID_SOCKET)
+        return;
+
+    epoll_event ev = {};
+    ev.data.ptr = aSock;
+    if(newEvents & Socket::WAIT_READ)
+        ev.events |= EPOLLIN | EPOLLRDHUP;
+    if(newEvents & Socket::WAIT_WRITE)
+        ev.events |= EPOLLOUT;
+    if(newEvents & WAIT_EDGE)
+        ev.events |= EPOLLET;
+
+    if(newEvents == 0) {
+        epoll_ctl(pollFd, EPOLL_CTL_DEL, aFd, &ev);
+    } else {
+        epoll_ctl(pollFd, oldEvents == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, aFd, &ev);
+    }
+#endif
+}
+
+void SocketReactor::Worker::schedule(BufferedSocket* aSock, uint64_t aTick) noexcept {
+    if(aSock->timerAt != 0 && aSock->timerAt <= aTick)
+        return;
+    aSock->timerAt = aTick;
+    timers.insert(make_pair(aTick, aSock));
+}
+
+void SocketReactor::Worker::stop() noexcept {
+    stopping = true;
+    wakeup();
+}
+
+void SocketReactor::Worker::wakeup() noexcept {
+#ifdef __linux__
+    uint64_t one = 1;
+    ssize_t ret = ::write(wakeFd, &one, sizeof(one));
+    (void)ret;
+#endif
+}
+
+void SocketReactor::Worker::process(BufferedSocket* aSock, int aEvents) noexcept {
+    // events may still be reported for a socket that shut down earlier in the same batch
+    if(find(dead.begin(), dead.end(), aSock) != dead.end())
+        return;
+
+    if(!aSock->reactorStep(aEvents)) {
+        dead.push_back(aSock);
+    }
+}
+
+int SocketReactor::Worker::run() {
+    setThreadName("SocketReactor");
+#ifdef __linux__
+    epoll_event events[MAX_EVENTS];
+    vector<BufferedSocket*> queue;
+    uint64_t nextTick = GET_TICK() + POLL_TIMEOUT;
+
+    while(!stopping) {
+        int timeout = POLL_TIMEOUT;
+        if(!timers.empty()) {
+            uint64_t now = GET_TICK();
+            uint64_t first = timers.begin()->first;
+            timeout = first <= now ? 0 : static_cast<int>(min(first - now, static_cast<uint64_t>(POLL_TIMEOUT)));
+        }
+
+        int n = epoll_wait(pollFd, events, MAX_EVENTS, timeout);
+        if(n < 0 && errno != EINTR) {
+            dcdebug("SocketReactor: epoll_wait failed: %d\n", errno);
+            Thread::sleep(POLL_TIMEOUT);
+            continue;
+        }
+
+        for(int i = 0; i < n; ++i) {
+            if(!events[i].data.ptr) {
+                uint64_t count;
+                while(::read(wakeFd, &count, sizeof(count)) > 0) { }
+                continue;
+            }
+
+            int ev = Socket::WAIT_NONE;
+            if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+                ev |= Socket::WAIT_READ;
+            if(events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+                ev |= Socket::WAIT_WRITE;
+            process(static_cast<BufferedSocket*>(events[i].data.ptr), ev);
+        }
+
+        {
+            FastLock l(cs);
+            queue.swap(posted);
+            for(auto s: queue)
+                s->queued = false;
+        }
+
+        for(auto s: queue) {
+            sockets.insert(s);
+            process(s, Socket::WAIT_NONE);
+        }
+        queue.clear();
+
+        uint64_t tick = GET_TICK();
+        while(!timers.empty() && timers.begin()->first <= tick) {
+            auto t = *timers.begin();
+            timers.erase(timers.begin());
+            if(t.second->timerAt != t.first || find(dead.begin(), dead.end(), t.second) != dead.end())
+                continue;
+            t.second->timerAt = 0;
+            process(t.second, Socket::WAIT_NONE);
+        }
+
+        if(tick >= nextTick) {
+            nextTick = tick + POLL_TIMEOUT;
+            for(auto s: sockets) {
+                if(s->reactorPending() && find(dead.begin(), dead.end(), s) == dead.end()) {
+                    process(s, Socket::WAIT_NONE);
+                }
+            }
+        }
+
+        if(!dead.empty()) {
+            {
+                FastLock l(cs);
+                for(auto s: dead)
+                    posted.erase(remove(posted.begin(), posted.end(), s), posted.end());
+            }
+            for(auto i = timers.begin(); i != timers.end(); ) {
+                if(find(dead.begin(), dead.end(), i->second) != dead.end())
+                    timers.erase(i++);
+                else
+                    ++i;
+            }
+            for(auto s: dead) {
+                sockets.erase(s);
+                delete s;
+            }
+            dead.clear();
+        }
+    }
+#endif
+    return 0;
+}
+
+} // namespace dcpp
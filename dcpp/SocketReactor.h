@@ -0,0 +1,91 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "typedefs.h"
+#include "Singleton.h"
+#include "Thread.h"
+#include "CriticalSection.h"
+#include "Socket.h"
+
+namespace dcpp {
+
+class BufferedSocket;
+
+/**
+ * Event loop socket engine: a small, fixed pool of I/O threads that multiplex
+ * every BufferedSocket over epoll instead of giving each socket its own thread.
+ * Only created when SettingsManager::SOCKET_ENGINE asks for it and the platform
+ * supports it; otherwise BufferedSocket keeps running its own thread.
+ */
+class SocketReactor : public Singleton<SocketReactor>
+{
+public:
+    class Worker : public Thread {
+    public:
+        /** Extra watch flag (next to Socket::WAIT_READ / WAIT_WRITE) for edge triggered notification */
+        enum { WAIT_EDGE = 0x80 };
+
+        Worker();
+        virtual ~Worker();
+
+        /** Queue a socket for processing on this thread; may be called from any thread. */
+        void post(BufferedSocket* aSock) noexcept;
+        /** Change the events the I/O thread is woken up for; I/O thread only. */
+        void watch(BufferedSocket* aSock, socket_t aFd, int oldEvents, int newEvents) noexcept;
+        /** Process the socket again at aTick, as when it is out of throttle tokens; I/O thread only. */
+        void schedule(BufferedSocket* aSock, uint64_t aTick) noexcept;
+
+        void stop() noexcept;
+    private:
+        virtual int run();
+
+        void process(BufferedSocket* aSock, int aEvents) noexcept;
+        void wakeup() noexcept;
+
+        int pollFd;
+        int wakeFd;
+        volatile bool stopping;
+
+        FastCriticalSection cs;
+        vector<BufferedSocket*> posted;
+
+        // I/O thread only
+        unordered_set<BufferedSocket*> sockets;
+        vector<BufferedSocket*> dead;
+        /** Entries whose tick isn't the socket's timerAt anymore are left over and skipped */
+        multimap<uint64_t, BufferedSocket*> timers;
+    };
+
+    /** @return Whether the event loop engine can be used on this platform */
+    static bool isAvailable();
+
+    /** Pick the I/O thread a new socket will live on */
+    Worker* attach() noexcept;
+
+private:
+    friend class Singleton<SocketReactor>;
+
+    SocketReactor();
+    virtual ~SocketReactor();
+
+    vector<Worker*> workers;
+    size_t next;
+    FastCriticalSection cs;
+};
+
+} // namespace dcpp
@@ -22,7 +22,9 @@
 #include <vector>
 #include <algorithm>
 #include <iterator>
+#include <atomic>
 #include "CriticalSection.h"
+#include "Semaphore.h"
 #include "noexcept.h"
 
 namespace dcpp {
@@ -31,45 +33,153 @@ using std::forward;
 using std::vector;
 using std::find;
 
+/**
+ * Events are dispatched without taking a lock: fire() walks an immutable snapshot of the
+ * listener list, and adding or removing a listener publishes a new snapshot (copy on write).
+ * removeListener() returns once no other thread can still call the removed listener, so it
+ * may be destroyed right away; the exception is a listener removed by a thread that is
+ * itself inside fire() of the same speaker, as waiting for that thread would never end.
+ */
 template<typename Listener>
 class Speaker {
     typedef vector<Listener*> ListenerList;
 
 public:
-    Speaker() noexcept { }
-    virtual ~Speaker() { }
+    Speaker() noexcept : snapshot(new ListenerList()), epoch(0), waiting(false) {
+        readers[0] = 0;
+        readers[1] = 0;
+    }
+    virtual ~Speaker() {
+        delete snapshot.load();
+        for(auto i = retired.begin(); i != retired.end(); ++i)
+            delete *i;
+    }
 
     template<typename... T>
     void fire(T&&... type) noexcept {
-        Lock l(listenerCS);
-        tmp = listeners;
-        for(auto i = tmp.begin(); i != tmp.end(); ++i) {
+        Reader r(*this);
+        const ListenerList& l = *snapshot.load();
+        for(auto i = l.begin(); i != l.end(); ++i) {
             (*i)->on(std::forward<T>(type)...);
         }
     }
 
     void addListener(Listener* aListener) {
         Lock l(listenerCS);
-        if(find(listeners.begin(), listeners.end(), aListener) == listeners.end())
+        if(find(listeners.begin(), listeners.end(), aListener) == listeners.end()) {
             listeners.push_back(aListener);
+            publish();
+        }
     }
 
     void removeListener(Listener* aListener) {
-        Lock l(listenerCS);
-        auto it = find(listeners.begin(), listeners.end(), aListener);
-        if(it != listeners.end())
+        vector<ListenerList*> old;
+        {
+            Lock l(listenerCS);
+            auto it = find(listeners.begin(), listeners.end(), aListener);
+            if(it == listeners.end())
+                return;
             listeners.erase(it);
+            publish();
+            if(!Reader::isFiring(this))
+                old.swap(retired);
+        }
+        synchronize(old);
     }
 
     void removeListeners() {
-        Lock l(listenerCS);
-        listeners.clear();
+        vector<ListenerList*> old;
+        {
+            Lock l(listenerCS);
+            listeners.clear();
+            publish();
+            if(!Reader::isFiring(this))
+                old.swap(retired);
+        }
+        synchronize(old);
     }
 
 protected:
     ListenerList listeners;
-    ListenerList tmp;
     CriticalSection listenerCS;
+
+private:
+    /** Counts a fire() in progress; chained per thread so that removeListener() can tell it runs inside one */
+    class Reader {
+    public:
+        Reader(Speaker& aSpeaker) : speaker(aSpeaker), slot(aSpeaker.epoch.load() & 1), prev(current) {
+            speaker.readers[slot]++;
+            current = this;
+        }
+        ~Reader() {
+            current = prev;
+            // the last one out of a slot wakes synchronize() if it's waiting for that
+            if(--speaker.readers[slot] == 0 && speaker.waiting.load() && speaker.waiting.exchange(false))
+                speaker.drained.signal();
+        }
+
+        static bool isFiring(const Speaker* aSpeaker) {
+            for(auto r = current; r; r = r->prev) {
+                if(&r->speaker == aSpeaker)
+                    return true;
+            }
+            return false;
+        }
+
+    private:
+        Reader(const Reader&);
+        Reader& operator=(const Reader&);
+
+        Speaker& speaker;
+        unsigned slot;
+        Reader* prev;
+
+        static thread_local Reader* current;
+    };
+
+    /** Swap in a copy of listeners; listenerCS must be held */
+    void publish() {
+        retired.push_back(snapshot.exchange(new ListenerList(listeners)));
+    }
+
+    /**
+     * Wait for every fire() that was in progress when the snapshots were swapped out, then
+     * delete them. Called without listenerCS, since a listener may add or remove listeners.
+     */
+    void synchronize(vector<ListenerList*>& aOld) {
+        if(aOld.empty())
+            return;
+
+        // one waiter at a time, so that each signal of drained is for the one waiting
+        Lock l(syncCS);
+
+        // Point new readers to the other counter, so that the one waited for drains
+        for(unsigned slot = 0; slot < 2; ++slot) {
+            epoch = slot ^ 1;
+            while(readers[slot] != 0) {
+                waiting = true;
+                // when the counter drained meanwhile but a reader took the flag, its signal is still due
+                if(readers[slot] != 0 || !waiting.exchange(false))
+                    drained.wait();
+            }
+        }
+
+        for(auto i = aOld.begin(); i != aOld.end(); ++i)
+            delete *i;
+    }
+
+    std::atomic<ListenerList*> snapshot;
+    std::atomic<unsigned> epoch;
+    std::atomic<unsigned> readers[2];
+    /** Set by synchronize() before it sleeps on drained */
+    std::atomic<bool> waiting;
+    Semaphore drained;
+    CriticalSection syncCS;
+    /** Snapshots some fire() may still be walking; listenerCS */
+    vector<ListenerList*> retired;
 };
 
+template<typename Listener>
+thread_local typename Speaker<Listener>::Reader* Speaker<Listener>::Reader::current = nullptr;
+
 } // namespace dcpp
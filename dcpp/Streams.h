@@ -73,6 +73,16 @@ public:
      *         actually read from the stream source in this call.
      */
     virtual size_t read(void* buf, size_t& len) = 0;
+    /**
+     * Zero-copy support: streams that are a plain view of an open file return the OS handle
+     * here, so that the data can be handed to the kernel instead of being read into memory.
+     * The data starts at the file's current position.
+     * @param maxBytes Number of bytes left in the stream
+     * @return The file descriptor or -1 if the stream has to be read normally.
+     */
+    virtual int getFileHandle(int64_t& /*maxBytes*/) { return -1; }
+    /** Tell the stream that len bytes have been taken directly from its file handle. */
+    virtual void skipped(size_t /*len*/) { }
 private:
     InputStream(const InputStream&);
     InputStream& operator=(const InputStream&);
@@ -124,6 +134,17 @@ public:
         return x;
     }
 
+    int getFileHandle(int64_t& aMaxBytes) {
+        int fd = s->getFileHandle(aMaxBytes);
+        aMaxBytes = min(aMaxBytes, (int64_t)maxBytes);
+        return fd;
+    }
+
+    void skipped(size_t len) {
+        maxBytes -= len;
+        s->skipped(len);
+    }
+
 private:
     InputStream* s;
     uint64_t maxBytes;
@@ -27,8 +27,7 @@ namespace dcpp {
  * A class that implements a fast substring search algo suited for matching
  * one pattern against many strings (currently Quick Search, a variant of
  * Boyer-Moore. Code based on "A very fast substring search algorithm" by
- * D. Sunday).
- * @todo Perhaps find an algo suitable for matching multiple substrings.
+ * D. Sunday). See MultiStringSearch for matching several patterns at once.
  */
 class StringSearch {
 public:
@@ -57,22 +56,24 @@ public:
 
     /** Match a text against the pattern */
     bool match(const string& aText) const noexcept {
-
         // Lower-case representation of UTF-8 string, since we no longer have that 1 char = 1 byte...
         string lower;
-        Text::toLower(aText, lower);
+        return matchLower(Text::toLower(aText, lower));
+    }
 
+    /** Match a text that is already in lower case against the pattern */
+    bool matchLower(const string& aLowerText) const noexcept {
         // uint8_t to avoid problems with signed char pointer arithmetic
-        uint8_t *tx = (uint8_t*)lower.c_str();
+        uint8_t *tx = (uint8_t*)aLowerText.c_str();
         uint8_t *px = (uint8_t*)pattern.c_str();
 
         string::size_type plen = pattern.length();
 
-        if(aText.length() < plen) {
+        if(aLowerText.length() < plen) {
             return false;
         }
 
-        uint8_t *end = tx + aText.length() - plen + 1;
+        uint8_t *end = tx + aLowerText.length() - plen + 1;
         while(tx < end) {
             size_t i = 0;
             for(; px[i] && (px[i] == tx[i]); ++i)
@@ -0,0 +1,82 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "stdinc.h"
+
+#include "ThreadPool.h"
+
+namespace dcpp {
+
+ThreadPool::ThreadPool(const char* aName, size_t aThreads, Thread::Priority aPriority) :
+    name(aName), priority(aPriority), stopping(false)
+{
+    for(size_t i = 0; i < max(aThreads, static_cast<size_t>(1)); ++i) {
+        Worker* w = new Worker(*this);
+        w->start();
+        workers.push_back(w);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        Lock l(cs);
+        stopping = true;
+    }
+    for(size_t i = 0; i < workers.size(); ++i)
+        s.signal();
+
+    for(auto w: workers) {
+        w->join();
+        delete w;
+    }
+}
+
+void ThreadPool::add(const Task& aTask) noexcept {
+    {
+        Lock l(cs);
+        tasks.push_back(aTask);
+    }
+    s.signal();
+}
+
+bool ThreadPool::next(Task& aTask) noexcept {
+    for(;;) {
+        s.wait();
+
+        Lock l(cs);
+        if(!tasks.empty()) {
+            aTask = std::move(tasks.front());
+            tasks.pop_front();
+            return true;
+        }
+        if(stopping)
+            return false;
+    }
+}
+
+int ThreadPool::Worker::run() {
+    setThreadName(pool.name);
+    setThreadPriority(pool.priority);
+
+    Task t;
+    while(pool.next(t)) {
+        t();
+        t = nullptr;
+    }
+    return 0;
+}
+
+} // namespace dcpp
@@ -0,0 +1,68 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <deque>
+#include <functional>
+
+#include "typedefs.h"
+#include "Thread.h"
+#include "CriticalSection.h"
+#include "Semaphore.h"
+
+namespace dcpp {
+
+using std::deque;
+
+/**
+ * Fixed set of threads running queued tasks in the order they were added.
+ * Tasks must not throw; the destructor runs whatever is still queued before
+ * joining the threads.
+ */
+class ThreadPool : private boost::noncopyable
+{
+public:
+    typedef std::function<void ()> Task;
+
+    ThreadPool(const char* aName, size_t aThreads, Thread::Priority aPriority = Thread::NORMAL);
+    ~ThreadPool();
+
+    void add(const Task& aTask) noexcept;
+    size_t size() const { return workers.size(); }
+
+private:
+    class Worker : public Thread {
+    public:
+        Worker(ThreadPool& aPool) : pool(aPool) { }
+    private:
+        virtual int run();
+        ThreadPool& pool;
+    };
+
+    bool next(Task& aTask) noexcept;
+
+    const char* name;
+    Thread::Priority priority;
+    vector<Worker*> workers;
+
+    CriticalSection cs;
+    Semaphore s;
+    deque<Task> tasks;
+    bool stopping;
+};
+
+} // namespace dcpp
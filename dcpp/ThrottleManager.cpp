@@ -20,12 +20,10 @@
 
 #include "ThrottleManager.h"
 
-#include "DownloadManager.h"
 #include "Singleton.h"
 #include "Socket.h"
 #include "Thread.h"
 #include "TimerManager.h"
-#include "UploadManager.h"
 #include "ClientManager.h"
 
 namespace dcpp {
@@ -34,79 +32,185 @@ namespace dcpp {
  * Inspired by Token Bucket algorithm: https://en.wikipedia.org/wiki/Token_bucket
  */
 
+namespace {
+
+// length of a round, in ms
+const uint64_t ROUND_TIME = 100;
+// unused tokens and deficits are kept for this many rounds at most
+const int64_t BURST_ROUNDS = 2;
+// smallest quantum, so that a low limit shared by many connections doesn't end up in tiny packets
+const int64_t MIN_QUANTUM = 1024;
+
+}
+
 /*
  * Throttles traffic and reads a packet from the network
  */
-int ThrottleManager::read(Socket* sock, void* buffer, size_t len)
+int ThrottleManager::read(Socket* sock, void* buffer, size_t len, uint64_t* nextRound)
 {
-    int64_t readSize = -1;
-    size_t downs = DownloadManager::getInstance()->getDownloadCount();
-    auto downLimit = getDownLimit(); // avoid even intra-function races
-    if(!BOOLSETTING(THROTTLE_ENABLE) || !getCurThrottling() || downLimit == 0 || downs == 0)
+    if(nextRound)
+        *nextRound = 0;
+
+    const int64_t rate = downRate;
+    if(rate == 0)
         return sock->read(buffer, len);
 
-    {
-        Lock l(downCS);
+    size_t readSize = takeTokens(down, sock->throttleDown, len, rate, nextRound);
+    if(readSize == 0)
+        return -1;  // from BufferedSocket: -1 = retry, 0 = connection close
 
-        if(downTokens > 0)
-        {
-            int64_t slice = (downLimit * 1024) / downs;
-            readSize = min(slice, min(static_cast<int64_t>(len), downTokens));
+    int ret;
+    try {
+        ret = sock->read(buffer, static_cast<int>(readSize));
+    } catch(const Exception&) {
+        down.giveBack(sock->throttleDown, readSize);
+        throw;
+    }
 
-            // read from socket
-            readSize = sock->read(buffer, static_cast<size_t>(readSize));
+    if(ret < static_cast<int>(readSize))
+        down.giveBack(sock->throttleDown, readSize - max(ret, 0));
+    return ret;
+}
 
-            if(readSize > 0)
-                downTokens -= readSize;
-        }
+/*
+ * Throttles traffic and writes a packet to the network
+ * Handle this a little bit differently than downloads due to OpenSSL stupidity
+ */
+int ThrottleManager::write(Socket* sock, void* buffer, size_t& len, uint64_t* nextRound)
+{
+    if(nextRound)
+        *nextRound = 0;
+
+    const int64_t rate = upRate;
+    if(rate != 0) {
+        len = takeTokens(up, sock->throttleUp, len, rate, nextRound);
+        if(len == 0)
+            return 0;   // from BufferedSocket: -1 = failed, 0 = retry
     }
 
-    if(readSize != -1)
-    {
-        Thread::yield(); // give a chance to other transfers to get a token
-        return readSize;
+    int sent;
+    try {
+        sent = sock->write(buffer, len);
+    } catch(const Exception&) {
+        if(rate != 0)
+            up.giveBack(sock->throttleUp, len);
+        throw;
     }
 
-    waitToken();
-    return -1;  // from BufferedSocket: -1 = retry, 0 = connection close
+    if(rate != 0 && sent < static_cast<int>(len))
+        up.giveBack(sock->throttleUp, len - max(sent, 0));
+    return sent;
 }
 
 /*
- * Throttles traffic and writes a packet to the network
- * Handle this a little bit differently than downloads due to OpenSSL stupidity
+ * Throttles traffic and sends part of an open file to the network (zero-copy);
+ * same return values as write
  */
-int ThrottleManager::write(Socket* sock, void* buffer, size_t& len)
+int ThrottleManager::sendFile(Socket* sock, int fd, size_t& len, uint64_t* nextRound)
 {
-    bool gotToken = false;
-    size_t ups = UploadManager::getInstance()->getUploadCount();
-    auto upLimit = getUpLimit(); // avoid even intra-function races
-    if(!BOOLSETTING(THROTTLE_ENABLE) || !getCurThrottling() || upLimit == 0 || ups == 0)
-        return sock->write(buffer, len);
+    if(nextRound)
+        *nextRound = 0;
+
+    const int64_t rate = upRate;
+    if(rate != 0) {
+        len = takeTokens(up, sock->throttleUp, len, rate, nextRound);
+        if(len == 0)
+            return 0;
+    }
+
+    int sent;
+    try {
+        sent = sock->sendFile(fd, len);
+    } catch(const Exception&) {
+        if(rate != 0)
+            up.giveBack(sock->throttleUp, len);
+        throw;
+    }
 
-    {
-        Lock l(upCS);
+    if(rate != 0 && sent < static_cast<int>(len))
+        up.giveBack(sock->throttleUp, len - max(sent, 0));
+    return sent;
+}
 
-        if(upTokens > 0)
-        {
-            size_t slice = (upLimit * 1024) / ups;
-            len = min(slice, min(len, static_cast<size_t>(upTokens)));
-            upTokens -= len;
+/*
+ * Takes tokens for up to len bytes; when the connection has used up its share of this round,
+ * returns 0 after waiting for the next one, or at once with the next one's tick in aNextRound.
+ */
+size_t ThrottleManager::takeTokens(Bucket& aBucket, Socket::ThrottleShare& aShare, size_t aLen, int64_t aRate, uint64_t* aNextRound)
+{
+    size_t n = aBucket.take(aShare, aLen, aRate);
+    if(n == 0) {
+        const uint64_t now = GET_TICK();
+        if(aNextRound)
+            *aNextRound = now - now % ROUND_TIME + ROUND_TIME;
+        else
+            Thread::sleep(static_cast<uint32_t>(ROUND_TIME - now % ROUND_TIME));
+    }
+    return n;
+}
+
+size_t ThrottleManager::Bucket::take(Socket::ThrottleShare& aShare, size_t aLen, int64_t aRate) noexcept
+{
+    const int64_t perRound = max(aRate * static_cast<int64_t>(ROUND_TIME) / 1000, static_cast<int64_t>(1));
+
+    // whoever notices first that a new round has begun refills the bucket
+    const uint64_t now = GET_TICK() / ROUND_TIME;
+    uint64_t cur = round;
+    while(now > cur && !round.compare_exchange_weak(cur, now))
+        ;   // Empty
+    if(now > cur) {
+        refill(now - cur, perRound);
+        cur = now;
+    }
 
-            gotToken = true; // token successfuly assigned
+    if(aShare.round != cur) {
+        // a connection that sat out a round doesn't get to save up
+        if(aShare.round + 1 != cur)
+            aShare.deficit = 0;
+        aShare.round = cur;
+        if(aShare.turn == 0)
+            aShare.turn = ++turns;
+        flows++;
+
+        // when a round can't give everyone a minimum quantum, the connections take turns
+        const int64_t n = lastFlows;
+        const int64_t rounds = max(MIN_QUANTUM * n / perRound, static_cast<int64_t>(1));
+        if(cur % rounds == aShare.turn % rounds) {
+            const int64_t quantum = perRound * rounds / n;
+            aShare.deficit = min(aShare.deficit + quantum, quantum * BURST_ROUNDS);
         }
     }
 
-    if(gotToken)
-    {
-        // write to socket
-        int sent = sock->write(buffer, len);
+    if(aShare.deficit <= 0)
+        return 0;
 
-        Thread::yield(); // give a chance to other transfers get a token
-        return sent;
-    }
+    const int64_t wanted = min(static_cast<int64_t>(aLen), aShare.deficit);
+    int64_t avail = tokens;
+    int64_t n;
+    do {
+        if(avail <= 0)
+            return 0;
+        n = min(wanted, avail);
+    } while(!tokens.compare_exchange_weak(avail, avail - n));
 
-    waitToken();
-    return 0;   // from BufferedSocket: -1 = failed, 0 = retry
+    aShare.deficit -= n;
+    return static_cast<size_t>(n);
+}
+
+void ThrottleManager::Bucket::giveBack(Socket::ThrottleShare& aShare, size_t aLen) noexcept
+{
+    tokens += static_cast<int64_t>(aLen);
+    aShare.deficit += static_cast<int64_t>(aLen);
+}
+
+void ThrottleManager::Bucket::refill(uint64_t aRounds, int64_t aPerRound) noexcept
+{
+    lastFlows = max(flows.exchange(0), 1u);
+
+    const int64_t add = aPerRound * static_cast<int64_t>(min(aRounds, static_cast<uint64_t>(BURST_ROUNDS)));
+    int64_t cur = tokens;
+    while(!tokens.compare_exchange_weak(cur, min(cur + add, aPerRound * BURST_ROUNDS)))
+        ;   // Empty
 }
 
 SettingsManager::IntSetting ThrottleManager::getCurSetting(SettingsManager::IntSetting setting) {
@@ -154,65 +258,19 @@ void ThrottleManager::setSetting(SettingsManager::IntSetting setting, int value)
         ClientManager::getInstance()->infoUpdated();
 }
 
-bool ThrottleManager::getCurThrottling() {
-    Lock l(stateCS);
-    return activeWaiter != -1;
-}
-
-void ThrottleManager::waitToken() {
-    // no tokens, wait for them, so long as throttling still active
-    // avoid keeping stateCS lock on whole function
-    CriticalSection *curCS = 0;
-    {
-        Lock l(stateCS);
-        if (activeWaiter != -1)
-            curCS = &waitCS[activeWaiter];
-    }
-    // possible post-CS aW shifts: 0->1/1->0: lock lands in wrong place, will
-    // either fall through immediately or wait depending on whether in
-    // stateCS-protected transition elsewhere; 0/1-> -1: falls through. Both harmless.
-    if (curCS)
-        Lock l(*curCS);
-}
-
 ThrottleManager::~ThrottleManager(void)
 {
     shutdown();
     TimerManager::getInstance()->removeListener(this);
 }
 
-#ifdef _WIN32
-
-void ThrottleManager::shutdown() {
-    Lock l(stateCS);
-    if (activeWaiter != -1) {
-        waitCS[activeWaiter].unlock();
-        activeWaiter = -1;
-    }
-}
-#else //*nix
-
 void ThrottleManager::shutdown()
 {
-    bool wait = false;
-    {
-        Lock l(stateCS);
-        if (activeWaiter != -1)
-        {
-            n_lock = activeWaiter;
-            activeWaiter = -1;
-            halt = 1;
-            wait = true;
-        }
-    }
-
-    // wait shutdown...
-    if (wait)
-    {
-        Lock l(shutdownCS);
-    }
+    // transfers waiting for tokens are back within a round and won't be throttled anymore
+    halted = true;
+    downRate = 0;
+    upRate = 0;
 }
-#endif //*nix
 
 // TimerManagerListener
 void ThrottleManager::on(TimerManagerListener::Second, uint64_t /* aTick */) noexcept
@@ -222,66 +280,13 @@ void ThrottleManager::on(TimerManagerListener::Second, uint64_t /* aTick */) noe
         setSetting(SettingsManager::SLOTS, newSlots);
     }
 
-    {
-        Lock l(stateCS);
-
-#ifndef _WIN32 //*nix
-
-        if (halt == 1)
-        {
-            halt = -1;
+    if(halted)
+        return;
 
-            // unlock shutdown and token wait
-            dcassert(n_lock == 0 || n_lock == 1);
-            waitCS[n_lock].unlock();
-            shutdownCS.unlock();
-
-            return;
-        }
-        else if (halt == -1)
-        {
-            return;
-        }
-#endif
-        if (activeWaiter == -1)
-        {
-            // This will create slight weirdness for the read/write calls between
-            // here and the first activeWaiter-toggle below.
-            waitCS[activeWaiter = 0].lock();
-
-#ifndef _WIN32 //*nix
-
-            // lock shutdown
-            shutdownCS.lock();
-#endif
-        }
-    }
-
-    int downLimit = getDownLimit();
-    int upLimit   = getUpLimit();
-
-    // readd tokens
-    {
-        Lock l(downCS);
-        downTokens = downLimit * 1024;
-    }
-
-    {
-        Lock l(upCS);
-        upTokens = upLimit * 1024;
-    }
-
-    // let existing events drain out (fairness).
-    // www.cse.wustl.edu/~schmidt/win32-cv-1.html documents various
-    // fairer strategies, but when only broadcasting, irrelevant
-    {
-        Lock l(stateCS);
-
-        dcassert(activeWaiter == 0 || activeWaiter == 1);
-        waitCS[1-activeWaiter].lock();
-        activeWaiter = 1-activeWaiter;
-        waitCS[1-activeWaiter].unlock();
-    }
+    // picked up here rather than on every transfer, as the limits depend on the time of day
+    bool enabled = BOOLSETTING(THROTTLE_ENABLE);
+    downRate = enabled ? static_cast<int64_t>(max(getDownLimit(), 0)) * 1024 : 0;
+    upRate = enabled ? static_cast<int64_t>(max(getUpLimit(), 0)) * 1024 : 0;
 }
 
 }   // namespace dcpp
@@ -18,6 +18,8 @@
 
 #pragma once
 
+#include <atomic>
+
 #include "Singleton.h"
 #include "Socket.h"
 #include "TimerManager.h"
@@ -28,6 +30,8 @@ namespace dcpp
 /**
  * Manager for throttling traffic flow.
  * Inspired by Token Bucket algorithm: https://en.wikipedia.org/wiki/Token_bucket
+ * The buckets are refilled several times a second and shared out between the connections by
+ * deficit round robin, so no lock is taken for a transfer and capped bandwidth stays smooth.
  */
 class ThrottleManager :
     public Singleton<ThrottleManager>, private TimerManagerListener
@@ -35,15 +39,23 @@ class ThrottleManager :
 public:
 
     /*
-     * Throttles traffic and reads a packet from the network
+     * Throttles traffic and reads a packet from the network.
+     * A connection out of tokens sleeps until the next round, unless nextRound is given: then
+     * it returns at once and nextRound is set to the tick to try again at (0 when not throttled).
      */
-    int read(Socket* sock, void* buffer, size_t len);
+    int read(Socket* sock, void* buffer, size_t len, uint64_t* nextRound = nullptr);
 
     /*
      * Throttles traffic and writes a packet to the network
      * Handle this a little bit differently than downloads due to OpenSSL stupidity
      */
-    int write(Socket* sock, void* buffer, size_t& len);
+    int write(Socket* sock, void* buffer, size_t& len, uint64_t* nextRound = nullptr);
+
+    /*
+     * Throttles traffic and sends part of an open file to the network (zero-copy);
+     * same return values as write
+     */
+    int sendFile(Socket* sock, int fd, size_t& len, uint64_t* nextRound = nullptr);
 
     static SettingsManager::IntSetting getCurSetting(SettingsManager::IntSetting setting);
 
@@ -54,39 +66,50 @@ public:
 
     void shutdown();
 private:
-    // stack up throttled read & write threads
-    CriticalSection stateCS;
-    CriticalSection waitCS[2];
-    long activeWaiter;
-
-#ifndef _WIN32 //*nix
-
-    // shutdown wait
-    CriticalSection shutdownCS;
-    long n_lock, halt;
-#endif
-    // download limiter
-    CriticalSection downCS;
-    int64_t         downTokens;
-
-    // upload limiter
-    CriticalSection upCS;
-    int64_t         upTokens;
+    /**
+     * Tokens (bytes) for one direction. Each round every connection that asks is granted a
+     * quantum, its fair part of what the round adds to the bucket, and may take tokens until
+     * that is used up; what it couldn't take because the bucket ran dry is carried over. When
+     * there are too many connections for a useful quantum, each one only gets every n-th round.
+     */
+    class Bucket {
+    public:
+        Bucket() : tokens(0), round(0), flows(0), lastFlows(1), turns(0) { }
+
+        /** @return How many of aLen bytes the connection may transfer now; 0 to wait for the next round */
+        size_t take(Socket::ThrottleShare& aShare, size_t aLen, int64_t aRate) noexcept;
+        /** Return tokens a transfer didn't use */
+        void giveBack(Socket::ThrottleShare& aShare, size_t aLen) noexcept;
+
+    private:
+        void refill(uint64_t aRounds, int64_t aPerRound) noexcept;
+
+        std::atomic<int64_t> tokens;
+        std::atomic<uint64_t> round;
+        /** Connections that took part in this and in the previous round */
+        std::atomic<uint32_t> flows;
+        std::atomic<uint32_t> lastFlows;
+        std::atomic<uint32_t> turns;
+    };
+
+    Bucket down;
+    Bucket up;
+
+    // current limits in bytes / second, 0 when not throttling; refreshed every second
+    std::atomic<int64_t> downRate;
+    std::atomic<int64_t> upRate;
+    std::atomic<bool> halted;
 
     friend class Singleton<ThrottleManager>;
 
-    ThrottleManager(void) : activeWaiter(-1), downTokens(0), upTokens(0)
+    ThrottleManager(void) : downRate(0), upRate(0), halted(false)
     {
-#ifndef _WIN32 //*nix
-        n_lock = halt = 0;
-#endif
         TimerManager::getInstance()->addListener(this);
     }
 
     ~ThrottleManager(void);
 
-    bool getCurThrottling();
-    void waitToken();
+    size_t takeTokens(Bucket& aBucket, Socket::ThrottleShare& aShare, size_t aLen, int64_t aRate, uint64_t* aNextRound);
 
     // TimerManagerListener
     void on(TimerManagerListener::Second, uint64_t /* aTick */) noexcept;
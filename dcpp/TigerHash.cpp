@@ -31,7 +31,9 @@
 #include "TigerHash.h"
 
 #include <algorithm>
+#include <chrono>
 #include <cstring>
+#include <vector>
 #include <boost/detail/endian.hpp>
 
 #include "debug.h"
@@ -44,9 +46,15 @@
 #define TIGER_ARCH64
 #endif
 
+#if defined(TIGER_ARCH64) && !defined(TIGER_BIG_ENDIAN) && defined(__GNUC__) && (defined(__x86_64__) || defined(__amd64__))
+#define TIGER_AVX2
+#include <immintrin.h>
+#endif
+
 namespace dcpp {
 
 using std::min;
+using std::vector;
 
 #define PASSES 3
 
@@ -265,6 +273,173 @@ uint8_t* TigerHash::finalize() {
 	return getResult();
 }
 
+#ifdef TIGER_AVX2
+
+#define AVX2 __attribute__((target("avx2")))
+
+/** Table lookups of byte n of every lane of c */
+#define sbox(t,c,n) \
+	_mm256_i64gather_epi64((const long long*)(t), \
+		_mm256_and_si256(_mm256_srli_epi64(c, (n)*8), _mm256_set1_epi64x(0xFF)), 8)
+
+/* b * 5, 7 or 9 */
+#define mul_lanes(b,mul) \
+	((mul) == 5 ? _mm256_add_epi64(_mm256_slli_epi64(b, 2), b) : \
+	 (mul) == 7 ? _mm256_sub_epi64(_mm256_slli_epi64(b, 3), b) : \
+	              _mm256_add_epi64(_mm256_slli_epi64(b, 3), b))
+
+#define round4(a,b,c,x,mul) \
+	c = _mm256_xor_si256(c, x); \
+	a = _mm256_sub_epi64(a, _mm256_xor_si256(_mm256_xor_si256(sbox(t1,c,0), sbox(t2,c,2)), \
+		_mm256_xor_si256(sbox(t3,c,4), sbox(t4,c,6)))); \
+	b = _mm256_add_epi64(b, _mm256_xor_si256(_mm256_xor_si256(sbox(t4,c,1), sbox(t3,c,3)), \
+		_mm256_xor_si256(sbox(t2,c,5), sbox(t1,c,7)))); \
+	b = mul_lanes(b,mul);
+
+#define pass4(a,b,c,mul) \
+	round4(a,b,c,x[0],mul) \
+	round4(b,c,a,x[1],mul) \
+	round4(c,a,b,x[2],mul) \
+	round4(a,b,c,x[3],mul) \
+	round4(b,c,a,x[4],mul) \
+	round4(c,a,b,x[5],mul) \
+	round4(a,b,c,x[6],mul) \
+	round4(b,c,a,x[7],mul)
+
+#define not4(v) _mm256_xor_si256(v, _mm256_set1_epi64x(-1))
+
+#define key_schedule4 \
+	x[0] = _mm256_sub_epi64(x[0], _mm256_xor_si256(x[7], _mm256_set1_epi64x(_ULL(0xA5A5A5A5A5A5A5A5)))); \
+	x[1] = _mm256_xor_si256(x[1], x[0]); \
+	x[2] = _mm256_add_epi64(x[2], x[1]); \
+	x[3] = _mm256_sub_epi64(x[3], _mm256_xor_si256(x[2], _mm256_slli_epi64(not4(x[1]), 19))); \
+	x[4] = _mm256_xor_si256(x[4], x[3]); \
+	x[5] = _mm256_add_epi64(x[5], x[4]); \
+	x[6] = _mm256_sub_epi64(x[6], _mm256_xor_si256(x[5], _mm256_srli_epi64(not4(x[4]), 23))); \
+	x[7] = _mm256_xor_si256(x[7], x[6]); \
+	x[0] = _mm256_add_epi64(x[0], x[7]); \
+	x[1] = _mm256_sub_epi64(x[1], _mm256_xor_si256(x[0], _mm256_slli_epi64(not4(x[7]), 19))); \
+	x[2] = _mm256_xor_si256(x[2], x[1]); \
+	x[3] = _mm256_add_epi64(x[3], x[2]); \
+	x[4] = _mm256_sub_epi64(x[4], _mm256_xor_si256(x[3], _mm256_srli_epi64(not4(x[2]), 23))); \
+	x[5] = _mm256_xor_si256(x[5], x[4]); \
+	x[6] = _mm256_add_epi64(x[6], x[5]); \
+	x[7] = _mm256_sub_epi64(x[7], _mm256_xor_si256(x[6], _mm256_set1_epi64x(_ULL(0x0123456789ABCDEF))));
+
+AVX2 static inline void compress4(const uint64_t (*blk)[8], const uint64_t* table, __m256i& a, __m256i& b, __m256i& c) {
+	__m256i x[8];
+	for(int j = 0; j < 8; ++j)
+		x[j] = _mm256_set_epi64x(blk[3][j], blk[2][j], blk[1][j], blk[0][j]);
+
+	__m256i aa = a, bb = b, cc = c;
+	pass4(a,b,c,5)
+	key_schedule4
+	pass4(c,a,b,7)
+	key_schedule4
+	pass4(b,c,a,9)
+	a = _mm256_xor_si256(a, aa);
+	b = _mm256_sub_epi64(b, bb);
+	c = _mm256_add_epi64(c, cc);
+}
+
+AVX2 void TigerHash::hashLeaves4(const uint8_t* data, size_t len, uint8_t* out) {
+	__m256i a = _mm256_set1_epi64x(_ULL(0x0123456789ABCDEF));
+	__m256i b = _mm256_set1_epi64x(_ULL(0xFEDCBA9876543210));
+	__m256i c = _mm256_set1_epi64x(_ULL(0xF096A5B4C3B2E187));
+	uint64_t blk[4][8];
+
+	// The 0 byte in front shifts the data by one, so block k starts at data + 64 * k - 1
+	for(int l = 0; l < 4; ++l) {
+		uint8_t* p = (uint8_t*)blk[l];
+		p[0] = 0;
+		memcpy(p + 1, data + l * len, BLOCK_SIZE - 1);
+	}
+	compress4(blk, table, a, b, c);
+
+	for(size_t k = 1; k < len / BLOCK_SIZE; ++k) {
+		for(int l = 0; l < 4; ++l)
+			memcpy(blk[l], data + l * len + k * BLOCK_SIZE - 1, BLOCK_SIZE);
+		compress4(blk, table, a, b, c);
+	}
+
+	// Last data byte, padding and the bit length of 0 byte + data
+	for(int l = 0; l < 4; ++l) {
+		uint8_t* p = (uint8_t*)blk[l];
+		memset(p, 0, BLOCK_SIZE);
+		p[0] = data[l * len + len - 1];
+		p[1] = 0x01;
+		blk[l][7] = (len + 1) << 3;
+	}
+	compress4(blk, table, a, b, c);
+
+	uint64_t res[3][4];
+	_mm256_storeu_si256((__m256i*)res[0], a);
+	_mm256_storeu_si256((__m256i*)res[1], b);
+	_mm256_storeu_si256((__m256i*)res[2], c);
+	for(int l = 0; l < 4; ++l) {
+		for(int i = 0; i < 3; ++i)
+			memcpy(out + l * BYTES + i * sizeof(uint64_t), &res[i][l], sizeof(uint64_t));
+	}
+}
+
+#endif // TIGER_AVX2
+
+bool TigerHash::hasKernel(Kernel aKernel) {
+#ifdef TIGER_AVX2
+	if(aKernel == KERNEL_AVX2)
+		return __builtin_cpu_supports("avx2");
+#endif
+	return aKernel == KERNEL_SCALAR;
+}
+
+TigerHash::Kernel TigerHash::pickKernel() {
+	if(!hasKernel(KERNEL_AVX2))
+		return KERNEL_SCALAR;
+
+	// Gathers are slow on some CPUs with AVX2, so both kernels are timed once and the faster one is kept
+	const size_t n = 64;
+	vector<uint8_t> buf(n * 1024), res(n * BYTES);
+	uint32_t seed = 1;
+	for(auto& c: buf)
+		c = static_cast<uint8_t>((seed = seed * 1103515245 + 12345) >> 16);
+
+	typedef std::chrono::steady_clock Clock;
+	Clock::duration best[2] = { Clock::duration::max(), Clock::duration::max() };
+	for(int round = 0; round < 3; ++round) {
+		for(int k = KERNEL_SCALAR; k <= KERNEL_AVX2; ++k) {
+			Clock::time_point start = Clock::now();
+			hashLeaves(&buf[0], 1024, n, &res[0], static_cast<Kernel>(k));
+			best[k] = min(best[k], Clock::now() - start);
+		}
+	}
+	return best[KERNEL_AVX2] < best[KERNEL_SCALAR] ? KERNEL_AVX2 : KERNEL_SCALAR;
+}
+
+void TigerHash::hashLeaves(const uint8_t* data, size_t len, size_t count, uint8_t* out) {
+	static const Kernel kernel = pickKernel();
+	hashLeaves(data, len, count, out, kernel);
+}
+
+void TigerHash::hashLeaves(const uint8_t* data, size_t len, size_t count, uint8_t* out, Kernel aKernel) {
+	dcassert(len > 0 && len % BLOCK_SIZE == 0);
+	size_t i = 0;
+#ifdef TIGER_AVX2
+	if(aKernel == KERNEL_AVX2) {
+		for(; i + 4 <= count; i += 4)
+			hashLeaves4(data + i * len, len, out + i * BYTES);
+	}
+#else
+	dcassert(aKernel == KERNEL_SCALAR);
+#endif
+	uint8_t zero = 0;
+	for(; i < count; ++i) {
+		TigerHash h;
+		h.update(&zero, 1);
+		h.update(data + i * len, len);
+		memcpy(out + i * BYTES, h.finalize(), BYTES);
+	}
+}
+
 uint64_t TigerHash::table[4*256] = {
 	_ULL(0x02AAB17CF7E90C5E)   /*    0 */,    _ULL(0xAC424B03E243A8EC)   /*    1 */,
 		_ULL(0x72CD5BE30DD5FCD3)   /*    2 */,    _ULL(0x6D019B93F6F97F3A)   /*    3 */,
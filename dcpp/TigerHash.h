@@ -55,6 +55,25 @@ public:
 	uint8_t* finalize();
 
 	uint8_t* getResult() { return (uint8_t*) res; }
+
+	/** The ways hashLeaves() can go about its work */
+	enum Kernel {
+		/** One leaf after the other */
+		KERNEL_SCALAR,
+		/** Four leaves at once, one per 64-bit lane of the AVX2 registers */
+		KERNEL_AVX2
+	};
+
+	/**
+	 * Hashes count leaves of len bytes each (a multiple of 64) stored one after the other,
+	 * every leaf prefixed with a 0 byte as the tree hash wants it. The results are stored
+	 * one after the other in out. Uses the kernel that was faster on this CPU the first time.
+	 */
+	static void hashLeaves(const uint8_t* data, size_t len, size_t count, uint8_t* out);
+	/** hashLeaves() with a given kernel, which must be available */
+	static void hashLeaves(const uint8_t* data, size_t len, size_t count, uint8_t* out, Kernel aKernel);
+	/** @return Whether this build and CPU can run aKernel */
+	static bool hasKernel(Kernel aKernel);
 private:
 	enum { BLOCK_SIZE = 512/8 };
 	/** 512 bit blocks for the compress function */
@@ -67,6 +86,10 @@ private:
 	static uint64_t table[];
 
 	void tigerCompress(const uint64_t* data, uint64_t state[3]);
+	/** Time the available kernels on a few leaves; the faster one is used from then on */
+	static Kernel pickKernel();
+	/** KERNEL_AVX2 on four leaves */
+	static void hashLeaves4(const uint8_t* data, size_t len, uint8_t* out);
 };
 
 } // namespace dcpp
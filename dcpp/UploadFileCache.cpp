@@ -0,0 +1,144 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "stdinc.h"
+
+#include "UploadFileCache.h"
+
+#include "File.h"
+#include "SettingsManager.h"
+#include "TimerManager.h"
+
+namespace dcpp {
+
+// A handle is kept this long after its last segment; a downloader asks for the next one right away
+#define IDLE_TIME (30 * 1000)
+
+UploadFileCache::Stream::~Stream() {
+    cache.release(path, f, generation, size, left == 0);
+}
+
+size_t UploadFileCache::Stream::read(void* buf, size_t& len) {
+    len = static_cast<size_t>(min(static_cast<int64_t>(len), left));
+    if(len == 0)
+        return 0;
+    size_t x = f->read(buf, len);
+    left -= x;
+    return x;
+}
+
+int UploadFileCache::Stream::getFileHandle(int64_t& aMaxBytes) {
+    int fd = f->getFileHandle(aMaxBytes);
+    aMaxBytes = min(aMaxBytes, left);
+    return fd;
+}
+
+File* UploadFileCache::open(const string& aPath, int64_t aPos, uint64_t& aGeneration) {
+    {
+        FastLock l(cs);
+        aGeneration = generation;
+        auto r = index.equal_range(aPath);
+        auto found = r.second;
+        for(auto i = r.first; i != r.second; ++i) {
+            found = i;
+            if(i->second->next == aPos)
+                break;
+        }
+
+        if(found != r.second) {
+            File* f = found->second->f;
+            entries.erase(found->second);
+            index.erase(found);
+            return f;
+        }
+    }
+
+    return new File(aPath, File::READ, File::OPEN);
+}
+
+void UploadFileCache::release(const string& aPath, File* f, uint64_t aGeneration, int64_t aSegmentSize, bool aComplete) noexcept {
+    const size_t maxFiles = static_cast<size_t>(max(SETTING(UPLOAD_FILE_CACHE), 0));
+    if(maxFiles == 0) {
+        delete f;
+        return;
+    }
+
+    const int64_t next = f->getPos();
+    if(aComplete && BOOLSETTING(UPLOAD_READ_AHEAD)) {
+        f->prefetch(next, aSegmentSize);
+    }
+
+    FastLock l(cs);
+    if(aGeneration != generation) {
+        delete f;
+        return;
+    }
+    entries.push_front(Entry(aPath, f, next, GET_TICK()));
+    index.insert(make_pair(aPath, entries.begin()));
+
+    while(entries.size() > maxFiles) {
+        auto last = --entries.end();
+        auto r = index.equal_range(last->path);
+        for(auto i = r.first; i != r.second; ++i) {
+            if(i->second == last) {
+                index.erase(i);
+                break;
+            }
+        }
+        delete last->f;
+        entries.erase(last);
+    }
+}
+
+void UploadFileCache::clear() noexcept {
+    FastLock l(cs);
+    ++generation;
+    for(auto i = entries.begin(); i != entries.end(); ++i) {
+        delete i->f;
+    }
+    entries.clear();
+    index.clear();
+}
+
+void UploadFileCache::remove(const string& aPath) noexcept {
+    FastLock l(cs);
+    // the handles of aPath that are in use aren't known apart from the others
+    ++generation;
+    auto r = index.equal_range(aPath);
+    for(auto i = r.first; i != r.second; ++i) {
+        delete i->second->f;
+        entries.erase(i->second);
+    }
+    index.erase(r.first, r.second);
+}
+
+void UploadFileCache::expire(uint64_t aTick) noexcept {
+    FastLock l(cs);
+    while(!entries.empty() && entries.back().time + IDLE_TIME < aTick) {
+        auto last = --entries.end();
+        auto r = index.equal_range(last->path);
+        for(auto i = r.first; i != r.second; ++i) {
+            if(i->second == last) {
+                index.erase(i);
+                break;
+            }
+        }
+        delete last->f;
+        entries.erase(last);
+    }
+}
+
+} // namespace dcpp
@@ -0,0 +1,97 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "typedefs.h"
+#include "CriticalSection.h"
+#include "Streams.h"
+
+namespace dcpp {
+
+class File;
+
+/**
+ * Open files of the uploads that finished lately. Segmented downloaders ask for one chunk of a
+ * file after the other; the next chunk is read through the same handle, which the system has
+ * already read ahead for, instead of opening the file again.
+ */
+class UploadFileCache : private boost::noncopyable
+{
+public:
+    /** Reads a segment of a file taken from the cache and gives the file back when it's deleted */
+    class Stream : public InputStream {
+    public:
+        Stream(UploadFileCache& aCache, const string& aPath, File* aFile, uint64_t aGeneration, int64_t aSize) :
+            cache(aCache), path(aPath), f(aFile), generation(aGeneration), size(aSize), left(aSize) { }
+        virtual ~Stream();
+
+        size_t read(void* buf, size_t& len);
+        int getFileHandle(int64_t& aMaxBytes);
+        void skipped(size_t len) { left -= len; }
+
+    private:
+        UploadFileCache& cache;
+        string path;
+        File* f;
+        uint64_t generation;
+        int64_t size;
+        int64_t left;
+    };
+
+    UploadFileCache() : generation(0) { }
+    ~UploadFileCache() { clear(); }
+
+    /**
+     * @return A handle of aPath positioned at aPos, preferably one whose last segment ended there;
+     * the caller owns it until it's given back with release()
+     * @param aGeneration Receives what release() needs to tell whether the handle is still current
+     */
+    File* open(const string& aPath, int64_t aPos, uint64_t& aGeneration);
+    /**
+     * Take back the handle of an upload. When the segment was sent completely, the system is
+     * asked to read the one after it, which is likely to be requested next. A handle opened before
+     * the cache was last cleared is closed instead, as the file may have been replaced meanwhile.
+     */
+    void release(const string& aPath, File* f, uint64_t aGeneration, int64_t aSegmentSize, bool aComplete) noexcept;
+
+    /** Close all handles, or those of aPath; the ones in use are closed when they're given back */
+    void clear() noexcept;
+    void remove(const string& aPath) noexcept;
+    /** Close the handles that haven't been used for a while */
+    void expire(uint64_t aTick) noexcept;
+
+private:
+    struct Entry {
+        Entry(const string& aPath, File* aFile, int64_t aNext, uint64_t aTime) : path(aPath), f(aFile), next(aNext), time(aTime) { }
+
+        string path;
+        File* f;
+        /** Where the last segment read through the handle ended */
+        int64_t next;
+        uint64_t time;
+    };
+    /** Most recently used first */
+    typedef list<Entry> EntryList;
+
+    FastCriticalSection cs;
+    EntryList entries;
+    unordered_multimap<string, EntryList::iterator> index;
+    /** Raised by clear() and remove() */
+    uint64_t generation;
+};
+
+} // namespace dcpp
@@ -135,7 +135,9 @@ bool UploadManager::prepareFile(UserConnection& aSource, const string& aType, co
                         throw ShareException(msg);
                     }
                 }
-                File* f = new File(sourceFile, File::READ, File::OPEN);
+                // the file list is replaced when it's generated again, so it's always opened anew
+                uint64_t generation = 0;
+                File* f = userlist ? new File(sourceFile, File::READ, File::OPEN) : fileCache.open(sourceFile, aStartPos, generation);
 
                 start = aStartPos;
                 int64_t sz = f->getSize();
@@ -144,16 +146,23 @@ bool UploadManager::prepareFile(UserConnection& aSource, const string& aType, co
 
                 if((start + size) > sz) {
                     aSource.fileNotAvail();
-                    delete f;
+                    if(userlist)
+                        delete f;
+                    else
+                        fileCache.release(sourceFile, f, generation, size, false);
                     return false;
                 }
 
                 free = free || (sz <= (int64_t)(SETTING(SET_MINISLOT_SIZE) * 1024) );
 
                 f->setPos(start);
-                is = f;
-                if((start + size) < sz) {
-                    is = new LimitedInputStream<true>(is, size);
+                if(userlist) {
+                    is = f;
+                    if((start + size) < sz) {
+                        is = new LimitedInputStream<true>(is, size);
+                    }
+                } else {
+                    is = new UploadFileCache::Stream(fileCache, sourceFile, f, generation, size);
                 }
             }
             type = userlist ? Transfer::TYPE_FULL_LIST : Transfer::TYPE_FILE;
@@ -665,7 +674,9 @@ void UploadManager::on(AdcCommand::GFI, UserConnection* aSource, const AdcComman
 }
 
 // TimerManagerListener
-void UploadManager::on(TimerManagerListener::Second, uint64_t) noexcept {
+void UploadManager::on(TimerManagerListener::Second, uint64_t aTick) noexcept {
+    fileCache.expire(aTick);
+
     Lock l(cs);
     UploadList ticks;
 
@@ -31,6 +31,7 @@
 #include "Speaker.h"
 #include "PerFolderLimit.h"
 #include "SettingsManager.h"
+#include "UploadFileCache.h"
 
 namespace dcpp {
 
@@ -78,6 +79,10 @@ public:
     GETSET(uint64_t, lastGrant, LastGrant);
 
     void updateLimits() {limits.RenewList(NULL);}
+
+    /** Close the files kept open between uploads, all of them or those of aRealPath */
+    void clearFileCache() { fileCache.clear(); }
+    void clearFileCache(const string& aRealPath) { fileCache.remove(aRealPath); }
 private:
     int running;
     UploadList uploads;
@@ -89,6 +94,8 @@ private:
     CPerfolderLimit limits;
     int lastFreeSlots; /// amount of free slots at the previous minute
 
+    UploadFileCache fileCache;
+
     typedef pair<HintedUser, uint64_t> WaitingUser;
     typedef list<WaitingUser> WaitingUserList;
 
@@ -139,6 +139,8 @@ public:
 
     void setDataMode(int64_t aBytes = -1) { dcassert(socket); socket->setDataMode(aBytes); }
     void setLineMode(size_t rollback) { dcassert(socket); socket->setLineMode(rollback); }
+    void pauseRead() { dcassert(socket); socket->pauseRead(); }
+    void resumeRead() { dcassert(socket); socket->resumeRead(); }
 
     void connect(const string& aServer, uint16_t aPort, uint16_t localPort, const BufferedSocket::NatRoles natRole) throw(SocketException, ThreadException);
     void accept(const Socket& aServer) throw(SocketException, ThreadException);
@@ -0,0 +1,134 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "stdinc.h"
+
+#include "WriteBehindOutputStream.h"
+
+#include "ThreadPool.h"
+
+namespace dcpp {
+
+WriteBehindOutputStream::WriteBehindOutputStream(OutputStream* aStream, ThreadPool& aPool, size_t aLimit, const Throttle& aThrottle) :
+    s(aStream), pool(aPool), limit(aLimit), throttle(aThrottle), queued(0), written(0), busy(false), paused(false), waiting(false)
+{
+}
+
+WriteBehindOutputStream::~WriteBehindOutputStream() {
+    waitIdle();
+    delete s;
+}
+
+size_t WriteBehindOutputStream::write(const void* buf, size_t len) {
+    Lock l(cs);
+    if(!error.empty())
+        throw FileException(error);
+
+    const uint8_t* b = (const uint8_t*)buf;
+    if(!queue.empty() && queue.back().size() + len <= PIECE_SIZE) {
+        queue.back().insert(queue.back().end(), b, b + len);
+    } else {
+        queue.push_back(ByteVector(b, b + len));
+    }
+    queued += len;
+
+    if(queued > limit && !paused && throttle) {
+        paused = true;
+        throttle(true);
+    }
+
+    if(!busy) {
+        busy = true;
+        pool.add([this] { run(); });
+    }
+    return len;
+}
+
+size_t WriteBehindOutputStream::flush() {
+    waitIdle();
+    {
+        Lock l(cs);
+        if(!error.empty())
+            throw FileException(error);
+    }
+    return s->flush();
+}
+
+void WriteBehindOutputStream::waitIdle() {
+    {
+        Lock l(cs);
+        if(!busy)
+            return;
+        waiting = true;
+    }
+    idle.wait();
+}
+
+void WriteBehindOutputStream::run() noexcept {
+    ByteVector piece;
+    {
+        Lock l(cs);
+        if(error.empty() && !queue.empty()) {
+            piece.swap(queue.front());
+            queue.pop_front();
+        }
+    }
+
+    if(!piece.empty()) {
+        try {
+            s->write(&piece[0], piece.size());
+            Lock l(cs);
+            written += piece.size();
+        } catch(const Exception& e) {
+            Lock l(cs);
+            error = e.getError();
+        }
+    }
+
+    bool wake = false;
+    {
+        Lock l(cs);
+        queued -= piece.size();
+
+        if(!error.empty()) {
+            // nothing after the failed write may reach the file
+            queue.clear();
+            queued = 0;
+        }
+
+        if(paused && (queued <= limit / 2 || !error.empty())) {
+            // an error is thrown by the next write, so let it come
+            paused = false;
+            if(throttle)
+                throttle(false);
+        }
+
+        if(queue.empty()) {
+            busy = false;
+            wake = waiting;
+            waiting = false;
+        } else {
+            // one piece per turn: a download that keeps its queue full mustn't keep a writer from the others
+            pool.add([this] { run(); });
+        }
+    }
+
+    // the waiter may delete the stream as soon as it wakes up
+    if(wake)
+        idle.signal();
+}
+
+} // namespace dcpp
@@ -0,0 +1,79 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <functional>
+
+#include "typedefs.h"
+#include "CriticalSection.h"
+#include "Semaphore.h"
+#include "Streams.h"
+
+namespace dcpp {
+
+class ThreadPool;
+
+/**
+ * Hands what is written to it over to a thread of a pool, which writes it to the stream below;
+ * for downloads this moves the tree check and the disk writes off the socket thread. The data is
+ * written in order, by one pool thread at a time and a piece per task, so that the streams
+ * sharing a pool take turns. An error of the stream below is thrown by the next write() or
+ * flush(). Owns the stream below.
+ */
+class WriteBehindOutputStream : public OutputStream {
+public:
+    using OutputStream::write;
+
+    /** Called with true when more than the limit is queued and with false once half of it is written */
+    typedef std::function<void (bool)> Throttle;
+
+    WriteBehindOutputStream(OutputStream* aStream, ThreadPool& aPool, size_t aLimit, const Throttle& aThrottle);
+    /** Waits until everything queued is written */
+    virtual ~WriteBehindOutputStream();
+
+    virtual size_t write(const void* buf, size_t len);
+    /** Waits until everything queued is written, then flushes the stream below */
+    virtual size_t flush();
+
+    /** @return Bytes the stream below has taken without an error */
+    int64_t getWritten() const { Lock l(cs); return written; }
+
+private:
+    /** Queued data is kept in pieces of about this size */
+    enum { PIECE_SIZE = 256 * 1024 };
+
+    void run() noexcept;
+    void waitIdle();
+
+    OutputStream* s;
+    ThreadPool& pool;
+    const size_t limit;
+    Throttle throttle;
+
+    mutable CriticalSection cs;
+    deque<ByteVector> queue;
+    size_t queued;
+    int64_t written;
+    string error;
+    /** A pool thread is writing or about to */
+    bool busy;
+    bool paused;
+    bool waiting;
+    Semaphore idle;
+};
+
+} // namespace dcpp
@@ -70,6 +70,8 @@ class InputStream;
 
 class LogManager;
 
+class MultiStringSearch;
+
 class OnlineUser;
 typedef OnlineUser* OnlineUserPtr;
 
@@ -1326,10 +1326,10 @@ void ServerThread::lsDirInList(DirectoryListing::Directory *dir, unordered_map<s
         map["Size"] = Util::toString(file->getSize());
         map["Size preformatted"] = Util::formatBytes(file->getSize());
         map["TTH"] = file->getTTH().toBase32();
-        map["Bitrate"] = file->mediaInfo.bitrate ? (Util::toString(file->mediaInfo.bitrate)) : Util::emptyString;
-        map["Resolution"] = !file->mediaInfo.video_info.empty() ? file->mediaInfo.resolution : Util::emptyString;
-        map["Video"] = file->mediaInfo.video_info;
-        map["Audio"] = file->mediaInfo.audio_info;
+        map["Bitrate"] = file->getMediaInfo().bitrate ? (Util::toString(file->getMediaInfo().bitrate)) : Util::emptyString;
+        map["Resolution"] = !file->getMediaInfo().video_info.empty() ? file->getMediaInfo().resolution : Util::emptyString;
+        map["Video"] = file->getMediaInfo().video_info;
+        map["Audio"] = file->getMediaInfo().audio_info;
         map["Downloaded"] = Util::toString(file->getHit());
         map["Shared"] = Util::formatTime("%Y-%m-%d %H:%M", file->getTS());
         ret[file->getName()] = map;
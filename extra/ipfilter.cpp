@@ -140,13 +140,52 @@ bool ipfilter::ParseString(string exp, uint32_t &ip, uint32_t &mask, eTableActio
     return true;
 }
 
+bool ipfilter::ParseRange(string exp, uint32_t &first, uint32_t &last, eTableAction &act){
+    act = etaACPT;
+    if (!exp.empty() && exp[0] == '!'){
+        act = etaDROP;
+        exp.erase(0, 1);
+    }
+
+    unsigned int a1=0,a2=0,a3=0,a4=0,b1=0,b2=0,b3=0,b4=0;
+    if (sscanf(exp.c_str(),"%3u.%3u.%3u.%3u - %3u.%3u.%3u.%3u",&a1,&a2,&a3,&a4,&b1,&b2,&b3,&b4) != 8 ||
+        a1 > 255 || a2 > 255 || a3 > 255 || a4 > 255 || b1 > 255 || b2 > 255 || b3 > 255 || b4 > 255)
+        return false;
+
+    first = make_ip(a1,a2,a3,a4);
+    last = make_ip(b1,b2,b3,b4);
+    return first <= last;
+}
+
 void ipfilter::addToRules(string exp, eDIRECTION direction) {
     uint32_t exp_ip, exp_mask;
     eTableAction act;
 
+    if (exp.find('-') != string::npos) {
+        uint32_t first, last;
+        if (!ParseRange(exp, first, last, act))
+            return;
+
+        // largest aligned block that fits, until the range is covered
+        for (uint64_t ip = first; ip <= last; ) {
+            uint32_t bits = 0;
+            while (bits < 32 && (ip & ((uint64_t(1) << (bits + 1)) - 1)) == 0 && ip + (uint64_t(1) << (bits + 1)) - 1 <= last)
+                bits++;
+            addRule((uint32_t)ip, MaskForBits(32 - bits), act, direction);
+            ip += uint64_t(1) << bits;
+        }
+        return;
+    }
+
     if (!ParseString(exp, exp_ip, exp_mask, act))
         return;
 
+    addRule(exp_ip, exp_mask, act, direction);
+}
+
+void ipfilter::addRule(uint32_t exp_ip, uint32_t exp_mask, eTableAction act, eDIRECTION direction) {
+    Lock l(cs);
+
     IPFilterElem *el = NULL;
 
     if (list_ip.find(exp_ip) != list_ip.end()) {
@@ -162,7 +201,10 @@ void ipfilter::addToRules(string exp, eDIRECTION direction) {
 #ifdef _DEBUG_IPFILTER
                 fprintf(stdout,"\tChange direction of IP\n");fflush(stdout);
 #endif
-                el->direction = eDIRECTION_BOTH;
+                if (el->direction != eDIRECTION_BOTH){
+                    el->direction = eDIRECTION_BOTH;
+                    rebuild();
+                }
 
                 return;
             }
@@ -193,9 +235,11 @@ void ipfilter::addToRules(string exp, eDIRECTION direction) {
 
     list_ip.insert(pair<uint32_t, IPFilterElem*>(el->ip,el));
     rules.push_back(el);
+    compile(el);
 }
 
 void ipfilter::remFromRules(string exp, eTableAction act) {
+    Lock l(cs);
 
     string str_ip;
     uint32_t exp_ip;
@@ -234,18 +278,18 @@ void ipfilter::remFromRules(string exp, eTableAction act) {
 #endif
             list_ip.erase(it);
             rules.erase( remove( rules.begin(), rules.end(), el ), rules.end());
+            delete el;
+            rebuild();
 #ifdef _DEBUG_IPFILTER
         printf("element is deleted.\n");
 #endif
         }
-#ifdef _DEBUG_IPFILTER
-        printf("delete *el\n");
-#endif
-        delete el;
     }
 }
 
 void ipfilter::changeRuleDirection(string exp, eDIRECTION direction, eTableAction act) {
+    Lock l(cs);
+
     string str_ip;
     size_t pos = exp.find("/");
 #ifdef _DEBUG_IPFILTER
@@ -262,8 +306,9 @@ void ipfilter::changeRuleDirection(string exp, eDIRECTION direction, eTableActio
     if (it != list_ip.end() && it->first == exp_ip) {
         IPFilterElem *el = it->second;
 
-        if (el->action == act){
+        if (el->action == act && el->direction != direction){
             el->direction = direction;
+            rebuild();
         }
     }
 }
@@ -273,54 +318,89 @@ bool ipfilter::OK(const string &exp, eDIRECTION direction){
     fprintf(stdout,"ipfilter::OK(%s,%i)\n",exp.c_str(),(int)direction);fflush(stdout);
 #endif
     string str_src(exp);
-    size_t pos = str_src.find(":") != string::npos;
-    if (pos > 0) {
-        str_src = str_src.erase(pos);
+    size_t pos = str_src.find(':');
+    if (pos != string::npos) {
+        str_src.erase(pos);
         //XXX.XXX.XXX.XXX:PORT -> XXX.XXX.XXX.XXX
     }
 
     uint32_t src = ipfilter::StringToUint32(str_src);
-    IPFilterElem *el;
 
-    for (unsigned i = 0; i < rules.size(); i++){
-        el = rules.at(i);
+    Lock l(cs);
 
-#ifdef _DEBUG_IPFILTER
-    fprintf(stdout,"\tel->ip & el->mask == %x\n"
-           "\tsrc    & el->mask == %x\n",
-           (el->ip & el->mask),
-           (src    & el->mask)
-          );fflush(stdout);
-#endif
+    const SpanMap &m = spans[direction == eDIRECTION_OUT ? 1 : 0];
+    SpanMap::const_iterator it = m.upper_bound(src);
+    if (it == m.begin())
+        return true;
+    --it;
+
+    if (src > it->second.last)
+        return true;//no rule covers this address
 
-        if ((el->ip & el->mask) == (src & el->mask)){//Exact match
-            bool exact_direction = ((el->direction == direction) || (el->direction == eDIRECTION_BOTH));
-#ifdef _DEBUG_IPFILTER
-            fprintf(stdout,"\tFound match... ");fflush(stdout);
-#endif
-            if      ((el->action == etaDROP) && exact_direction){
-#ifdef _DEBUG_IPFILTER
-                fprintf(stdout,"DROP.\n");fflush(stdout);
-#endif
-                return false;
-            }
-            else if ((el->action == etaACPT) && exact_direction){
-#ifdef _DEBUG_IPFILTER
-                fprintf(stdout,"ACCEPT.\n");fflush(stdout);
-#endif
-                return true;
-            }
 #ifdef _DEBUG_IPFILTER
-            else
-                fprintf(stdout,"IGNORE.\n");fflush(stdout);
+    fprintf(stdout,"\tFound match... %s.\n", it->second.drop ? "DROP" : "ACCEPT");fflush(stdout);
 #endif
+    return !it->second.drop;
+}
+
+void ipfilter::compile(const IPFilterElem *el) {
+    uint32_t first = el->ip & el->mask;
+    uint32_t last = first | ~el->mask;
+    bool drop = el->action == etaDROP;
+
+    if (el->direction != eDIRECTION_OUT)
+        paint(spans[0], first, last, drop);
+    if (el->direction != eDIRECTION_IN)
+        paint(spans[1], first, last, drop);
+}
+
+void ipfilter::rebuild() {
+    spans[0].clear();
+    spans[1].clear();
+
+    for (unsigned i = 0; i < rules.size(); i++)
+        compile(rules.at(i));
+}
+
+void ipfilter::paint(SpanMap &spans, uint32_t first, uint32_t last, bool drop) {
+    // skip the part already covered by the span starting before first
+    SpanMap::iterator it = spans.upper_bound(first);
+    if (it != spans.begin()) {
+        SpanMap::iterator prev = it;
+        --prev;
+        if (prev->second.last >= first) {
+            if (prev->second.last >= last)
+                return;
+            first = prev->second.last + 1;
+            it = spans.lower_bound(first);
         }
     }
 
-    return true;
+    for (;;) {
+        bool tail = (it == spans.end() || it->first > last);
+
+        if (tail || it->first > first) {
+            uint32_t end = tail ? last : it->first - 1;
+            SpanMap::iterator prev = it;
+            if (it != spans.begin() && (--prev)->second.last + 1 == first && prev->second.drop == drop)
+                prev->second.last = end;//adjacent with the same verdict, grow it
+            else {
+                Span span = { end, drop };
+                spans.insert(it, make_pair(first, span));
+            }
+        }
+
+        if (tail || it->second.last >= last)
+            return;
+
+        first = it->second.last + 1;
+        ++it;
+    }
 }
 
 void ipfilter::step(uint32_t ip, eTableAction act, bool down){
+    Lock l(cs);
+
     IPFilterElem *el = NULL;
 
     QIPHash::const_iterator it = list_ip.find(ip);
@@ -375,6 +455,12 @@ void ipfilter::step(uint32_t ip, eTableAction act, bool down){
 
     rules[index]= old_el;
     rules[new_index]= el;
+
+    // the order only matters where both rules cover the same addresses in the same direction
+    uint32_t common = el->mask & old_el->mask;
+    if (el->action != old_el->action && (el->ip & common) == (old_el->ip & common) &&
+        (el->direction == old_el->direction || el->direction == eDIRECTION_BOTH || old_el->direction == eDIRECTION_BOTH))
+        rebuild();
 #ifdef _DEBUG_IPFILTER
     fprintf(stdout,"\tElement has been moved at new_index:\n");
     fprintf(stdout,"\t\tMASK: 0x%x\n"
@@ -504,11 +590,46 @@ void ipfilter::importFrom(string path) {
 
         clearRules();
         loadList();
+    } else if (loadP2PList(path) > 0) {
+        saveList();
     } else {
         fprintf(stdout,"Invalid signature.");fflush(stdout);
     }
 }
 
+size_t ipfilter::loadP2PList(const string& path, eDIRECTION direction) {
+    string f;
+    try {
+        f = File(path, File::READ, File::OPEN).read();
+    } catch (const FileException&) {
+        return 0;
+    }
+
+    size_t ranges = 0;
+    StringTokenizer<string> st(f, "\n");
+    for (StringIter i = st.getTokens().begin(); i != st.getTokens().end(); ++i) {
+        const string &line = *i;
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        //Description:first-last, the description itself may contain ':'
+        size_t pos = line.rfind(':');
+        if (pos == string::npos)
+            continue;
+
+        uint32_t first, last;
+        eTableAction act;
+        string range = line.substr(pos + 1);
+        if (!ParseRange(range, first, last, act))
+            continue;
+
+        addToRules("!" + range, direction);
+        ranges++;
+    }
+
+    return ranges;
+}
+
 const QIPList &ipfilter::getRules() {
     return rules;
 }
@@ -518,8 +639,15 @@ const QIPHash &ipfilter::getHash() {
 }
 
 void ipfilter::clearRules() {
+    Lock l(cs);
+
+    for (unsigned i = 0; i < rules.size(); i++)
+        delete rules.at(i);
+
     list_ip.clear();
     rules.clear();
+    spans[0].clear();
+    spans[1].clear();
 }
 
 void ipfilter::load() {
@@ -10,8 +10,10 @@
 #pragma once
 
 #include <string>
+#include <map>
 #include "dcpp/stdinc.h"
 #include "dcpp/Singleton.h"
+#include "dcpp/CriticalSection.h"
 
 enum eDIRECTION {
     eDIRECTION_IN = 0,
@@ -51,6 +53,8 @@ public:
     static uint32_t MaskForBits(uint32_t);
     /** */
     static bool ParseString(std::string, uint32_t&, uint32_t&, eTableAction&);
+    /** [!]first-last address range */
+    static bool ParseRange(std::string, uint32_t&, uint32_t&, eTableAction&);
 
     void load();
     void shutdown();
@@ -64,7 +68,7 @@ public:
     /** */
     const QIPHash &getHash ();
 
-    /** */
+    /** exp is [!]ip[/bits] or [!]first-last; ranges are split into ip/bits rules */
     void addToRules(std::string exp, eDIRECTION direction);
     /** */
     void remFromRules(std::string exp, eTableAction);
@@ -85,6 +89,8 @@ public:
     void exportTo(std::string path);
     /** */
     void importFrom(std::string path);
+    /** Add the ranges of a PeerGuardian (P2P) list ("name:first-last" lines) as drop rules; returns how many */
+    size_t loadP2PList(const std::string& path, eDIRECTION direction = eDIRECTION_BOTH);
 
 private:
     /** */
@@ -94,8 +100,29 @@ private:
 
     /** */
     void step(uint32_t, eTableAction, bool down = true);
+    /** */
+    void addRule(uint32_t ip, uint32_t mask, eTableAction act, eDIRECTION direction);
+
+    /** Addresses up to last starting at the key, and whether the first rule matching them drops them */
+    struct Span {
+        uint32_t last;
+        bool drop;
+    };
+    typedef std::map<uint32_t, Span> SpanMap;
+
+    /** Add a rule to the lookup tables behind all others */
+    void compile(const IPFilterElem* el);
+    /** */
+    void rebuild();
+    /** Cover the parts of first..last that no earlier rule covers */
+    static void paint(SpanMap& spans, uint32_t first, uint32_t last, bool drop);
+
     /** */
     QIPHash list_ip;
     /** */
     QIPList rules;
+    /** Rules compiled per direction (eDIRECTION_IN, eDIRECTION_OUT), so that OK needn't walk them */
+    SpanMap spans[2];
+    /** */
+    dcpp::CriticalSection cs;
 };